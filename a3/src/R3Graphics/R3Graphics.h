@@ -10,6 +10,8 @@
 class R3Scene;
 class R3SceneNode;
 class R3SceneElement;
+struct R3SceneInstance;
+struct R3SceneTriangles;
 
 
 
@@ -34,7 +34,10 @@ R3Scene(void)
     brdfs(),
     textures(),
     ambient(0, 0, 0),
-    background(0, 0, 0)
+    background(0, 0, 0),
+    instances(),
+    bvh(NULL),
+    triangles(NULL)
 {
   // Create root node
   root = new R3SceneNode(this);
@@ -49,6 +52,9 @@ R3Scene(void)
 R3Scene::
 ~R3Scene(void)
 {
+  // Delete acceleration structure
+  InvalidateBvh();
+
   // Delete everything
   // ???
 }
@@ -442,6 +448,9 @@ SubdivideTriangles(RNLength max_edge_length)
 {
   // Subdivide triangles until none is longer than max edge length
   R3SceneSubdivideTriangles(this, root, max_edge_length);
+
+  // Remember that should update acceleration structure
+  InvalidateBvh();
 }
 
 
@@ -468,14 +477,603 @@ FindClosest(const R3Point& point,
 
 
 
+struct R3SceneInstance {
+  R3SceneNode *node;
+  R3SceneElement *element;
+  R3Shape *shape;
+  R3Affine transformation;
+  RNBoolean is_identity;
+  RNBoolean is_compiled;        // triangle or triangle array flattened into R3SceneTriangles
+};
+
+
+
+struct R3SceneTriangles {
+  // Triangles of all triangle and triangle array shapes of a scene, with
+  // node transformations baked in, stored as a structure of arrays in
+  // single precision so that ray queries stream through the coordinates
+  // they test rather than chasing pointers to vertices
+  R3SceneTriangles(int ntriangles);
+  ~R3SceneTriangles(void);
+  int ntriangles;
+  float *vertices[3][3];        // vertices[k][dim][i] is coordinate dim of vertex k of triangle i
+  float *normals[3];            // normals[dim][i] is coordinate dim of unit normal of triangle i
+  int *instances;               // instance (node, element and so material) of triangle i
+};
+
+
+
+R3SceneTriangles::
+R3SceneTriangles(int ntriangles)
+  : ntriangles(ntriangles)
+{
+  // Allocate arrays
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    for (int k = 0; k < 3; k++) vertices[k][dim] = new float [ ntriangles ];
+    normals[dim] = new float [ ntriangles ];
+  }
+  instances = new int [ ntriangles ];
+}
+
+
+
+R3SceneTriangles::
+~R3SceneTriangles(void)
+{
+  // Delete arrays
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    for (int k = 0; k < 3; k++) delete [] vertices[k][dim];
+    delete [] normals[dim];
+  }
+  delete [] instances;
+}
+
+
+
+struct R3SceneWatertightRay {
+  // Ray set up for the watertight ray-triangle test of Woop et al. (2013):
+  // vertices are translated to the ray origin and sheared so that the ray
+  // runs along the axis kz of its largest component, which reduces the
+  // test to the signs of three 2D edge functions.  A vertex is mapped the
+  // same way by every triangle that shares it, so both triangles of an
+  // edge see the same edge function, and single precision does not let
+  // rays slip between them.
+  R3SceneWatertightRay(void) {};
+  R3SceneWatertightRay(const R3Ray& ray);
+  R3Point origin;
+  int kx, ky, kz;
+  float shear[3];
+};
+
+
+
+R3SceneWatertightRay::
+R3SceneWatertightRay(const R3Ray& ray)
+  : origin(ray.Start())
+{
+  // Permute axes so that kz is the largest dimension of the ray vector,
+  // swapping the others if it points down kz to keep triangle winding
+  const R3Vector& vector = ray.Vector();
+  kz = vector.MaxDimension();
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+  if (vector[kz] < 0) { int swap = kx; kx = ky; ky = swap; }
+
+  // Compute shear taking the ray vector to (0, 0, 1)
+  shear[0] = (float) (vector[kx] / vector[kz]);
+  shear[1] = (float) (vector[ky] / vector[kz]);
+  shear[2] = (float) (1.0 / vector[kz]);
+}
+
+
+
+static RNBoolean
+R3SceneIntersectsTriangle(const R3SceneTriangles *triangles, int index,
+  const R3SceneWatertightRay& ray, RNScalar min_t, RNScalar max_t, RNScalar *hit_t)
+{
+  // Translate vertices to ray origin and shear them
+  float x[3], y[3], z[3];
+  for (int k = 0; k < 3; k++) {
+    float dx = (float) (triangles->vertices[k][ray.kx][index] - ray.origin[ray.kx]);
+    float dy = (float) (triangles->vertices[k][ray.ky][index] - ray.origin[ray.ky]);
+    float dz = (float) (triangles->vertices[k][ray.kz][index] - ray.origin[ray.kz]);
+    x[k] = dx - ray.shear[0] * dz;
+    y[k] = dy - ray.shear[1] * dz;
+    z[k] = ray.shear[2] * dz;
+  }
+
+  // Compute edge functions, in double precision if any is zero (the ray
+  // passes through an edge or vertex, or close enough to round to it)
+  float u = x[2] * y[1] - y[2] * x[1];
+  float v = x[0] * y[2] - y[0] * x[2];
+  float w = x[1] * y[0] - y[1] * x[0];
+  if ((u == 0) || (v == 0) || (w == 0)) {
+    u = (float) ((double) x[2] * y[1] - (double) y[2] * x[1]);
+    v = (float) ((double) x[0] * y[2] - (double) y[0] * x[2]);
+    w = (float) ((double) x[1] * y[0] - (double) y[1] * x[0]);
+  }
+
+  // Check that ray passes inside all edges (or outside all of them, if it
+  // sees the back of the triangle)
+  if (((u < 0) || (v < 0) || (w < 0)) && ((u > 0) || (v > 0) || (w > 0))) return FALSE;
+  float det = u + v + w;
+  if (det == 0) return FALSE;
+
+  // Check interval, scaling it by the determinant rather than dividing
+  RNScalar t_det = u * z[0] + v * z[1] + w * z[2];
+  RNScalar abs_det = det;
+  if (det < 0) { t_det = -t_det; abs_det = -abs_det; }
+  if ((t_det < min_t * abs_det) || (t_det > max_t * abs_det)) return FALSE;
+
+  // Return parametric value of hit
+  *hit_t = t_det / abs_det;
+  return TRUE;
+}
+
+
+
+static R3Vector
+R3SceneTriangleNormal(const R3SceneTriangles *triangles, int index)
+{
+  // Return normal of triangle
+  return R3Vector(triangles->normals[RN_X][index], triangles->normals[RN_Y][index], triangles->normals[RN_Z][index]);
+}
+
+
+
+static RNBoolean
+R3SceneIntersectsInstance(const R3SceneInstance *instance, const R3Ray& ray,
+  R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t)
+{
+  // Intersect shape in world coordinates
+  if (instance->is_identity) return instance->shape->Intersects(ray, hit_point, hit_normal, hit_t);
+
+  // Apply inverse transformation to ray
+  R3Ray shape_ray = ray;
+  shape_ray.InverseTransform(instance->transformation);
+
+  // Compute shape units per world unit along ray
+  R3Vector v(ray.Vector());
+  instance->transformation.ApplyInverse(v);
+  RNScalar scale = v.Length();
+  if (RNIsNegativeOrZero(scale)) return FALSE;
+
+  // Intersect shape in its own coordinate system
+  if (!instance->shape->Intersects(shape_ray, hit_point, hit_normal, hit_t)) return FALSE;
+  *hit_t /= scale;
+
+  // Transform hit point and normal into world coordinates
+  hit_point->Transform(instance->transformation);
+  hit_normal->Transform(instance->transformation);
+  hit_normal->Normalize();
+
+  // Return success
+  return TRUE;
+}
+
+
+
+static RNBoolean
+R3SceneOccludedByInstance(const R3SceneInstance *instance, const R3Ray& ray,
+  RNScalar min_t, RNScalar max_t)
+{
+  // Check shape in world coordinates
+  if (instance->is_identity) return instance->shape->Occluded(ray, min_t, max_t);
+
+  // Apply inverse transformation to ray and interval
+  R3Ray shape_ray = ray;
+  shape_ray.InverseTransform(instance->transformation);
+  R3Vector v(ray.Vector());
+  instance->transformation.ApplyInverse(v);
+  RNScalar scale = v.Length();
+  if (RNIsNegativeOrZero(scale)) return FALSE;
+  return instance->shape->Occluded(shape_ray, scale * min_t, scale * max_t);
+}
+
+
+
+struct R3SceneIntersector {
+  // Intersector for R3Bvh traversal over compiled triangles (the first
+  // primitives) and the other scene instances
+  R3SceneIntersector(const RNArray<R3SceneInstance *>& instances, const R3SceneTriangles *triangles, const R3Ray& ray)
+    : instances(instances), triangles(triangles), watertight_ray(ray), hit_instance(NULL), hit_triangle(-1) {};
+  RNBoolean operator()(int index, const R3Ray& ray, RNScalar min_t, RNScalar& max_t) {
+    // Intersect triangle
+    if (index < triangles->ntriangles) {
+      RNScalar t;
+      if (!R3SceneIntersectsTriangle(triangles, index, watertight_ray, min_t, max_t, &t)) return FALSE;
+      hit_instance = instances.Kth(triangles->instances[index]);
+      hit_triangle = index;
+      max_t = t;
+      return TRUE;
+    }
+
+    // Intersect shape
+    R3SceneInstance *instance = instances.Kth(index - triangles->ntriangles);
+    R3Point point;
+    R3Vector normal;
+    RNScalar t;
+    if (!R3SceneIntersectsInstance(instance, ray, &point, &normal, &t)) return FALSE;
+    if ((t < min_t) || (t > max_t)) return FALSE;
+
+    // Remember closest hit
+    hit_instance = instance;
+    hit_triangle = -1;
+    hit_point = point;
+    hit_normal = normal;
+    max_t = t;
+    return TRUE;
+  }
+  const RNArray<R3SceneInstance *>& instances;
+  const R3SceneTriangles *triangles;
+  R3SceneWatertightRay watertight_ray;
+  R3SceneInstance *hit_instance;
+  int hit_triangle;
+  R3Point hit_point;
+  R3Vector hit_normal;
+};
+
+
+
 RNBoolean R3Scene::
 Intersects(const R3Ray& ray,
   R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape,
   R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t,
   RNScalar min_t, RNScalar max_t) const
 {
-  // Intersect with root node
-  return root->Intersects(ray, hit_node, hit_element, hit_shape, hit_point, hit_normal, hit_t, min_t, max_t);
+  // Intersect with root node if there is no acceleration structure
+  if (!bvh) return root->Intersects(ray, hit_node, hit_element, hit_shape, hit_point, hit_normal, hit_t, min_t, max_t);
+
+  // Find closest shape intersection
+  R3SceneIntersector intersector(instances, triangles, ray);
+  RNScalar closest_t = max_t;
+  if (!bvh->Intersects(ray, intersector, min_t, closest_t)) return FALSE;
+
+  // Return hit information
+  R3SceneInstance *instance = intersector.hit_instance;
+  if (hit_node) *hit_node = instance->node;
+  if (hit_element) *hit_element = instance->element;
+  if (hit_shape) *hit_shape = instance->shape;
+  if (intersector.hit_triangle >= 0) {
+    if (hit_point) *hit_point = ray.Point(closest_t);
+    if (hit_normal) *hit_normal = R3SceneTriangleNormal(triangles, intersector.hit_triangle);
+  }
+  else {
+    if (hit_point) *hit_point = intersector.hit_point;
+    if (hit_normal) *hit_normal = intersector.hit_normal;
+  }
+  if (hit_t) *hit_t = closest_t;
+
+  // Return success
+  return TRUE;
+}
+
+
+
+struct R3SceneOccluder {
+  // Any-hit intersector for R3Bvh traversal over compiled triangles and
+  // the other scene instances
+  R3SceneOccluder(const RNArray<R3SceneInstance *>& instances, const R3SceneTriangles *triangles, const R3Ray& ray)
+    : instances(instances), triangles(triangles), watertight_ray(ray) {};
+  RNBoolean operator()(int index, const R3Ray& ray, RNScalar min_t, RNScalar& max_t) {
+    RNScalar t;
+    if (index < triangles->ntriangles) return R3SceneIntersectsTriangle(triangles, index, watertight_ray, min_t, max_t, &t);
+    return R3SceneOccludedByInstance(instances.Kth(index - triangles->ntriangles), ray, min_t, max_t);
+  }
+  const RNArray<R3SceneInstance *>& instances;
+  const R3SceneTriangles *triangles;
+  R3SceneWatertightRay watertight_ray;
+};
+
+
+
+RNBoolean R3Scene::
+Occluded(const R3Ray& ray, RNScalar max_t) const
+{
+  // Check root node if there is no acceleration structure
+  if (!bvh) return root->Occluded(ray, 0.0, max_t);
+
+  // Find any shape intersection in [0, max_t]
+  R3SceneOccluder occluder(instances, triangles, ray);
+  return bvh->Intersects(ray, occluder, 0.0, max_t, TRUE);
+}
+
+
+
+struct R3ScenePacketIntersector {
+  // Closest (or any) hit intersector for R3Bvh packet traversal over
+  // compiled triangles, which are tested one ray at a time with the
+  // watertight test, and the other scene instances
+  R3ScenePacketIntersector(const RNArray<R3SceneInstance *>& instances, const R3SceneTriangles *triangles,
+    const R3RayPacket& packet, RNBoolean any_hit)
+    : instances(instances), triangles(triangles), any_hit(any_hit) {
+    for (int i = 0; i < packet.nrays; i++) watertight_rays[i] = R3SceneWatertightRay(packet.rays[i]);
+  };
+  int operator()(int index, R3RayPacket& packet, int mask) {
+    // Intersect triangle with each ray
+    int hits = 0;
+    if (index < triangles->ntriangles) {
+      for (int i = 0; mask; i++, mask >>= 1) {
+        if (!(mask & 1)) continue;
+        RNScalar t;
+        if (!R3SceneIntersectsTriangle(triangles, index, watertight_rays[i],
+          packet.exact_min_t, packet.exact_max_t[i], &t)) continue;
+        if (!any_hit) {
+          hit_instances[i] = instances.Kth(triangles->instances[index]);
+          hit_triangles[i] = index;
+          packet.SetMaxT(i, t);
+        }
+        hits |= 1 << i;
+      }
+      return hits;
+    }
+
+    // Intersect shape with each ray, as the scalar intersectors do
+    R3SceneInstance *instance = instances.Kth(index - triangles->ntriangles);
+    for (int i = 0; mask; i++, mask >>= 1) {
+      if (!(mask & 1)) continue;
+      if (any_hit) {
+        if (!R3SceneOccludedByInstance(instance, packet.rays[i], packet.exact_min_t, packet.exact_max_t[i])) continue;
+      }
+      else {
+        R3Point point;
+        R3Vector normal;
+        RNScalar t;
+        if (!R3SceneIntersectsInstance(instance, packet.rays[i], &point, &normal, &t)) continue;
+        if ((t < packet.exact_min_t) || (t > packet.exact_max_t[i])) continue;
+        hit_instances[i] = instance;
+        hit_triangles[i] = -1;
+        hit_points[i] = point;
+        hit_normals[i] = normal;
+        packet.SetMaxT(i, t);
+      }
+      hits |= 1 << i;
+    }
+
+    // Return rays that hit shape
+    return hits;
+  }
+  const RNArray<R3SceneInstance *>& instances;
+  const R3SceneTriangles *triangles;
+  RNBoolean any_hit;
+  R3SceneWatertightRay watertight_rays[R3_RAY_PACKET_SIZE];
+  R3SceneInstance *hit_instances[R3_RAY_PACKET_SIZE];
+  int hit_triangles[R3_RAY_PACKET_SIZE];
+  R3Point hit_points[R3_RAY_PACKET_SIZE];
+  R3Vector hit_normals[R3_RAY_PACKET_SIZE];
+};
+
+
+
+int R3Scene::
+Intersects(const R3Ray *rays, int nrays,
+  R3SceneNode **hit_nodes, R3SceneElement **hit_elements, R3Shape **hit_shapes,
+  R3Point *hit_points, R3Vector *hit_normals, RNScalar *hit_ts,
+  RNScalar min_t, RNScalar max_t) const
+{
+  // Intersect rays one at a time if there is no acceleration structure
+  assert(nrays <= R3_RAY_PACKET_SIZE);
+  int hits = 0;
+  if (!bvh) {
+    for (int i = 0; i < nrays; i++) {
+      if (Intersects(rays[i], (hit_nodes) ? &hit_nodes[i] : NULL,
+        (hit_elements) ? &hit_elements[i] : NULL, (hit_shapes) ? &hit_shapes[i] : NULL,
+        (hit_points) ? &hit_points[i] : NULL, (hit_normals) ? &hit_normals[i] : NULL,
+        (hit_ts) ? &hit_ts[i] : NULL, min_t, max_t)) hits |= 1 << i;
+    }
+    return hits;
+  }
+
+  // Find closest shape intersections of packet
+  RNScalar max_ts[R3_RAY_PACKET_SIZE];
+  for (int i = 0; i < nrays; i++) max_ts[i] = max_t;
+  R3RayPacket packet(rays, nrays, min_t, max_ts);
+  R3ScenePacketIntersector intersector(instances, triangles, packet, FALSE);
+  hits = bvh->Intersects(packet, (1 << nrays) - 1, intersector);
+
+  // Return hit information
+  for (int i = 0; i < nrays; i++) {
+    if (!(hits & (1 << i))) continue;
+    R3SceneInstance *instance = intersector.hit_instances[i];
+    if (hit_nodes) hit_nodes[i] = instance->node;
+    if (hit_elements) hit_elements[i] = instance->element;
+    if (hit_shapes) hit_shapes[i] = instance->shape;
+    if (intersector.hit_triangles[i] >= 0) {
+      if (hit_points) hit_points[i] = rays[i].Point(packet.exact_max_t[i]);
+      if (hit_normals) hit_normals[i] = R3SceneTriangleNormal(triangles, intersector.hit_triangles[i]);
+    }
+    else {
+      if (hit_points) hit_points[i] = intersector.hit_points[i];
+      if (hit_normals) hit_normals[i] = intersector.hit_normals[i];
+    }
+    if (hit_ts) hit_ts[i] = packet.exact_max_t[i];
+  }
+
+  // Return mask of rays that hit
+  return hits;
+}
+
+
+
+int R3Scene::
+Occluded(const R3Ray *rays, const RNScalar *max_t, int nrays) const
+{
+  // Check rays one at a time if there is no acceleration structure
+  assert(nrays <= R3_RAY_PACKET_SIZE);
+  int hits = 0;
+  if (!bvh) {
+    for (int i = 0; i < nrays; i++) {
+      if (Occluded(rays[i], max_t[i])) hits |= 1 << i;
+    }
+    return hits;
+  }
+
+  // Find any shape intersections of packet in [0, max_t]
+  R3RayPacket packet(rays, nrays, 0.0, max_t);
+  R3ScenePacketIntersector occluder(instances, triangles, packet, TRUE);
+  return bvh->Intersects(packet, (1 << nrays) - 1, occluder, TRUE);
+}
+
+
+
+static void
+R3SceneInsertInstances(RNArray<R3SceneInstance *>& instances, R3SceneNode *node, const R3Affine& parent_transformation)
+{
+  // Compute transformation
+  R3Affine transformation = R3identity_affine;
+  transformation.Transform(parent_transformation);
+  transformation.Transform(node->Transformation());
+
+  // Create an instance for every shape, with node transformations baked in
+  for (int i = 0; i < node->NElements(); i++) {
+    R3SceneElement *element = node->Element(i);
+    for (int j = 0; j < element->NShapes(); j++) {
+      R3SceneInstance *instance = new R3SceneInstance();
+      instance->node = node;
+      instance->element = element;
+      instance->shape = element->Shape(j);
+      instance->transformation = transformation;
+      instance->is_identity = transformation.IsIdentity();
+      instance->transformation.InverseMatrix(); // cache inverse before concurrent queries
+      instance->is_compiled = (instance->shape->ClassID() == R3Triangle::CLASS_ID()) ||
+        (instance->shape->ClassID() == R3TriangleArray::CLASS_ID());
+      instances.Insert(instance);
+    }
+  }
+
+  // Recurse to children
+  for (int i = 0; i < node->NChildren(); i++) {
+    R3SceneNode *child = node->Child(i);
+    R3SceneInsertInstances(instances, child, transformation);
+  }
+}
+
+
+
+static void
+R3SceneInsertTriangle(R3SceneTriangles *triangles, int index, int instance_index,
+  const R3SceneInstance *instance, const R3Triangle *triangle)
+{
+  // Transform vertices into world coordinates
+  R3Point positions[3] = {
+    triangle->V0()->Position(), triangle->V1()->Position(), triangle->V2()->Position()
+  };
+  R3Vector normal = triangle->Normal();
+  if (!instance->is_identity) {
+    for (int k = 0; k < 3; k++) positions[k].Transform(instance->transformation);
+
+    // Recompute normal (a transformed normal need not be perpendicular),
+    // on the side that the transformed normal is
+    R3Vector transformed_normal = normal;
+    transformed_normal.Transform(instance->transformation);
+    normal = (positions[1] - positions[0]) % (positions[2] - positions[0]);
+    normal.Normalize();
+    if (normal.Dot(transformed_normal) < 0) normal.Flip();
+  }
+
+  // Store triangle
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    for (int k = 0; k < 3; k++) triangles->vertices[k][dim][index] = (float) positions[k][dim];
+    triangles->normals[dim][index] = (float) normal[dim];
+  }
+  triangles->instances[index] = instance_index;
+}
+
+
+
+static R3Box
+R3SceneTriangleBox(const R3SceneTriangles *triangles, int index)
+{
+  // Return box of triangle in single precision (which R3Bvh stores
+  // exactly, and whose slab tests allow for their rounding)
+  R3Box box = R3null_box;
+  for (int k = 0; k < 3; k++) {
+    box.Union(R3Point(triangles->vertices[k][RN_X][index],
+      triangles->vertices[k][RN_Y][index], triangles->vertices[k][RN_Z][index]));
+  }
+  return box;
+}
+
+
+
+void R3Scene::
+UpdateBvh(void)
+{
+  // Delete previous acceleration structure
+  InvalidateBvh();
+
+  // Flatten hierarchy into shape instances, ordering instances of shapes
+  // that are intersected as shapes before those with compiled triangles
+  RNArray<R3SceneInstance *> all_instances;
+  R3SceneInsertInstances(all_instances, root, R3identity_affine);
+  if (all_instances.IsEmpty()) return;
+  for (int i = 0; i < all_instances.NEntries(); i++) {
+    if (!all_instances.Kth(i)->is_compiled) instances.Insert(all_instances.Kth(i));
+  }
+  int nshapes = instances.NEntries();
+  for (int i = 0; i < all_instances.NEntries(); i++) {
+    if (all_instances.Kth(i)->is_compiled) instances.Insert(all_instances.Kth(i));
+  }
+
+  // Flatten triangles of compiled instances into world coordinates
+  int ntriangles = 0;
+  for (int i = nshapes; i < instances.NEntries(); i++) {
+    R3Shape *shape = instances.Kth(i)->shape;
+    if (shape->ClassID() == R3Triangle::CLASS_ID()) ntriangles++;
+    else ntriangles += ((R3TriangleArray *) shape)->NTriangles();
+  }
+  triangles = new R3SceneTriangles(ntriangles);
+  int index = 0;
+  for (int i = nshapes; i < instances.NEntries(); i++) {
+    R3SceneInstance *instance = instances.Kth(i);
+    if (instance->shape->ClassID() == R3Triangle::CLASS_ID()) {
+      R3SceneInsertTriangle(triangles, index++, i, instance, (R3Triangle *) instance->shape);
+    }
+    else {
+      R3TriangleArray *array = (R3TriangleArray *) instance->shape;
+      for (int j = 0; j < array->NTriangles(); j++) {
+        R3SceneInsertTriangle(triangles, index++, i, instance, array->Triangle(j));
+      }
+    }
+  }
+
+  // Build bounding volume hierarchy over world bounding boxes of
+  // triangles, followed by those of the other instances
+  R3Box *boxes = new R3Box [ ntriangles + nshapes ];
+  for (int i = 0; i < ntriangles; i++) {
+    boxes[i] = R3SceneTriangleBox(triangles, i);
+  }
+  for (int i = 0; i < nshapes; i++) {
+    R3SceneInstance *instance = instances.Kth(i);
+    boxes[ntriangles + i] = instance->shape->BBox();
+    if (!instance->is_identity) boxes[ntriangles + i].Transform(instance->transformation);
+  }
+  bvh = new R3Bvh(boxes, ntriangles + nshapes, 1);
+  delete [] boxes;
+}
+
+
+
+void R3Scene::
+InvalidateBvh(void)
+{
+  // Delete acceleration structure
+  if (bvh) {
+    delete bvh;
+    bvh = NULL;
+  }
+
+  // Delete compiled triangles
+  if (triangles) {
+    delete triangles;
+    triangles = NULL;
+  }
+
+  // Delete instances
+  for (int i = 0; i < instances.NEntries(); i++) {
+    delete instances.Kth(i);
+  }
+  instances.Empty();
 }
 
 
@@ -582,6 +1180,9 @@ ReadFile(const char *filename)
     InsertLight(light2);
   }
 
+  // Build acceleration structure for ray queries
+  UpdateBvh();
+
   // Return success
   return 1;
 }
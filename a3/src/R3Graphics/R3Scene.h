@@ -74,6 +74,16 @@ public:
     R3SceneNode **hit_node = NULL, R3SceneElement **hit_element = NULL, R3Shape **hit_shape = NULL,
     R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL,
     RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+  RNBoolean Occluded(const R3Ray& ray, RNScalar max_t = RN_INFINITY) const;
+
+  // Ray packet query functions (at most R3_RAY_PACKET_SIZE rays, hit
+  // information in arrays of nrays entries, returning a mask with bit i
+  // set if ray i hit)
+  int Intersects(const R3Ray *rays, int nrays,
+    R3SceneNode **hit_nodes = NULL, R3SceneElement **hit_elements = NULL, R3Shape **hit_shapes = NULL,
+    R3Point *hit_points = NULL, R3Vector *hit_normals = NULL, RNScalar *hit_ts = NULL,
+    RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+  int Occluded(const R3Ray *rays, const RNScalar *max_t, int nrays) const;
 
   // I/O functions
   int ReadFile(const char *filename);
@@ -96,6 +106,11 @@ public:
   void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS,
     RNBoolean set_camera = TRUE, RNBoolean set_lights = TRUE) const;
 
+public:
+  // Internal update functions
+  void InvalidateBvh(void);
+  void UpdateBvh(void);
+
 private:
   R3SceneNode *root;
   RNArray<R3SceneNode *> nodes;
@@ -106,6 +121,9 @@ private:
   R3Viewer viewer;
   RNRgb ambient;
   RNRgb background;
+  RNArray<R3SceneInstance *> instances;
+  R3Bvh *bvh;
+  R3SceneTriangles *triangles;
 };
 
 
@@ -244,6 +244,28 @@ Intersects(const R3Ray& ray, R3Shape **hit_shape,
 
 
 
+RNBoolean R3SceneElement::
+Occluded(const R3Ray& ray, RNScalar min_t, RNScalar max_t) const
+{
+  // Check if ray intersects bounding box
+  RNScalar bbox_t;
+  if (!R3Contains(BBox(), ray.Start())) {
+    if (!R3Intersects(ray, BBox(), NULL, NULL, &bbox_t)) return FALSE;
+    if (RNIsGreater(bbox_t, max_t)) return FALSE;
+  }
+
+  // Check shapes, stopping at the first one hit
+  for (int i = 0; i < NShapes(); i++) {
+    R3Shape *shape = Shape(i);
+    if (shape->Occluded(ray, min_t, max_t)) return TRUE;
+  }
+
+  // Return no hit
+  return FALSE;
+}
+
+
+
 void R3SceneElement::
 Draw(const R3DrawFlags draw_flags) const
 {
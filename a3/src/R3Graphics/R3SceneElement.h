@@ -38,6 +38,7 @@ public:
   RNBoolean Intersects(const R3Ray& ray, R3Shape **hit_shape = NULL,
     R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL,
     RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+  RNBoolean Occluded(const R3Ray& ray, RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
 
   // Draw functions
   void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS) const;
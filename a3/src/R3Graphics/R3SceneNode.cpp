@@ -511,6 +511,48 @@ Intersects(const R3Ray& ray,
 
 
 
+RNBoolean R3SceneNode::
+Occluded(const R3Ray& ray, RNScalar min_t, RNScalar max_t) const
+{
+  // Check if ray intersects bounding box
+  RNScalar bbox_t;
+  if (!R3Contains(BBox(), ray.Start())) {
+    if (!R3Intersects(ray, BBox(), NULL, NULL, &bbox_t)) return FALSE;
+    if (RNIsGreater(bbox_t, max_t)) return FALSE;
+  }
+
+  // Apply inverse transformation to ray
+  R3Ray node_ray = ray;
+  node_ray.InverseTransform(transformation);
+
+  // Apply inverse transform to min_t and max_t
+  R3Vector v(ray.Vector());
+  transformation.Apply(v);
+  RNScalar length = v.Length();
+  if (RNIsNegativeOrZero(length)) return FALSE;
+  if (RNIsNotEqual(length, 1.0)) {
+    min_t /= length;
+    max_t /= length;
+  }
+
+  // Check elements
+  for (int i = 0; i < elements.NEntries(); i++) {
+    R3SceneElement *element = elements.Kth(i);
+    if (element->Occluded(node_ray, min_t, max_t)) return TRUE;
+  }
+
+  // Check children
+  for (int i = 0; i < children.NEntries(); i++) {
+    R3SceneNode *child = children.Kth(i);
+    if (child->Occluded(node_ray, min_t, max_t)) return TRUE;
+  }
+
+  // Return no hit
+  return FALSE;
+}
+
+
+
 void R3SceneNode::
 Draw(const R3DrawFlags draw_flags) const
 {
@@ -567,8 +609,9 @@ InvalidateBBox(void)
   // Invalidate bounding box
   bbox[0][0] = FLT_MAX;
 
-  // Invalidate parent's bounding box
+  // Invalidate parent's bounding box (or scene acceleration structure at top)
   if (parent) parent->InvalidateBBox();
+  else if (scene) scene->InvalidateBvh();
 }
 
 
@@ -0,0 +1,300 @@
+/* Source file for the R3 bounding volume hierarchy class */
+
+
+
+/* Include files */
+
+#include "R3Shapes/R3Shapes.h"
+#include <algorithm>
+
+
+
+/* Build parameters */
+
+static const int R3bvh_nbins = 16;
+static const RNScalar R3bvh_traversal_cost = 1.0;
+static const RNScalar R3bvh_intersection_cost = 1.0;
+static const int R3bvh_max_leaf_size = 32767;
+static const int R3bvh_median_split_levels = 32; // enough to halve any int count to one
+
+
+
+/* Private functions */
+
+static float
+RoundDown(RNCoord c)
+{
+  // Return largest float no greater than c
+  float f = (float) c;
+  if ((RNCoord) f > c) f = nextafterf(f, -FLT_MAX);
+  return f;
+}
+
+
+
+static float
+RoundUp(RNCoord c)
+{
+  // Return smallest float no less than c
+  float f = (float) c;
+  if ((RNCoord) f < c) f = nextafterf(f, FLT_MAX);
+  return f;
+}
+
+
+
+static RNArea
+HalfArea(const R3Box& box)
+{
+  // Return half of surface area of box (zero for empty box)
+  if (box.IsEmpty()) return 0;
+  RNLength dx = box.XLength();
+  RNLength dy = box.YLength();
+  RNLength dz = box.ZLength();
+  return dx*dy + dy*dz + dz*dx;
+}
+
+
+
+struct R3BvhCentroidLess {
+  // Orders primitives by centroid coordinate along a dimension
+  const R3Point *centroids;
+  int dim;
+  bool operator()(int a, int b) const {
+    return centroids[a][dim] < centroids[b][dim];
+  }
+};
+
+
+
+/* Member functions */
+
+R3Bvh::
+R3Bvh(void)
+  : nodes(NULL),
+    nnodes(0),
+    primitives(NULL),
+    nprimitives(0)
+{
+}
+
+
+
+R3Bvh::
+R3Bvh(const R3Box *boxes, int nboxes, int max_primitives_per_leaf)
+  : nodes(NULL),
+    nnodes(0),
+    primitives(NULL),
+    nprimitives(nboxes)
+{
+  // Check boxes
+  if (nboxes <= 0) return;
+
+  // Initialize primitive order and centroids
+  primitives = new int [ nboxes ];
+  R3Point *centroids = new R3Point [ nboxes ];
+  for (int i = 0; i < nboxes; i++) {
+    primitives[i] = i;
+    centroids[i] = boxes[i].Centroid();
+  }
+
+  // Allocate nodes (a binary tree with at most one primitive per leaf)
+  nodes = new R3BvhNode [ 2*nboxes - 1 ];
+
+  // Build nodes recursively in depth-first order
+  if (max_primitives_per_leaf < 1) max_primitives_per_leaf = 1;
+  BuildNode(0, nboxes, boxes, centroids, max_primitives_per_leaf, 0);
+
+  // Delete temporary data
+  delete [] centroids;
+}
+
+
+
+R3Bvh::
+~R3Bvh(void)
+{
+  // Delete nodes and primitive order
+  if (nodes) delete [] nodes;
+  if (primitives) delete [] primitives;
+}
+
+
+
+const R3Box R3Bvh::
+BBox(void) const
+{
+  // Return bounding box of root
+  if (nnodes == 0) return R3null_box;
+  const R3BvhNode& root = nodes[0];
+  return R3Box(root.bbox[0][0], root.bbox[0][1], root.bbox[0][2],
+    root.bbox[1][0], root.bbox[1][1], root.bbox[1][2]);
+}
+
+
+
+int R3Bvh::
+BuildNode(int first, int count, const R3Box *boxes, const R3Point *centroids,
+  int max_primitives_per_leaf, int depth)
+{
+  // Allocate node
+  int index = nnodes++;
+
+  // Compute bounding boxes of primitives and of their centroids
+  R3Box bbox = R3null_box;
+  R3Box centroid_bbox = R3null_box;
+  for (int i = first; i < first + count; i++) {
+    bbox.Union(boxes[primitives[i]]);
+    centroid_bbox.Union(centroids[primitives[i]]);
+  }
+
+  // Store conservative bounding box
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    nodes[index].bbox[0][dim] = RoundDown(bbox.Min()[dim]);
+    nodes[index].bbox[1][dim] = RoundUp(bbox.Max()[dim]);
+  }
+
+  // Find best split plane with binned surface area heuristic, unless the
+  // node is so deep that only median splits keep leaves within
+  // R3_BVH_MAX_DEPTH levels (and so within the traversal stacks)
+  RNBoolean median_split = (depth >= R3_BVH_MAX_DEPTH - R3bvh_median_split_levels) ? TRUE : FALSE;
+  RNScalar leaf_cost = R3bvh_intersection_cost * count;
+  RNScalar best_cost = leaf_cost;
+  int best_dim = -1;
+  int best_bin = -1;
+  if ((count > 1) && !median_split) {
+    RNScalar bbox_area = HalfArea(bbox);
+    for (int dim = RN_X; dim <= RN_Z; dim++) {
+      // Check extent of centroids along dimension
+      RNCoord cmin = centroid_bbox.Min()[dim];
+      RNLength extent = centroid_bbox.Max()[dim] - cmin;
+      if (extent <= 0) continue;
+
+      // Sort primitives into bins
+      R3Box bin_boxes[R3bvh_nbins];
+      int bin_counts[R3bvh_nbins];
+      for (int b = 0; b < R3bvh_nbins; b++) {
+        bin_boxes[b] = R3null_box;
+        bin_counts[b] = 0;
+      }
+      for (int i = first; i < first + count; i++) {
+        int b = (int) (R3bvh_nbins * (centroids[primitives[i]][dim] - cmin) / extent);
+        if (b >= R3bvh_nbins) b = R3bvh_nbins - 1;
+        bin_boxes[b].Union(boxes[primitives[i]]);
+        bin_counts[b]++;
+      }
+
+      // Sweep from the right to accumulate areas of right sides
+      RNArea right_areas[R3bvh_nbins];
+      int right_counts[R3bvh_nbins];
+      R3Box right_box = R3null_box;
+      int right_count = 0;
+      for (int b = R3bvh_nbins - 1; b > 0; b--) {
+        right_box.Union(bin_boxes[b]);
+        right_count += bin_counts[b];
+        right_areas[b] = HalfArea(right_box);
+        right_counts[b] = right_count;
+      }
+
+      // Sweep from the left to evaluate cost of splitting after each bin
+      R3Box left_box = R3null_box;
+      int left_count = 0;
+      for (int b = 0; b < R3bvh_nbins - 1; b++) {
+        left_box.Union(bin_boxes[b]);
+        left_count += bin_counts[b];
+        if ((left_count == 0) || (right_counts[b+1] == 0)) continue;
+        RNScalar cost = R3bvh_traversal_cost;
+        if (bbox_area > 0) {
+          cost += R3bvh_intersection_cost *
+            (HalfArea(left_box) * left_count + right_areas[b+1] * right_counts[b+1]) / bbox_area;
+        }
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_dim = dim;
+          best_bin = b;
+        }
+      }
+    }
+  }
+
+  // Create leaf if splitting does not pay off
+  if ((count <= max_primitives_per_leaf) ||
+      (!median_split && (best_dim < 0) && (count <= R3bvh_max_leaf_size))) {
+    nodes[index].offset = first;
+    nodes[index].nprimitives = (short) count;
+    nodes[index].axis = 0;
+    return index;
+  }
+
+  // Partition primitives
+  int middle = first;
+  if (best_dim >= 0) {
+    // Partition by SAH bin
+    RNCoord cmin = centroid_bbox.Min()[best_dim];
+    RNLength extent = centroid_bbox.Max()[best_dim] - cmin;
+    for (int i = first; i < first + count; i++) {
+      int b = (int) (R3bvh_nbins * (centroids[primitives[i]][best_dim] - cmin) / extent);
+      if (b >= R3bvh_nbins) b = R3bvh_nbins - 1;
+      if (b <= best_bin) {
+        int swap = primitives[i]; primitives[i] = primitives[middle]; primitives[middle] = swap;
+        middle++;
+      }
+    }
+  }
+  else {
+    // Too many coincident centroids for one leaf, or too deep for the
+    // surface area heuristic -- split in half at the median centroid
+    R3BvhCentroidLess less;
+    less.centroids = centroids;
+    less.dim = best_dim = centroid_bbox.LongestAxis();
+    middle = first + count / 2;
+    std::nth_element(primitives + first, primitives + middle, primitives + first + count, less);
+  }
+
+  // Build children (first child immediately follows its parent)
+  nodes[index].nprimitives = 0;
+  nodes[index].axis = (short) best_dim;
+  BuildNode(first, middle - first, boxes, centroids, max_primitives_per_leaf, depth + 1);
+  nodes[index].offset = BuildNode(middle, first + count - middle, boxes, centroids, max_primitives_per_leaf, depth + 1);
+
+  // Return index of node
+  return index;
+}
+
+
+
+/* Ray packet functions */
+
+R3RayPacket::
+R3RayPacket(const R3Ray *rays, int nrays, RNScalar min_t, const RNScalar *max_t)
+  : rays(rays),
+    nrays(nrays),
+    exact_min_t(min_t)
+{
+  // Check number of rays
+  assert((nrays >= 0) && (nrays <= R3_RAY_PACKET_SIZE));
+
+  // Copy rays into lanes, leaving unused lanes with empty intervals
+  for (int i = 0; i < R3_RAY_PACKET_SIZE; i++) {
+    if (i < nrays) {
+      const R3Point& start = rays[i].Start();
+      const R3Vector& vector = rays[i].Vector();
+      for (int dim = RN_X; dim <= RN_Z; dim++) {
+        origin[dim][i] = (float) start[dim];
+        direction[dim][i] = (float) vector[dim];
+        inverse[dim][i] = (float) (1.0 / vector[dim]);
+      }
+      exact_max_t[i] = (max_t) ? max_t[i] : RN_INFINITY;
+      this->min_t[i] = RoundDown(min_t);
+      this->max_t[i] = RoundUp(exact_max_t[i]);
+    }
+    else {
+      for (int dim = RN_X; dim <= RN_Z; dim++) {
+        origin[dim][i] = direction[dim][i] = inverse[dim][i] = 0;
+      }
+      exact_max_t[i] = -RN_INFINITY;
+      this->min_t[i] = 1;
+      this->max_t[i] = -1;
+    }
+  }
+}
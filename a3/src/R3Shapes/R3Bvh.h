@@ -0,0 +1,376 @@
+/* Include file for the R3 bounding volume hierarchy class */
+
+
+
+/* Node definition */
+
+struct R3BvhNode {
+  float bbox[2][3];   // conservative single precision bounding box
+  int offset;         // leaf: first primitive slot, interior: second child
+  short nprimitives;  // number of primitives (zero for interior nodes)
+  short axis;         // split axis (interior nodes)
+};
+
+
+
+/* Traversal parameters */
+
+#define R3_BVH_MAX_DEPTH 64 // most levels below the root (size of traversal stacks)
+#define R3_BVH_SLAB_GROWTH (1.0 + 3.0 * DBL_EPSILON / (1.0 - 1.5 * DBL_EPSILON)) // 1 + 2 gamma(3) in double precision
+
+
+
+/* Ray packet definition */
+
+#define R3_RAY_PACKET_SIZE 8        // rays traced together (a multiple of 4)
+#define R3_RAY_PACKET_EPSILON 1.0E-3f // relative growth of single precision tests
+
+struct R3RayPacket {
+  // Constructor functions (at most R3_RAY_PACKET_SIZE rays, each with
+  // its own max_t if max_t is not NULL)
+  R3RayPacket(const R3Ray *rays, int nrays, RNScalar min_t = 0.0, const RNScalar *max_t = NULL);
+
+  // Manipulation functions
+  void SetMaxT(int lane, RNScalar t);
+
+  // Rays and intervals in double precision, as the exact tests use them
+  const R3Ray *rays;
+  int nrays;
+  RNScalar exact_min_t;
+  RNScalar exact_max_t[R3_RAY_PACKET_SIZE];
+
+  // Single precision copies, one lane per ray, for the SIMD tests
+  alignas(16) float origin[3][R3_RAY_PACKET_SIZE];
+  alignas(16) float direction[3][R3_RAY_PACKET_SIZE];
+  alignas(16) float inverse[3][R3_RAY_PACKET_SIZE];
+  alignas(16) float min_t[R3_RAY_PACKET_SIZE];
+  alignas(16) float max_t[R3_RAY_PACKET_SIZE];
+};
+
+
+
+/* Class definition */
+
+class R3Bvh {
+public:
+  // Constructor functions
+  R3Bvh(void);
+  R3Bvh(const R3Box *boxes, int nboxes, int max_primitives_per_leaf = 4);
+  ~R3Bvh(void);
+
+  // Property functions
+  const R3Box BBox(void) const;
+  int NNodes(void) const;
+  int NPrimitives(void) const;
+
+  // Access functions
+  const R3BvhNode& Node(int k) const;
+  int Primitive(int slot) const;
+
+  // Ray traversal function -- calls intersector(index, ray, min_t, max_t)
+  // for each primitive whose box the ray enters before max_t, nearest
+  // boxes first; the intersector returns TRUE when it finds a hit in
+  // [min_t, max_t] and shrinks max_t to it.  With any_hit, traversal
+  // stops at the first hit rather than the closest one.
+  template <class Intersector>
+  RNBoolean Intersects(const R3Ray& ray, Intersector& intersector,
+    RNScalar min_t, RNScalar& max_t, RNBoolean any_hit = FALSE) const;
+
+  // Packet traversal function -- the same for the rays of packet in mask
+  // (bit i for ray i), visiting nodes that any of them enter: calls
+  // intersector(index, packet, mask) with the rays that enter the
+  // primitive's box, which returns the mask of rays it hit and shrinks
+  // their max_t (with SetMaxT).  Returns the mask of rays that hit.
+  template <class Intersector>
+  int Intersects(R3RayPacket& packet, int mask, Intersector& intersector,
+    RNBoolean any_hit = FALSE) const;
+
+private:
+  int BuildNode(int first, int count, const R3Box *boxes, const R3Point *centroids,
+    int max_primitives_per_leaf, int depth);
+
+private:
+  R3BvhNode *nodes;
+  int nnodes;
+  int *primitives;
+  int nprimitives;
+};
+
+
+
+/* Inline functions */
+
+inline int R3Bvh::
+NNodes(void) const
+{
+  // Return number of nodes
+  return nnodes;
+}
+
+
+
+inline int R3Bvh::
+NPrimitives(void) const
+{
+  // Return number of primitives
+  return nprimitives;
+}
+
+
+
+inline const R3BvhNode& R3Bvh::
+Node(int k) const
+{
+  // Return kth node (node 0 is the root)
+  return nodes[k];
+}
+
+
+
+inline int R3Bvh::
+Primitive(int slot) const
+{
+  // Return index of primitive stored in leaf slot
+  return primitives[slot];
+}
+
+
+
+inline RNBoolean
+R3BvhIntersectsBox(const R3BvhNode& node, const RNScalar origin[3], const RNScalar inverse[3],
+  const int sign[3], RNScalar min_t, RNScalar max_t, RNScalar *entry_t)
+{
+  // Slab test against node box with precomputed inverse ray direction,
+  // growing exit distances by the rounding error of the three operations
+  // that compute each distance (Ize 2013), so that a ray touching the box
+  // (even a flat one) is never culled
+  RNScalar tmin = (node.bbox[sign[0]][0] - origin[0]) * inverse[0];
+  RNScalar tmax = (node.bbox[1-sign[0]][0] - origin[0]) * inverse[0] * R3_BVH_SLAB_GROWTH;
+  RNScalar ymin = (node.bbox[sign[1]][1] - origin[1]) * inverse[1];
+  RNScalar ymax = (node.bbox[1-sign[1]][1] - origin[1]) * inverse[1] * R3_BVH_SLAB_GROWTH;
+  if ((tmin > ymax) || (ymin > tmax)) return FALSE;
+  if (ymin > tmin) tmin = ymin;
+  if (ymax < tmax) tmax = ymax;
+  RNScalar zmin = (node.bbox[sign[2]][2] - origin[2]) * inverse[2];
+  RNScalar zmax = (node.bbox[1-sign[2]][2] - origin[2]) * inverse[2] * R3_BVH_SLAB_GROWTH;
+  if ((tmin > zmax) || (zmin > tmax)) return FALSE;
+  if (zmin > tmin) tmin = zmin;
+  if (zmax < tmax) tmax = zmax;
+  if ((tmax < min_t) || (tmin > max_t)) return FALSE;
+  *entry_t = tmin;
+  return TRUE;
+}
+
+
+
+inline void R3RayPacket::
+SetMaxT(int lane, RNScalar t)
+{
+  // Shrink interval of ray (single precision copy rounded to nearest,
+  // which the growth of the SIMD tests covers)
+  exact_max_t[lane] = t;
+  max_t[lane] = (float) t;
+}
+
+
+
+inline int
+R3BvhIntersectsBox(const R3BvhNode& node, const R3RayPacket& packet, int mask)
+{
+  // Slab test against node box for the rays in mask, growing their
+  // intervals slightly so that single precision rounding does not cull
+  // boxes the double precision test would enter.  A ray parallel to a
+  // slab with its origin on one of the slab's planes gets 0 * inf = NaN,
+  // and lies in the slab, so that slab does not bound its interval.
+  int result = 0;
+  for (int lane = 0; lane < R3_RAY_PACKET_SIZE; lane += 4) {
+    if (!((mask >> lane) & 0xF)) continue;
+#ifdef RN_USE_SSE
+    __m128 tmin = _mm_load_ps(&packet.min_t[lane]);
+    __m128 tmax = _mm_load_ps(&packet.max_t[lane]);
+    for (int dim = 0; dim < 3; dim++) {
+      __m128 origin = _mm_load_ps(&packet.origin[dim][lane]);
+      __m128 inverse = _mm_load_ps(&packet.inverse[dim][lane]);
+      __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbox[0][dim]), origin), inverse);
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbox[1][dim]), origin), inverse);
+      __m128 inside = _mm_cmpunord_ps(t0, t1);
+      __m128 near_t = _mm_andnot_ps(inside, _mm_min_ps(t0, t1));
+      __m128 far_t = _mm_andnot_ps(inside, _mm_max_ps(t0, t1));
+      near_t = _mm_or_ps(near_t, _mm_and_ps(inside, _mm_set1_ps(-FLT_MAX)));
+      far_t = _mm_or_ps(far_t, _mm_and_ps(inside, _mm_set1_ps(FLT_MAX)));
+      tmin = _mm_max_ps(tmin, near_t);
+      tmax = _mm_min_ps(tmax, far_t);
+    }
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.0f + R3_RAY_PACKET_EPSILON));
+    result |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << lane;
+#else
+    for (int i = lane; i < lane + 4; i++) {
+      float tmin = packet.min_t[i];
+      float tmax = packet.max_t[i];
+      for (int dim = 0; dim < 3; dim++) {
+        float t0 = (node.bbox[0][dim] - packet.origin[dim][i]) * packet.inverse[dim][i];
+        float t1 = (node.bbox[1][dim] - packet.origin[dim][i]) * packet.inverse[dim][i];
+        if ((t0 != t0) || (t1 != t1)) continue;
+        if (t0 > t1) { float swap = t0; t0 = t1; t1 = swap; }
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+      }
+      if (tmin <= tmax * (1.0f + R3_RAY_PACKET_EPSILON)) result |= 1 << i;
+    }
+#endif
+  }
+  return result & mask;
+}
+
+
+
+template <class Intersector>
+RNBoolean R3Bvh::
+Intersects(const R3Ray& ray, Intersector& intersector,
+  RNScalar min_t, RNScalar& max_t, RNBoolean any_hit) const
+{
+  // Check nodes
+  if (nnodes == 0) return FALSE;
+
+  // Precompute ray slab test variables
+  RNScalar origin[3], inverse[3];
+  int sign[3];
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    origin[dim] = ray.Start()[dim];
+    inverse[dim] = 1.0 / ray.Vector()[dim];
+    sign[dim] = (inverse[dim] < 0) ? 1 : 0;
+  }
+
+  // Check root box
+  RNScalar entry_t;
+  if (!R3BvhIntersectsBox(nodes[0], origin, inverse, sign, min_t, max_t, &entry_t)) return FALSE;
+
+  // Traverse nodes with an explicit stack
+  RNBoolean hit = FALSE;
+  int stack[R3_BVH_MAX_DEPTH];
+  RNScalar stack_t[R3_BVH_MAX_DEPTH];
+  int nstack = 0;
+  int index = 0;
+  while (TRUE) {
+    const R3BvhNode& node = nodes[index];
+    if (node.nprimitives > 0) {
+      // Intersect primitives in leaf
+      for (int i = 0; i < node.nprimitives; i++) {
+        if (intersector(primitives[node.offset + i], ray, min_t, max_t)) {
+          if (any_hit) return TRUE;
+          hit = TRUE;
+        }
+      }
+    }
+    else {
+      // Visit the nearer child first and push the other one
+      int near_index = index + 1;
+      int far_index = node.offset;
+      RNScalar near_t = 0, far_t = 0;
+      RNBoolean near_hit = R3BvhIntersectsBox(nodes[near_index], origin, inverse, sign, min_t, max_t, &near_t);
+      RNBoolean far_hit = R3BvhIntersectsBox(nodes[far_index], origin, inverse, sign, min_t, max_t, &far_t);
+      if (near_hit && far_hit) {
+        if (far_t < near_t) {
+          int swap_index = near_index; near_index = far_index; far_index = swap_index;
+          RNScalar swap_t = near_t; near_t = far_t; far_t = swap_t;
+        }
+        assert(nstack < R3_BVH_MAX_DEPTH);
+        stack[nstack] = far_index;
+        stack_t[nstack] = far_t;
+        nstack++;
+        index = near_index;
+        continue;
+      }
+      else if (near_hit) { index = near_index; continue; }
+      else if (far_hit) { index = far_index; continue; }
+    }
+
+    // Pop next node off stack, skipping nodes behind the closest hit
+    do {
+      if (nstack == 0) return hit;
+      nstack--;
+    } while (stack_t[nstack] > max_t);
+    index = stack[nstack];
+  }
+
+  // Should never get here
+  return hit;
+}
+
+
+
+template <class Intersector>
+int R3Bvh::
+Intersects(R3RayPacket& packet, int mask, Intersector& intersector, RNBoolean any_hit) const
+{
+  // Check nodes
+  if (nnodes == 0) return 0;
+
+  // Check root box
+  int active = mask;
+  mask = R3BvhIntersectsBox(nodes[0], packet, active);
+  if (!mask) return 0;
+
+  // Traverse nodes with an explicit stack, each entry holding the rays
+  // that entered the node's box
+  int hits = 0;
+  int stack[R3_BVH_MAX_DEPTH];
+  int stack_mask[R3_BVH_MAX_DEPTH];
+  int nstack = 0;
+  int index = 0;
+  while (TRUE) {
+    const R3BvhNode& node = nodes[index];
+    if (node.nprimitives > 0) {
+      // Intersect primitives in leaf
+      for (int i = 0; i < node.nprimitives; i++) {
+        int primitive_hits = intersector(primitives[node.offset + i], packet, mask);
+        if (!primitive_hits) continue;
+        hits |= primitive_hits;
+        if (any_hit) {
+          // Rays that hit something need not go any further
+          active &= ~primitive_hits;
+          if (!active) return hits;
+          mask &= active;
+          if (!mask) break;
+        }
+      }
+    }
+    else {
+      // Visit first the child that is nearer along the split axis for
+      // the first ray, and push the other one
+      int first = 0;
+      while (!(mask & (1 << first))) first++;
+      int near_index = index + 1;
+      int far_index = node.offset;
+      if (packet.direction[node.axis][first] < 0) {
+        int swap_index = near_index; near_index = far_index; far_index = swap_index;
+      }
+      int near_mask = R3BvhIntersectsBox(nodes[near_index], packet, mask);
+      int far_mask = R3BvhIntersectsBox(nodes[far_index], packet, mask);
+      if (near_mask && far_mask) {
+        assert(nstack < R3_BVH_MAX_DEPTH);
+        stack[nstack] = far_index;
+        stack_mask[nstack] = far_mask;
+        nstack++;
+        index = near_index;
+        mask = near_mask;
+        continue;
+      }
+      else if (near_mask) { index = near_index; mask = near_mask; continue; }
+      else if (far_mask) { index = far_index; mask = far_mask; continue; }
+    }
+
+    // Pop next node off stack, retesting its box for rays whose max_t
+    // has shrunk since it was pushed
+    do {
+      if (nstack == 0) return hits;
+      nstack--;
+      index = stack[nstack];
+      mask = stack_mask[nstack] & active;
+      if (mask) mask = R3BvhIntersectsBox(nodes[index], packet, mask);
+    } while (!mask);
+  }
+
+  // Should never get here
+  return hits;
+}
@@ -549,7 +549,7 @@ RNClassID R3Intersects(const R3Line& line, const R3Sphere& sphere,
 	else {
 	    // Line intersects sphere (it grazes if disc is zero)
 	    if (hit_point) {
-		RNScalar d = sqrt(disc);
+		RNScalar d = (disc > 0) ? sqrt(disc) : 0;
 		RNScalar t = v - d;
 		*hit_point = line.Point() + t * line.Vector();
 	    }
@@ -797,32 +797,38 @@ RNClassID R3Intersects(const R3Ray& ray, const R3Triangle& triangle,
 
 
 
+struct R3TriangleArrayIntersector {
+    // Finds closest intersection with triangles of array
+    const R3TriangleArray *array;
+    R3Point hit_point;
+    R3Vector hit_normal;
+    RNBoolean operator()(int index, const R3Ray& ray, RNScalar min_t, RNScalar& max_t) {
+        R3Point point;
+        R3Vector normal;
+        RNScalar t;
+        if (R3Intersects(ray, *(array->Triangle(index)), &point, &normal, &t) != R3_POINT_CLASS_ID) return FALSE;
+        if ((t < min_t) || (t >= max_t)) return FALSE;
+        hit_point = point;
+        hit_normal = normal;
+        max_t = t;
+        return TRUE;
+    }
+};
+
+
+
 RNClassID R3Intersects(const R3Ray& ray, const R3TriangleArray& array,
     R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t)
 {
-    // This could be more efficient ???
-    // Sort intersections with front-facing planes 
-    //   before do any point-in-triangle operations
-
-    // Check bounding volume for intersection 
-    if (!R3Intersects(ray, array.Box())) 
-	return RN_NULL_CLASS_ID;
-
-    // Check each triangle for intersection
-    RNClassID status = RN_NULL_CLASS_ID;
+    // Find closest triangle intersection with bounding volume hierarchy
+    R3TriangleArrayIntersector intersector;
+    intersector.array = &array;
     RNScalar min_t = FLT_MAX;
-    for (int i = 0; i < array.NTriangles(); i++) {
-        R3Point point;
-        R3Vector normal;
-	RNScalar t;
-        if (R3Intersects(ray, *(array.Triangle(i)), &point, &normal, &t) == R3_POINT_CLASS_ID) {
-	    if (t < min_t) {
-	        status = R3_POINT_CLASS_ID;
-	        if (hit_point) *hit_point = point;
-	        if (hit_normal) *hit_normal = normal;
-	        min_t = t;
-	    }
-	}
+    RNClassID status = RN_NULL_CLASS_ID;
+    if (array.Bvh()->Intersects(ray, intersector, 0.0, min_t)) {
+        status = R3_POINT_CLASS_ID;
+        if (hit_point) *hit_point = intersector.hit_point;
+        if (hit_normal) *hit_normal = intersector.hit_normal;
     }
 
     // Update hit t
@@ -994,9 +1000,9 @@ RNClassID R3Intersects(const R3Ray& ray, const R3Sphere& sphere,
         }
         else {
             // Ray intersects sphere (it grazes if disc is zero)
-            // Compute first intersection
+            // Compute first intersection (disc may be slightly negative within tolerance)
             if (hit_t1 || hit_point1 || hit_normal1) {
-                RNScalar d = sqrt(disc);
+                RNScalar d = (disc > 0) ? sqrt(disc) : 0;
                 RNScalar t = (start_inside) ? v + d : v - d;
                 R3Point p = ray.Start() + t * ray.Vector();
                 if (hit_t1) *hit_t1 = t;
@@ -498,67 +498,109 @@ FindClosest(const R3Point& query_position,
 // Finding the closest K points to a query point
 ////////////////////////////////////////////////////////////////////////
 
+template <class PtrType>
+static void
+R3KdtreeInsertClosest(PtrType point, RNLength distance_squared, int max_points,
+  PtrType *points, RNLength *distances_squared, int& npoints)
+{
+  // Insert point into max-heap keyed on squared distance (farthest point at top)
+  int i;
+  if (npoints < max_points) {
+    // Sift new point up from end of heap
+    i = npoints++;
+    while (i > 0) {
+      int parent = (i - 1) / 2;
+      if (distances_squared[parent] >= distance_squared) break;
+      points[i] = points[parent];
+      distances_squared[i] = distances_squared[parent];
+      i = parent;
+    }
+  }
+  else {
+    // Replace farthest point and sift down
+    i = 0;
+    while (TRUE) {
+      int child = 2 * i + 1;
+      if (child >= npoints) break;
+      if ((child + 1 < npoints) && (distances_squared[child+1] > distances_squared[child])) child++;
+      if (distances_squared[child] <= distance_squared) break;
+      points[i] = points[child];
+      distances_squared[i] = distances_squared[child];
+      i = child;
+    }
+  }
+
+  // Store point
+  points[i] = point;
+  distances_squared[i] = distance_squared;
+}
+
+
+
+template <class PtrType>
+static void
+R3KdtreeSortClosest(PtrType *points, RNLength *distances_squared, int npoints)
+{
+  // Sort max-heap in place by increasing distance (heapsort)
+  for (int n = npoints - 1; n > 0; n--) {
+    // Move farthest point to end
+    PtrType point = points[n];
+    RNLength distance_squared = distances_squared[n];
+    points[n] = points[0];
+    distances_squared[n] = distances_squared[0];
+
+    // Sift displaced point down remaining heap
+    int i = 0;
+    while (TRUE) {
+      int child = 2 * i + 1;
+      if (child >= n) break;
+      if ((child + 1 < n) && (distances_squared[child+1] > distances_squared[child])) child++;
+      if (distances_squared[child] <= distance_squared) break;
+      points[i] = points[child];
+      distances_squared[i] = distances_squared[child];
+      i = child;
+    }
+    points[i] = point;
+    distances_squared[i] = distance_squared;
+  }
+}
+
+
+
 template <class PtrType>
 void R3Kdtree<PtrType>::
-FindClosest(R3KdtreeNode<PtrType> *node, const R3Box& node_box, 
+FindClosest(R3KdtreeNode<PtrType> *node, RNLength node_distance_squared, RNLength node_offsets[3],
   PtrType query_point, const R3Point& query_position, 
-  RNScalar min_distance_squared, RNScalar max_distance_squared, int max_points,
+  RNScalar min_distance_squared, RNScalar& max_distance_squared, int max_points,
   int (*IsCompatible)(PtrType, PtrType, void *), void *compatible_data, 
-  RNArray<PtrType>& points, RNLength *distances_squared) const
+  PtrType *points, RNLength *distances_squared, int& npoints) const
 {
-  // Update max distance squared
-  if (points.NEntries() == max_points) {
-    max_distance_squared = distances_squared[max_points-1];
-  }
-
   // Check if node is interior
   if (node->children[0]) {
     assert(node->children[1]);
 
-    // Find and check axial distances from point to node box
-    RNLength dx, dy, dz;
-    if (RNIsGreater(query_position.X(), node_box.XMax())) dx = query_position.X() - node_box.XMax();
-    else if (RNIsLess(query_position.X(), node_box.XMin())) dx = node_box.XMin()- query_position.X();
-    else dx = 0.0;
-    RNLength dx_squared = dx * dx;
-    if (dx_squared > max_distance_squared) return;
-    if (RNIsGreater(query_position.Y(), node_box.YMax())) dy = query_position.Y() - node_box.YMax();
-    else if (RNIsLess(query_position.Y(), node_box.YMin())) dy = node_box.YMin()- query_position.Y();
-    else dy = 0.0;
-    RNLength dy_squared = dy * dy;
-    if (dy_squared > max_distance_squared) return;
-    if (RNIsGreater(query_position.Z(), node_box.ZMax())) dz = query_position.Z() - node_box.ZMax();
-    else if (RNIsLess(query_position.Z(), node_box.ZMin())) dz = node_box.ZMin()- query_position.Z();
-    else dz = 0.0;
-    RNLength dz_squared = dz * dz;
-    if (dz_squared > max_distance_squared) return;
-    
-    // Find and check actual distance from point to node box
-    RNLength distance_squared = 0;
-    if ((dy == 0.0) && (dz == 0.0)) distance_squared = dx_squared;
-    else if ((dx == 0.0) && (dz == 0.0)) distance_squared = dy_squared;
-    else if ((dx == 0.0) && (dy == 0.0)) distance_squared = dz_squared;
-    else distance_squared = dx_squared + dy_squared + dz_squared;
-    if (distance_squared > max_distance_squared) return;
-
     // Compute distance from point to split plane
-    RNLength side = query_position[node->split_dimension] - node->split_coordinate;
-
-    // Search children nodes
-    if ((side <= 0) || (side*side <= max_distance_squared)) {
-      // Search negative side 
-      R3Box child_box(node_box);
-      child_box[RN_HI][node->split_dimension] = node->split_coordinate;
-      FindClosest(node->children[0], child_box, query_point, query_position, 
-        min_distance_squared, max_distance_squared, max_points, IsCompatible, compatible_data,
-        points, distances_squared);
-    }
-    if ((side >= 0) || (side*side <= max_distance_squared)) {
-      R3Box child_box(node_box);
-      child_box[RN_LO][node->split_dimension] = node->split_coordinate;
-      FindClosest(node->children[1], child_box, query_point, query_position, 
+    RNDimension dim = node->split_dimension;
+    RNLength side = query_position[dim] - node->split_coordinate;
+
+    // Search child on same side of split plane as point (box distance is unchanged)
+    int near = (side < 0) ? 0 : 1;
+    FindClosest(node->children[near], node_distance_squared, node_offsets, 
+      query_point, query_position, 
+      min_distance_squared, max_distance_squared, max_points, IsCompatible, compatible_data,
+      points, distances_squared, npoints);
+
+    // Search child on other side if its box is within max distance
+    // (only the offset along the split dimension changes, to the split plane)
+    RNLength offset = node_offsets[dim];
+    RNLength far_distance_squared = node_distance_squared - offset*offset + side*side;
+    if (far_distance_squared <= max_distance_squared) {
+      node_offsets[dim] = side;
+      FindClosest(node->children[1-near], far_distance_squared, node_offsets, 
+        query_point, query_position, 
         min_distance_squared, max_distance_squared, max_points, IsCompatible, compatible_data,
-        points, distances_squared);
+        points, distances_squared, npoints);
+      node_offsets[dim] = offset;
     }
   }
   else {
@@ -569,25 +611,16 @@ FindClosest(R3KdtreeNode<PtrType> *node, const R3Box& node_box,
       if ((distance_squared >= min_distance_squared) && 
           (distance_squared <= max_distance_squared)) {
 
+        // Check if heap is full and point is no closer than farthest one
+        if ((npoints == max_points) && (distance_squared >= distances_squared[0])) continue;
+
         // Check if point is compatible
         if (!IsCompatible || !query_point || IsCompatible(query_point, point, compatible_data)) {
+          // Insert point into heap
+          R3KdtreeInsertClosest(point, distance_squared, max_points, points, distances_squared, npoints);
 
-          // Find slot for point (points are sorted by distance)
-          int slot = 0;
-          while (slot < points.NEntries()) {
-            if (distance_squared < distances_squared[slot]) break;
-            slot++;
-          }
-          
-          // Insert point and distance into sorted arrays
-          if (slot < max_points) {
-            int first = points.NEntries();
-            if (first >= max_points) first = max_points-1;
-            for (int j = first; j > slot; j--) distances_squared[j] = distances_squared[j-1];
-            distances_squared[slot] = distance_squared;
-            points.InsertKth(point, slot);
-            points.Truncate(max_points);
-          }
+          // Update max distance squared once heap is full
+          if (npoints == max_points) max_distance_squared = distances_squared[0];
         }
       }
     }
@@ -596,6 +629,93 @@ FindClosest(R3KdtreeNode<PtrType> *node, const R3Box& node_box,
 
 
 
+template <class PtrType>
+int R3Kdtree<PtrType>::
+FindClosest(PtrType query_point, 
+  RNScalar min_distance, RNScalar max_distance, int max_points, 
+  int (*IsCompatible)(PtrType, PtrType, void *), void *compatible_data, 
+  PtrType *points, RNLength *distances) const
+{
+  // Check root
+  if (!root) return 0;
+  if (max_points <= 0) return 0;
+
+  // Use squared distances for efficiency (stored in distances during search)
+  RNLength min_distance_squared = min_distance * min_distance;
+  RNLength max_distance_squared = max_distance * max_distance;
+  RNLength *distances_squared = distances;
+
+  // Compute offsets and squared distance from point to root box
+  R3Point query_position = Position(query_point);
+  RNLength offsets[3];
+  RNLength distance_squared = 0;
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    if (query_position[dim] > bbox[RN_HI][dim]) offsets[dim] = query_position[dim] - bbox[RN_HI][dim];
+    else if (query_position[dim] < bbox[RN_LO][dim]) offsets[dim] = bbox[RN_LO][dim] - query_position[dim];
+    else offsets[dim] = 0;
+    distance_squared += offsets[dim] * offsets[dim];
+  }
+
+  // Search nodes recursively
+  int npoints = 0;
+  FindClosest(root, distance_squared, offsets, 
+    query_point, query_position,
+    min_distance_squared, max_distance_squared, max_points, 
+    IsCompatible, compatible_data,
+    points, distances_squared, npoints);
+
+  // Sort points by distance
+  R3KdtreeSortClosest(points, distances_squared, npoints);
+  for (int i = 0; i < npoints; i++) distances[i] = sqrt(distances_squared[i]);
+
+  // Return number of points
+  return npoints;
+}
+
+
+
+template <class PtrType>
+int R3Kdtree<PtrType>::
+FindClosest(const R3Point& query_position, RNScalar min_distance, RNScalar max_distance, int max_points, 
+  PtrType *points, RNLength *distances) const
+{
+  // Check root
+  if (!root) return 0;
+  if (max_points <= 0) return 0;
+
+  // Use squared distances for efficiency (stored in distances during search)
+  RNLength min_distance_squared = min_distance * min_distance;
+  RNLength max_distance_squared = max_distance * max_distance;
+  RNLength *distances_squared = distances;
+
+  // Compute offsets and squared distance from point to root box
+  RNLength offsets[3];
+  RNLength distance_squared = 0;
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    if (query_position[dim] > bbox[RN_HI][dim]) offsets[dim] = query_position[dim] - bbox[RN_HI][dim];
+    else if (query_position[dim] < bbox[RN_LO][dim]) offsets[dim] = bbox[RN_LO][dim] - query_position[dim];
+    else offsets[dim] = 0;
+    distance_squared += offsets[dim] * offsets[dim];
+  }
+
+  // Search nodes recursively
+  int npoints = 0;
+  FindClosest(root, distance_squared, offsets, 
+    NULL, query_position, 
+    min_distance_squared, max_distance_squared, max_points, 
+    NULL, NULL, 
+    points, distances_squared, npoints);
+
+  // Sort points by distance
+  R3KdtreeSortClosest(points, distances_squared, npoints);
+  for (int i = 0; i < npoints; i++) distances[i] = sqrt(distances_squared[i]);
+
+  // Return number of points
+  return npoints;
+}
+
+
+
 template <class PtrType>
 int R3Kdtree<PtrType>::
 FindClosest(PtrType query_point, RNScalar min_distance, RNScalar max_distance, int max_points, 
@@ -617,30 +737,22 @@ FindClosest(PtrType query_point,
 {
   // Check root
   if (!root) return 0;
+  if (max_points <= 0) return 0;
 
-  // Use squared distances for efficiency
-  RNLength min_distance_squared = min_distance * min_distance;
-  RNLength max_distance_squared = max_distance * max_distance;
+  // Allocate temporary arrays for max_points closest points
+  PtrType *tmp_points = new PtrType [ max_points ];
+  RNLength *tmp_distances = (distances) ? distances : new RNLength [ max_points ];
 
-  // Allocate temporary array of squared distances to max_points closest points
-  RNLength *distances_squared = new RNLength [ max_points ];
+  // Search nodes
+  int npoints = FindClosest(query_point, min_distance, max_distance, max_points, 
+    IsCompatible, compatible_data, tmp_points, tmp_distances);
 
-  // Search nodes recursively
-  FindClosest(root, bbox, 
-    query_point, Position(query_point),
-    min_distance_squared, max_distance_squared, max_points, 
-    IsCompatible, compatible_data,
-    points, distances_squared);
+  // Insert points in order of increasing distance
+  for (int i = 0; i < npoints; i++) points.Insert(tmp_points[i]);
 
-  // Update return distances
-  if (distances) {
-    for (int i = 0; i < points.NEntries(); i++) {
-      distances[i] = sqrt(distances_squared[i]);
-    }
-  }
-
-  // Delete temporary array of squared distances
-  delete [] distances_squared;
+  // Delete temporary arrays
+  if (!distances) delete [] tmp_distances;
+  delete [] tmp_points;
 
   // Return number of points
   return points.NEntries();
@@ -655,30 +767,22 @@ FindClosest(const R3Point& query_position, RNScalar min_distance, RNScalar max_d
 {
   // Check root
   if (!root) return 0;
+  if (max_points <= 0) return 0;
 
-  // Use squared distances for efficiency
-  RNLength min_distance_squared = min_distance * min_distance;
-  RNLength max_distance_squared = max_distance * max_distance;
+  // Allocate temporary arrays for max_points closest points
+  PtrType *tmp_points = new PtrType [ max_points ];
+  RNLength *tmp_distances = (distances) ? distances : new RNLength [ max_points ];
 
-  // Allocate temporary array of squared distances to max_points closest points
-  RNLength *distances_squared = new RNLength [ max_points ];
+  // Search nodes
+  int npoints = FindClosest(query_position, min_distance, max_distance, max_points, 
+    tmp_points, tmp_distances);
 
-  // Search nodes recursively
-  FindClosest(root, bbox, 
-    NULL, query_position, 
-    min_distance_squared, max_distance_squared, max_points, 
-    NULL, NULL, 
-    points, distances_squared);
-
-  // Update return distances
-  if (distances) {
-    for (int i = 0; i < points.NEntries(); i++) {
-      distances[i] = sqrt(distances_squared[i]);
-    }
-  }
+  // Insert points in order of increasing distance
+  for (int i = 0; i < npoints; i++) points.Insert(tmp_points[i]);
 
-  // Delete temporary array of squared distances
-  delete [] distances_squared;
+  // Delete temporary arrays
+  if (!distances) delete [] tmp_distances;
+  delete [] tmp_points;
 
   // Return number of points
   return points.NEntries();
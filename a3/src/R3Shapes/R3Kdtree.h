@@ -75,6 +75,17 @@ public:
     RNLength min_distance, RNLength max_distance, int max_points, 
     RNArray<PtrType>& points, RNLength *distances = NULL) const;
 
+  // Search for closest K, writing up to max_points points and their 
+  // distances into caller-provided arrays (sorted by increasing distance),
+  // so that repeated queries allocate nothing
+  int FindClosest(PtrType query_point, 
+    RNLength min_distance, RNLength max_distance, int max_points, 
+    int (*IsCompatible)(PtrType, PtrType, void *), void *compatible_data, 
+    PtrType *points, RNLength *distances) const;
+  int FindClosest(const R3Point& query_position, 
+    RNLength min_distance, RNLength max_distance, int max_points, 
+    PtrType *points, RNLength *distances) const;
+
   // Search for all within some distance 
   int FindAll(PtrType query_point, 
     RNLength min_distance, RNLength max_distance, 
@@ -115,11 +126,11 @@ public:
     RNLength min_distance_squared, RNLength max_distance_squared, 
     int (*IsCompatible)(PtrType, PtrType, void *), void *compatible_data, 
     PtrType& closest_point, RNLength& closest_distance_squared) const;
-  void FindClosest(R3KdtreeNode<PtrType> *node, const R3Box& node_box, 
+  void FindClosest(R3KdtreeNode<PtrType> *node, RNLength node_distance_squared, RNLength node_offsets[3], 
     PtrType query_point, const R3Point& query_position, 
-    RNLength min_distance_squared, RNLength max_distance_squared, int max_points, 
+    RNLength min_distance_squared, RNLength& max_distance_squared, int max_points, 
     int (*IsCompatible)(PtrType, PtrType, void *), void *compatible_data, 
-    RNArray<PtrType>& points, RNLength *distances_squared) const;
+    PtrType *points, RNLength *distances_squared, int& npoints) const;
   void FindAll(R3KdtreeNode<PtrType> *node, const R3Box& node_box, 
     PtrType query_point, const R3Point& position, 
     RNLength min_distance_squared, RNLength max_distance_squared, 
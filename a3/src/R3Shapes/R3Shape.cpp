@@ -218,6 +218,17 @@ Transform(const R3Transformation& /* transformation */)
 
 
 
+RNBoolean R3Shape::
+Occluded(const R3Ray& ray, RNScalar min_t, RNScalar max_t) const
+{
+    // Check for intersection within [min_t, max_t] - this may be overridden
+    RNScalar t;
+    if (!Intersects(ray, NULL, NULL, &t)) return FALSE;
+    return ((t >= min_t) && (t <= max_t)) ? TRUE : FALSE;
+}
+
+
+
 void R3Shape::
 Draw(const R3DrawFlags ) const
 {
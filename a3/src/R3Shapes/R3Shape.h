@@ -40,6 +40,9 @@ class R3Shape /* : public R3Base */ {
 	// Manipulation functions/operators
 	virtual void Transform(const R3Transformation& transformation);
 
+	// Ray query functions/operators
+	virtual RNBoolean Occluded(const R3Ray& ray, RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+
 	// Draw functions/operations
 	virtual void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS) const;
 	virtual void Outline(const R3DrawFlags draw_flags = R3_EDGES_DRAW_FLAG) const;
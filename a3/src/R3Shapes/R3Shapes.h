@@ -37,6 +37,8 @@ class R3Ellipsoid;
 class R3Surface;
 class R3Triangle;
 class R3TriangleArray;
+class R3Bvh;
+struct R3RayPacket;
 class R3Circle;
 class R3Ellipse;
 class R3Mesh;
@@ -131,6 +133,7 @@ class R3Grid;
 #include "R3Shapes/R3Relate.h"
 #include "R3Shapes/R3Align.h"
 #include "R3Shapes/R3Kdtree.h"
+#include "R3Shapes/R3Bvh.h"
 
 
 
@@ -14,6 +14,12 @@ RN_CLASS_TYPE_DEFINITIONS(R3TriangleArray);
 
 
 
+/* Private variables */
+
+static std::mutex R3triangle_array_bvh_mutex;
+
+
+
 /* Public functions */
 
 int 
@@ -34,7 +40,8 @@ R3StopTriangleArray()
 
 R3TriangleArray::
 R3TriangleArray(void)
-    : bbox(R3null_box)
+    : bbox(R3null_box),
+      bvh(NULL)
 {
 }
 
@@ -44,7 +51,8 @@ R3TriangleArray::
 R3TriangleArray(const R3TriangleArray& array)
   : vertices(array.vertices),
     triangles(array.triangles),
-    bbox(array.bbox)
+    bbox(array.bbox),
+    bvh(NULL)
 {
 }
 
@@ -54,7 +62,8 @@ R3TriangleArray::
 R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Triangle *>& triangles)
   : vertices(vertices),
     triangles(triangles),
-    bbox(R3null_box)
+    bbox(R3null_box),
+    bvh(NULL)
 {
     // Update bounding box
     Update();
@@ -62,6 +71,65 @@ R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Tri
 
 
 
+R3TriangleArray::
+~R3TriangleArray(void)
+{
+    // Delete bounding volume hierarchy
+    delete bvh.load();
+}
+
+
+
+const R3Bvh *R3TriangleArray::
+Bvh(void) const
+{
+    // Return hierarchy if it has already been built
+    R3Bvh *result = bvh.load(std::memory_order_acquire);
+    if (result) return result;
+
+    // Build hierarchy (only one thread does so)
+    std::lock_guard<std::mutex> lock(R3triangle_array_bvh_mutex);
+    result = bvh.load(std::memory_order_relaxed);
+    if (!result) {
+      R3Box *boxes = new R3Box [ triangles.NEntries() ];
+      for (int i = 0; i < triangles.NEntries(); i++) 
+        boxes[i] = triangles[i]->Box();
+      result = new R3Bvh(boxes, triangles.NEntries());
+      delete [] boxes;
+      bvh.store(result, std::memory_order_release);
+    }
+
+    // Return hierarchy
+    return result;
+}
+
+
+
+struct R3TriangleArrayAnyIntersector {
+    // Finds any intersection with triangles
+    const R3TriangleArray *array;
+    RNBoolean operator()(int index, const R3Ray& ray, RNScalar min_t, RNScalar& max_t) {
+        RNScalar t;
+        if (R3Intersects(ray, *(array->Triangle(index)), NULL, NULL, &t) != R3_POINT_CLASS_ID) return FALSE;
+        if ((t < min_t) || (t > max_t)) return FALSE;
+        max_t = t;
+        return TRUE;
+    }
+};
+
+
+
+RNBoolean R3TriangleArray::
+Occluded(const R3Ray& ray, RNScalar min_t, RNScalar max_t) const
+{
+    // Find any intersection with hierarchy
+    R3TriangleArrayAnyIntersector intersector;
+    intersector.array = this;
+    return Bvh()->Intersects(ray, intersector, min_t, max_t, TRUE);
+}
+
+
+
 const RNBoolean R3TriangleArray::
 IsPoint (void) const
 {
@@ -352,6 +420,9 @@ Subdivide(RNLength max_edge_length)
       stack.Insert(t);
     }
   }
+
+  // Invalidate bounding volume hierarchy
+  delete bvh.exchange(NULL);
 }
 
 
@@ -382,6 +453,9 @@ MoveVertex(R3TriangleVertex *vertex, const R3Point& position)
 void R3TriangleArray::
 Update(void)
 {
+    // Invalidate bounding volume hierarchy
+    delete bvh.exchange(NULL);
+
     // Recompute bounding box
     bbox = R3null_box;
     for (int i = 0; i < vertices.NEntries(); i++) {
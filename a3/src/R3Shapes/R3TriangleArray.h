@@ -17,6 +17,7 @@ class R3TriangleArray : public R3Surface {
         R3TriangleArray(void);
         R3TriangleArray(const R3TriangleArray& array);
         R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Triangle *>& triangles);
+        virtual ~R3TriangleArray(void);
 
         // Triangle array properties
         const R3Box& Box(void) const;
@@ -29,6 +30,9 @@ class R3TriangleArray : public R3Surface {
         int NTriangles(void) const;
 	R3Triangle *Triangle(int index) const;
 
+        // Acceleration structure functions (hierarchy is built on first use)
+        const R3Bvh *Bvh(void) const;
+
         // Shape property functions/operators
 	virtual const RNBoolean IsPoint(void) const;
 	virtual const RNBoolean IsLinear(void) const;
@@ -52,6 +56,9 @@ class R3TriangleArray : public R3Surface {
 	virtual void MoveVertex(R3TriangleVertex *vertex, const R3Point& position);
 	virtual void Update(void);  
 
+        // Ray query functions/operators
+        virtual RNBoolean Occluded(const R3Ray& ray, RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+
         // Draw functions/operators
         virtual void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS) const;
 
@@ -63,6 +70,7 @@ class R3TriangleArray : public R3Surface {
 	RNArray<R3TriangleVertex *> vertices;
 	RNArray<R3Triangle *> triangles;
         R3Box bbox;
+        mutable std::atomic<R3Bvh *> bvh;
 };
 
 
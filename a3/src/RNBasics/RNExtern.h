@@ -15,6 +15,13 @@
 
 
 
+/* Standard C++ include files */
+
+#include <atomic>
+#include <mutex>
+
+
+
 /* Machine dependent include files */
 
 #if (RN_OS == RN_WINDOWS)
@@ -27,3 +34,12 @@
 #endif
 
 
+
+/* SIMD include files (packet ray tracing falls back to scalar code without them) */
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#   include <xmmintrin.h>
+#   define RN_USE_SSE
+#endif
+
+
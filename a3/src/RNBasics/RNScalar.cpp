@@ -40,7 +40,15 @@ const RNScalar RN_SQRT_THREE = 1.7320508;
 
 /* Private variables */
 
-static RNBoolean random_seeded = FALSE;
+// Each thread draws from its own 48-bit linear congruential generator
+// (the same recurrence as drand48), so that worker threads never share
+// random state and can be seeded independently
+
+static thread_local RNBoolean random_seeded = FALSE;
+static thread_local unsigned long long random_state = 0;
+static const unsigned long long random_multiplier = 0x5DEECE66DULL;
+static const unsigned long long random_increment = 0xBULL;
+static const unsigned long long random_mask = (1ULL << 48) - 1;
 
 
 
@@ -96,23 +104,47 @@ RNSetEpsilon(RNScalar epsilon)
 
 /* Random number functions */
 
+static void
+RNSetRandomState(unsigned long long seed)
+{
+    // Initialize state the same way as srand48
+    random_state = ((seed << 16) | 0x330EULL) & random_mask;
+    random_seeded = TRUE;
+}
+
+
+
 void 
 RNSeedRandomScalar(RNScalar seed)
 {
 #if (RN_OS == RN_WINDOWS)
-  if (seed == 0.0) srand(GetTickCount());
-  else srand((int) (1.0E6 * seed));
+  if (seed == 0.0) RNSetRandomState((unsigned long long) GetTickCount());
+  else RNSetRandomState((unsigned long long) (long) (1.0E6 * seed));
 #else
   if (seed == 0.0) { 
       struct timeval timevalue;
       gettimeofday(&timevalue, NULL);
-      srand48(timevalue.tv_usec);
+      RNSetRandomState((unsigned long long) timevalue.tv_usec);
   }
   else {
-    srand48((long) (1.0E6 * seed));
+    RNSetRandomState((unsigned long long) (long) (1.0E6 * seed));
   }
 #endif
-  random_seeded = TRUE;
+}
+
+
+
+void 
+RNSeedRandomScalarStream(unsigned int seed, unsigned int stream)
+{
+    // Mix seed and stream index (splitmix64 finalizer), so that
+    // neighboring streams start far apart in the generator sequence
+    unsigned long long z = ((unsigned long long) seed << 32) | stream;
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    RNSetRandomState(z);
 }
 
 
@@ -120,14 +152,10 @@ RNSeedRandomScalar(RNScalar seed)
 RNScalar
 RNRandomScalar(void)
 {
+    // Advance this thread's generator and return value in [0,1)
     if (!random_seeded) RNSeedRandomScalar();
-#   if (RN_OS == RN_WINDOWS)
-    int r1 = rand();
-    RNScalar r2 = ((RNScalar) rand()) / ((RNScalar) (RAND_MAX + 1));
-    return (r1 + r2) / ((RNScalar) (RAND_MAX + 1));
-#else
-    return drand48();
-#   endif
+    random_state = (random_multiplier * random_state + random_increment) & random_mask;
+    return (RNScalar) random_state / (RNScalar) (1ULL << 48);
 }
 
 
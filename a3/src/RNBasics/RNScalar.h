@@ -173,6 +173,7 @@ extern void RNSetEpsilon(RNScalar epsilon);
 /* Random number generator */
 
 extern void RNSeedRandomScalar(RNScalar seed = 0.0);
+extern void RNSeedRandomScalarStream(unsigned int seed, unsigned int stream);
 extern RNScalar RNRandomScalar(void);
 
 
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <mutex>
+
+#include "R3Graphics/R3Graphics.h"
+#include "irradiancecache.h"
+
+// Maximum depth of the octree below the root
+static const int MAX_DEPTH = 20;
+
+IrradianceCache::IrradianceCache(const R3Box& bbox, RNScalar max_error_)
+  : max_error(max_error_),
+    center(bbox.Centroid()),
+    half_size(0.5 * 1.01 * std::max(bbox.LongestAxisLength(), RN_EPSILON)),
+    nodes(1)
+{
+}
+
+int IrradianceCache::NRecords(void) const
+{
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  return (int) records.size();
+}
+
+RNBoolean IrradianceCache::Interpolate(const R3Point& position, const R3Vector& normal,
+  RNRgb *irradiance) const
+{
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  if (records.empty()) return FALSE;
+
+  // Visit every node whose cube, grown by half its side on each side,
+  // contains position -- the others hold no records valid there
+  RNScalar total_weight = 0;
+  RNRgb sum = RNblack_rgb;
+  struct Entry { int index; R3Point center; RNLength half_size; };
+  Entry stack[8 * MAX_DEPTH + 1];
+  int nstack = 0;
+  stack[nstack++] = { 0, center, half_size };
+  while (nstack > 0) {
+    Entry entry = stack[--nstack];
+    const Node& node = nodes[entry.index];
+
+    // Accumulate weighted estimates from the records valid at position
+    for (int r : node.records) {
+      const Record& record = records[r];
+      R3Vector offset = position - record.position;
+      RNScalar error = offset.Length() / record.radius +
+        sqrt(std::max(0.0, 1.0 - normal.Dot(record.normal)));
+      if (error >= max_error) continue;
+
+      // Skip records in front of position (they see different geometry)
+      R3Vector average_normal = normal + record.normal;
+      if (offset.Dot(average_normal) < -0.1 * record.radius) continue;
+
+      // Extrapolate record to position with its gradient
+      RNRgb estimate(record.irradiance.R() + record.gradient[0].Dot(offset),
+        record.irradiance.G() + record.gradient[1].Dot(offset),
+        record.irradiance.B() + record.gradient[2].Dot(offset));
+      RNScalar weight = 1.0 / std::max(error, 1.0E-6);
+      sum += weight * estimate;
+      total_weight += weight;
+    }
+
+    // Visit children whose grown cubes contain position
+    RNLength child_half_size = 0.5 * entry.half_size;
+    for (int i = 0; i < 8; i++) {
+      if (node.children[i] < 0) continue;
+      R3Point child_center = entry.center;
+      child_center[0] += (i & 1) ? child_half_size : -child_half_size;
+      child_center[1] += (i & 2) ? child_half_size : -child_half_size;
+      child_center[2] += (i & 4) ? child_half_size : -child_half_size;
+      if (fabs(position[0] - child_center[0]) > 2 * child_half_size) continue;
+      if (fabs(position[1] - child_center[1]) > 2 * child_half_size) continue;
+      if (fabs(position[2] - child_center[2]) > 2 * child_half_size) continue;
+      stack[nstack++] = { node.children[i], child_center, child_half_size };
+    }
+  }
+
+  // Return weighted average
+  if (total_weight == 0) return FALSE;
+  sum /= total_weight;
+  irradiance->Reset(std::max(sum.R(), 0.0), std::max(sum.G(), 0.0), std::max(sum.B(), 0.0));
+  return TRUE;
+}
+
+void IrradianceCache::Insert(const R3Point& position, const R3Vector& normal,
+  const RNRgb& irradiance, const R3Vector gradient[3], RNLength radius)
+{
+  if (radius <= 0) return;
+
+  // Create record
+  Record record;
+  record.position = position;
+  record.normal = normal;
+  record.irradiance = irradiance;
+  for (int c = 0; c < 3; c++) record.gradient[c] = gradient[c];
+  record.radius = radius;
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  int r = (int) records.size();
+  records.push_back(record);
+
+  // Descend to the smallest node whose half side still covers the
+  // record's validity distance (records outside the root stay there)
+  RNLength validity = max_error * radius;
+  int index = 0;
+  R3Point node_center = center;
+  RNLength node_half_size = half_size;
+  int max_depth = MAX_DEPTH;
+  for (int dim = 0; dim < 3; dim++) {
+    if (fabs(position[dim] - center[dim]) > half_size) max_depth = 0;
+  }
+  for (int depth = 0; depth < max_depth; depth++) {
+    RNLength child_half_size = 0.5 * node_half_size;
+    if (child_half_size < validity) break;
+    int i = 0;
+    if (position[0] >= node_center[0]) i |= 1;
+    if (position[1] >= node_center[1]) i |= 2;
+    if (position[2] >= node_center[2]) i |= 4;
+    node_center[0] += (i & 1) ? child_half_size : -child_half_size;
+    node_center[1] += (i & 2) ? child_half_size : -child_half_size;
+    node_center[2] += (i & 4) ? child_half_size : -child_half_size;
+    node_half_size = child_half_size;
+    if (nodes[index].children[i] < 0) {
+      nodes[index].children[i] = (int) nodes.size();
+      nodes.emplace_back();
+    }
+    index = nodes[index].children[i];
+  }
+
+  nodes[index].records.push_back(r);
+}
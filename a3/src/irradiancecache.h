@@ -0,0 +1,61 @@
+// Include file for the irradiance cache
+
+#ifndef IRRADIANCECACHE_H
+#define IRRADIANCECACHE_H
+
+#include <shared_mutex>
+#include <vector>
+
+// Ward-style irradiance cache: irradiance records are stored in an octree
+// and interpolated (with their translational gradients) at nearby points
+// whose error estimate
+//
+//   e(x, n) = |x - x_i| / R_i + sqrt(1 - n . n_i)
+//
+// is below the maximum error, where R_i is the record's validity radius.
+// Lookups and insertions may be made concurrently from several threads.
+class IrradianceCache {
+public:
+  // Constructors (bbox bounds the points that will be cached)
+  IrradianceCache(const R3Box& bbox, RNScalar max_error);
+
+  // Property functions
+  int NRecords(void) const;
+  RNScalar MaxError(void) const { return max_error; }
+
+  // Query functions: interpolate irradiance at position from the records
+  // valid there, returning FALSE if there are none
+  RNBoolean Interpolate(const R3Point& position, const R3Vector& normal,
+    RNRgb *irradiance) const;
+
+  // Manipulation functions: add a record with irradiance gradients (one
+  // per color channel) and validity radius
+  void Insert(const R3Point& position, const R3Vector& normal,
+    const RNRgb& irradiance, const R3Vector gradient[3], RNLength radius);
+
+private:
+  struct Record {
+    R3Point position;
+    R3Vector normal;
+    RNRgb irradiance;
+    R3Vector gradient[3];
+    RNLength radius;
+  };
+
+  // Octree node, holding the records whose validity distance is at most
+  // half its side length
+  struct Node {
+    Node(void) { for (int i = 0; i < 8; i++) children[i] = -1; }
+    int children[8];
+    std::vector<int> records;
+  };
+
+  mutable std::shared_mutex mutex;
+  RNScalar max_error;
+  R3Point center;       // center of root node
+  RNLength half_size;   // half side length of root node
+  std::vector<Node> nodes;
+  std::vector<Record> records;
+};
+
+#endif
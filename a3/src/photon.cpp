@@ -1,28 +1,550 @@
+#include <algorithm>
+
 #include "R3Graphics/R3Graphics.h"
 #include "photon.h"
 
+#ifndef PHOTON_DEBUG
+static_assert(sizeof(Photon) == 20, "Photon should be packed into 20 bytes");
+#endif
+
+// Sines and cosines of the quantized photon direction angles
+struct PhotonDirectionTable {
+  PhotonDirectionTable(void) {
+    for (int i = 0; i < 256; i++) {
+      double theta = (i + 0.5) * (RN_PI / 256.0);
+      double phi = (i + 0.5) * (2.0 * RN_PI / 256.0);
+      cos_theta[i] = cos(theta);
+      sin_theta[i] = sin(theta);
+      cos_phi[i] = cos(phi);
+      sin_phi[i] = sin(phi);
+    }
+  }
+  double cos_theta[256], sin_theta[256];
+  double cos_phi[256], sin_phi[256];
+};
+
+static const PhotonDirectionTable& DirectionTable(void)
+{
+  static const PhotonDirectionTable table;
+  return table;
+}
+
+Photon::Photon(const R3Point& position_, const R3Vector& direction_, const RNRgb& power_) :
+  flag(0)
+{
+  // Store position in single precision
+  position[0] = (float) position_.X();
+  position[1] = (float) position_.Y();
+  position[2] = (float) position_.Z();
+
+  // Store power
+  SetPower(power_);
+
+  // Store direction as spherical angles quantized to 256 steps
+  R3Vector d = direction_;
+  d.Normalize();
+  int t = (int) (acos(std::min(std::max(d.Z(), -1.0), 1.0)) * (256.0 / RN_PI));
+  int p = (int) floor(atan2(d.Y(), d.X()) * (256.0 / (2.0 * RN_PI)));
+  theta = (unsigned char) std::min(t, 255);
+  phi = (unsigned char) (p & 255); // azimuths in [-pi, 0) wrap to [pi, 2pi)
+
+#ifdef PHOTON_DEBUG
+  bounces = 0;
+  start_pos[0] = position[0];
+  start_pos[1] = position[1];
+  start_pos[2] = position[2];
+#endif
+}
+
+void Photon::SetPower(const RNRgb& power_)
+{
+  // Store power with a shared exponent (Ward's RGBE format)
+  double v = std::max(std::max(power_.R(), power_.G()), power_.B());
+  if (v < 1.0E-32) {
+    power[0] = power[1] = power[2] = power[3] = 0;
+  }
+  else {
+    int e;
+    double scale = frexp(v, &e) * 256.0 / v;
+    power[0] = (unsigned char) (std::max(power_.R(), 0.0) * scale);
+    power[1] = (unsigned char) (std::max(power_.G(), 0.0) * scale);
+    power[2] = (unsigned char) (std::max(power_.B(), 0.0) * scale);
+    power[3] = (unsigned char) (e + 128);
+  }
+}
+
+R3Vector Photon::Direction(void) const
+{
+  const PhotonDirectionTable& table = DirectionTable();
+  return R3Vector(table.sin_theta[theta] * table.cos_phi[phi],
+    table.sin_theta[theta] * table.sin_phi[phi],
+    table.cos_theta[theta]);
+}
+
+RNRgb Photon::Power(void) const
+{
+  // Decode RGBE, placing nonzero mantissas at the center of their bin
+  if (power[3] == 0) return RNblack_rgb;
+  double f = ldexp(1.0, power[3] - (128 + 8));
+  return RNRgb((power[0] > 0) ? (power[0] + 0.5) * f : 0.0,
+    (power[1] > 0) ? (power[1] + 0.5) * f : 0.0,
+    (power[2] > 0) ? (power[2] + 0.5) * f : 0.0);
+}
+
 R3Ray Photon::Ray(void) const
 {
-  return R3Ray(position, direction);
+  return R3Ray(Position(), Direction());
 }
 
-static R3Point
-GetPhotonPosition(Photon *photon, void *dummy)
+// Return the number of nodes in the left subtree of a left-balanced
+// (complete) binary tree with n nodes
+static size_t
+LeftSubtreeSize(size_t n)
 {
-  R3Point pos = photon->position;
-  return R3Point(pos.X(), pos.Y(), pos.Z());
+  if (n < 2) return 0;
+
+  // Find the number of levels below the root that are full
+  size_t full = 1; // nodes on the deepest full level
+  while (4 * full - 1 <= n) full *= 2;
+
+  // Left subtree has the full levels above, plus as much of the
+  // deepest level as fits on the left
+  size_t last = n - (2 * full - 1);
+  return (full - 1) + std::min(last, full);
 }
 
-int PhotonMap::BuildKdTree(void) {
-  tree = new R3Kdtree<Photon *>(intersections, GetPhotonPosition);
-  if (!tree) {
-    fprintf(stderr, "Unable to create KD tree\n");
-    return 0;
+// Store photons [first, last) as the subtree rooted at heap index node:
+// the photon at the split is the one that makes the left subtree exactly
+// as large as a left-balanced tree requires
+static void
+BuildKdTree(Photon *first, Photon *last, std::vector<Photon>& heap, size_t node)
+{
+  size_t n = last - first;
+  if (n == 0) return;
+
+  // Find the axis of greatest extent
+  float low[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+  float high[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  for (Photon *p = first; p < last; p++) {
+    for (int dim = 0; dim < 3; dim++) {
+      low[dim] = std::min(low[dim], p->position[dim]);
+      high[dim] = std::max(high[dim], p->position[dim]);
+    }
   }
+  int axis = 0;
+  if (high[1] - low[1] > high[axis] - low[axis]) axis = 1;
+  if (high[2] - low[2] > high[axis] - low[axis]) axis = 2;
+
+  // Partition around the split photon
+  Photon *median = first + LeftSubtreeSize(n);
+  std::nth_element(first, median, last, [axis](const Photon& a, const Photon& b) {
+    return a.position[axis] < b.position[axis];
+  });
+  heap[node] = *median;
+  heap[node].flag = (short) ((heap[node].flag & ~PHOTON_AXIS_MASK) | axis);
+
+  BuildKdTree(first, median, heap, 2 * node + 1);
+  BuildKdTree(median + 1, last, heap, 2 * node + 2);
+}
+
+int PhotonMap::BuildKdTree(void) {
+  // Arrange photons as a left-balanced kd-tree in heap order
+  std::vector<Photon> heap(storage.size());
+  if (!storage.empty()) ::BuildKdTree(&storage[0], &storage[0] + storage.size(), heap, 0);
+  storage.swap(heap);
+  photons = storage.data();
+  nphotons = (int) storage.size();
 
   return 1;
 }
 
-void PhotonMap::AddPhotonIntersection(Photon *photon) {
-  intersections.Insert(photon);
+void PhotonMap::AddPhotons(const std::vector<Photon>& stored) {
+  storage.insert(storage.end(), stored.begin(), stored.end());
+  photons = storage.data();
+  nphotons = (int) storage.size();
+}
+
+void PhotonMap::SetKdTree(const Photon *tree, int ntree) {
+  std::vector<Photon>().swap(storage);
+  photons = tree;
+  nphotons = ntree;
+}
+
+int PhotonMap::FindClosest(const R3Point& position, RNLength max_distance, int max_photons,
+  NearestPhotons& nearest) const
+{
+  nearest.Reset(max_photons, max_distance * max_distance);
+  if ((nphotons == 0) || (max_photons <= 0)) return 0;
+
+  RNScalar p[3] = { position.X(), position.Y(), position.Z() };
+  FindClosest(0, p, nearest);
+  return nearest.NPhotons();
+}
+
+void PhotonMap::FindClosest(int index, const RNScalar position[3], NearestPhotons& nearest) const
+{
+  const Photon& photon = photons[index];
+
+  // Search the child on the query's side of the split first, and the
+  // other one only if the split plane is within the search radius
+  int left = 2 * index + 1;
+  if (left < nphotons) {
+    RNScalar side = position[photon.Axis()] - photon.position[photon.Axis()];
+    int near = (side < 0) ? left : left + 1;
+    int far = (side < 0) ? left + 1 : left;
+    if (near < nphotons) FindClosest(near, position, nearest);
+    if ((far < nphotons) && (side * side < nearest.MaxSquaredDistance())) {
+      FindClosest(far, position, nearest);
+    }
+  }
+
+  // Check this photon
+  RNScalar dx = position[0] - photon.position[0];
+  RNScalar dy = position[1] - photon.position[1];
+  RNScalar dz = position[2] - photon.position[2];
+  RNScalar distance_squared = dx * dx + dy * dy + dz * dz;
+  if (distance_squared < nearest.MaxSquaredDistance()) nearest.Insert(&photon, distance_squared);
+}
+
+void PhotonMap::FindClosest(const R3Point& position, RNLength max_global_distance,
+  int max_global_photons, RNLength max_caustic_distance, int max_caustic_photons,
+  NearestPhotons& global, NearestPhotons& caustic) const
+{
+  // Heaps that are not searched get an empty search radius
+  global.Reset(max_global_photons, (max_global_photons > 0) ? max_global_distance * max_global_distance : 0);
+  caustic.Reset(max_caustic_photons, (max_caustic_photons > 0) ? max_caustic_distance * max_caustic_distance : 0);
+  if (nphotons == 0) return;
+
+  NearestPhotons *nearest[2] = { &global, &caustic };
+  RNScalar p[3] = { position.X(), position.Y(), position.Z() };
+  FindClosest(0, p, nearest);
+}
+
+void PhotonMap::FindClosest(int index, const RNScalar position[3], NearestPhotons *nearest[2]) const
+{
+  const Photon& photon = photons[index];
+
+  // Search the child on the query's side of the split first, and the
+  // other one only if the split plane is within either search radius
+  int left = 2 * index + 1;
+  if (left < nphotons) {
+    RNScalar side = position[photon.Axis()] - photon.position[photon.Axis()];
+    int near = (side < 0) ? left : left + 1;
+    int far = (side < 0) ? left + 1 : left;
+    if (near < nphotons) FindClosest(near, position, nearest);
+    RNScalar max_distance_squared = std::max(nearest[0]->MaxSquaredDistance(), nearest[1]->MaxSquaredDistance());
+    if ((far < nphotons) && (side * side < max_distance_squared)) {
+      FindClosest(far, position, nearest);
+    }
+  }
+
+  // Check this photon against the heap for its type
+  NearestPhotons *heap = nearest[photon.IsCaustic() ? 1 : 0];
+  RNScalar dx = position[0] - photon.position[0];
+  RNScalar dy = position[1] - photon.position[1];
+  RNScalar dz = position[2] - photon.position[2];
+  RNScalar distance_squared = dx * dx + dy * dy + dz * dz;
+  if (distance_squared < heap->MaxSquaredDistance()) heap->Insert(&photon, distance_squared);
+}
+
+void PhotonMap::GatherClosest(const R3Point *points, int npoints, RNLength max_distance,
+  int max_photons, PhotonGather *results, PhotonFilter filter) const
+{
+  RNLength max_distances[2] = { max_distance, 0 };
+  int max_photon_counts[2] = { max_photons, 0 };
+  PhotonGather *gathers[2] = { results, NULL };
+  GatherClosest(points, npoints, max_distances, max_photon_counts, gathers, filter);
+}
+
+void PhotonMap::GatherClosest(const R3Point *points, int npoints,
+  RNLength max_global_distance, int max_global_photons, PhotonGather *global_results,
+  RNLength max_caustic_distance, int max_caustic_photons, PhotonGather *caustic_results,
+  PhotonFilter filter) const
+{
+  RNLength max_distances[2] = { max_global_distance, max_caustic_distance };
+  int max_photon_counts[2] = { max_global_photons, max_caustic_photons };
+  PhotonGather *gathers[2] = { global_results, caustic_results };
+  GatherClosest(points, npoints, max_distances, max_photon_counts, gathers, filter);
+}
+
+void PhotonMap::GatherClosest(const R3Point *points, int npoints, const RNLength max_distance[2],
+  const int max_photons[2], PhotonGather *results[2], PhotonFilter filter) const
+{
+  // Sort queries along a Z-order curve through their bounding box, so
+  // that consecutive searches visit mostly the same nodes
+  R3Box box = R3null_box;
+  for (int q = 0; q < npoints; q++) box.Union(points[q]);
+  std::vector<std::pair<unsigned long long, int> > order(npoints);
+  for (int q = 0; q < npoints; q++) order[q] = std::make_pair(MortonCode(points[q], box, 21), q);
+  std::sort(order.begin(), order.end());
+
+  // Answer queries in order, with heaps and a stack shared by all of them
+  // (the stack holds the far children skipped on the way down, with the
+  // squared distance to their split planes, and has at most one entry per
+  // level of the tree).  Caustic photons go in the second heap if there
+  // are results for it, and are not told apart otherwise.
+  static thread_local NearestPhotons thread_nearest[2];
+  NearestPhotons *nearest = thread_nearest;
+  int nheaps = (results[1]) ? 2 : 1;
+  int stack_index[64];
+  RNScalar stack_distance_squared[64];
+  int path[64];
+  const R3Point *previous_point[2] = { NULL, NULL };
+  RNScalar previous_radius[2] = { 0, 0 };
+  for (int o = 0; o < npoints; o++) {
+    int q = order[o].second;
+    const R3Point& point = points[q];
+    RNScalar p[3] = { point.X(), point.Y(), point.Z() };
+
+    // The previous query's photons are all within its radius plus the
+    // distance between the queries, so this query's are too (the bound
+    // is grown slightly to keep photons at exactly that distance)
+    nearest[1].Reset(0, 0);
+    for (int h = 0; h < nheaps; h++) {
+      RNScalar bound_squared = (max_photons[h] > 0) ? max_distance[h] * max_distance[h] : 0;
+      if (previous_point[h]) {
+        RNScalar bound = previous_radius[h] + R3Distance(point, *previous_point[h]);
+        bound_squared = std::min(bound_squared, bound * bound * (1.0 + 1.0E-9));
+      }
+      nearest[h].Reset(max_photons[h], bound_squared);
+    }
+
+    // Search the tree, descending toward the query from each node taken
+    // off the stack and then checking the photons passed on the way back
+    // up (nearest first, so that the search radius shrinks quickly)
+    int nstack = 0;
+    if (nphotons > 0) {
+      stack_index[nstack] = 0;
+      stack_distance_squared[nstack++] = 0;
+    }
+    while (nstack > 0) {
+      nstack--;
+      RNScalar max_distance_squared = std::max(nearest[0].MaxSquaredDistance(), nearest[1].MaxSquaredDistance());
+      if (stack_distance_squared[nstack] >= max_distance_squared) continue;
+      int npath = 0;
+      int index = stack_index[nstack];
+      while (index < nphotons) {
+        path[npath++] = index;
+        const Photon& photon = photons[index];
+        int left = 2 * index + 1;
+        if (left >= nphotons) break;
+        RNScalar side = p[photon.Axis()] - photon.position[photon.Axis()];
+        int far = (side < 0) ? left + 1 : left;
+        if (far < nphotons) {
+          stack_index[nstack] = far;
+          stack_distance_squared[nstack++] = side * side;
+        }
+        index = (side < 0) ? left : left + 1;
+      }
+      while (npath > 0) {
+        const Photon& photon = photons[path[--npath]];
+        NearestPhotons& heap = nearest[((nheaps > 1) && photon.IsCaustic()) ? 1 : 0];
+        RNScalar dx = p[0] - photon.position[0];
+        RNScalar dy = p[1] - photon.position[1];
+        RNScalar dz = p[2] - photon.position[2];
+        RNScalar distance_squared = dx * dx + dy * dy + dz * dz;
+        if (distance_squared < heap.MaxSquaredDistance()) heap.Insert(&photon, distance_squared);
+      }
+    }
+
+    for (int h = 0; h < nheaps; h++) {
+      // Sum power of photons found, weighted by the filter
+      PhotonGather& result = results[h][q];
+      result.power = RNblack_rgb;
+      result.nphotons = nearest[h].NPhotons();
+      result.radius_squared = (result.nphotons > 0) ? nearest[h].SquaredDistance(0) : 0;
+      if (filter == BOX_FILTER) {
+        for (int i = 0; i < result.nphotons; i++) result.power += nearest[h].Kth(i)->Power();
+      }
+      else {
+        for (int i = 0; i < result.nphotons; i++) {
+          RNScalar weight = PhotonFilterWeight(filter, nearest[h].SquaredDistance(i), result.radius_squared);
+          result.power += weight * nearest[h].Kth(i)->Power();
+        }
+      }
+
+      // Use this query's radius to bound the next one's if it found all
+      // the photons it could
+      if ((max_photons[h] > 0) && (result.nphotons == max_photons[h])) {
+        previous_point[h] = &point;
+        previous_radius[h] = sqrt(result.radius_squared);
+      }
+    }
+  }
+}
+
+const Photon *PhotonMap::FindNearest(const R3Point& position, const R3Vector& normal,
+  RNScalar min_cosine, RNLength max_distance) const
+{
+  if (nphotons == 0) return NULL;
+
+  const Photon *nearest = NULL;
+  RNScalar max_distance_squared = max_distance * max_distance;
+  RNScalar p[3] = { position.X(), position.Y(), position.Z() };
+  FindNearest(0, p, normal, min_cosine, nearest, max_distance_squared);
+  return nearest;
+}
+
+void PhotonMap::FindNearest(int index, const RNScalar position[3], const R3Vector& normal,
+  RNScalar min_cosine, const Photon *& nearest, RNScalar& max_distance_squared) const
+{
+  const Photon& photon = photons[index];
+
+  // Search the child on the query's side of the split first
+  int left = 2 * index + 1;
+  if (left < nphotons) {
+    RNScalar side = position[photon.Axis()] - photon.position[photon.Axis()];
+    int near = (side < 0) ? left : left + 1;
+    int far = (side < 0) ? left + 1 : left;
+    if (near < nphotons) {
+      FindNearest(near, position, normal, min_cosine, nearest, max_distance_squared);
+    }
+    if ((far < nphotons) && (side * side < max_distance_squared)) {
+      FindNearest(far, position, normal, min_cosine, nearest, max_distance_squared);
+    }
+  }
+
+  // Check this photon
+  RNScalar dx = position[0] - photon.position[0];
+  RNScalar dy = position[1] - photon.position[1];
+  RNScalar dz = position[2] - photon.position[2];
+  RNScalar distance_squared = dx * dx + dy * dy + dz * dz;
+  if ((distance_squared < max_distance_squared) && (photon.Direction().Dot(normal) >= min_cosine)) {
+    nearest = &photon;
+    max_distance_squared = distance_squared;
+  }
+}
+
+int PhotonMap::SumPower(const R3Point& position, const R3Vector& normal, RNLength max_distance,
+  RNRgb *power) const
+{
+  *power = RNblack_rgb;
+  if (nphotons == 0) return 0;
+
+  RNScalar p[3] = { position.X(), position.Y(), position.Z() };
+  return SumPower(0, p, normal, max_distance * max_distance, power);
+}
+
+int PhotonMap::SumPower(int index, const RNScalar position[3], const R3Vector& normal,
+  RNScalar max_distance_squared, RNRgb *power) const
+{
+  const Photon& photon = photons[index];
+  int count = 0;
+
+  // Search the children whose half-spaces intersect the search sphere
+  int left = 2 * index + 1;
+  if (left < nphotons) {
+    RNScalar side = position[photon.Axis()] - photon.position[photon.Axis()];
+    if ((side < 0) || (side * side < max_distance_squared)) {
+      count += SumPower(left, position, normal, max_distance_squared, power);
+    }
+    if ((left + 1 < nphotons) && ((side >= 0) || (side * side < max_distance_squared))) {
+      count += SumPower(left + 1, position, normal, max_distance_squared, power);
+    }
+  }
+
+  // Check this photon
+  RNScalar dx = position[0] - photon.position[0];
+  RNScalar dy = position[1] - photon.position[1];
+  RNScalar dz = position[2] - photon.position[2];
+  RNScalar distance_squared = dx * dx + dy * dy + dz * dz;
+  if ((distance_squared < max_distance_squared) && (photon.Direction().Dot(normal) < 0)) {
+    *power += photon.Power();
+    count++;
+  }
+
+  return count;
+}
+
+unsigned long long MortonCode(const R3Point& point, const R3Box& box, int bits)
+{
+  unsigned long long code = 0;
+  unsigned int max_cell = (1U << bits) - 1;
+  for (int dim = 0; dim < 3; dim++) {
+    RNLength length = box.AxisLength(dim);
+    RNScalar x = (length > 0) ? (point[dim] - box.Min()[dim]) / length : 0;
+    unsigned int cell = (unsigned int) std::min(std::max(x * (max_cell + 1), 0.0), (RNScalar) max_cell);
+    for (int b = 0; b < bits; b++) {
+      code |= (unsigned long long) ((cell >> b) & 1) << (3 * b + dim);
+    }
+  }
+  return code;
+}
+
+// Slope of the cone filter: photons at the edge of the disc get weight
+// 1 - 1/k (Jensen's k >= 1)
+static const RNScalar CONE_FILTER_K = 1.1;
+
+// Constants of the Gaussian filter (Pavicic's alpha and beta)
+static const RNScalar GAUSSIAN_FILTER_ALPHA = 0.918;
+static const RNScalar GAUSSIAN_FILTER_BETA = 1.953;
+
+RNScalar PhotonFilterWeight(PhotonFilter filter, RNScalar distance_squared,
+  RNScalar radius_squared)
+{
+  if (radius_squared <= 0) return 1;
+  RNScalar x2 = std::min(distance_squared / radius_squared, 1.0);
+  switch (filter) {
+  case CONE_FILTER:
+    // w = 1 - d/(kr), whose mean over the disc is 1 - 2/(3k)
+    return (1 - sqrt(x2) / CONE_FILTER_K) / (1 - 2 / (3 * CONE_FILTER_K));
+
+  case GAUSSIAN_FILTER: {
+    // w = alpha (1 - (1 - exp(-beta d^2/(2r^2))) / (1 - exp(-beta))),
+    // divided by its mean over the disc
+    static const RNScalar b = GAUSSIAN_FILTER_BETA;
+    static const RNScalar mean = GAUSSIAN_FILTER_ALPHA *
+      (1 - (1 - 2 * (1 - exp(-0.5 * b)) / b) / (1 - exp(-b)));
+    return GAUSSIAN_FILTER_ALPHA * (1 - (1 - exp(-0.5 * b * x2)) / (1 - exp(-b))) / mean; }
+
+  case EPANECHNIKOV_FILTER:
+    // w = 1 - d^2/r^2, whose mean over the disc is 1/2
+    return 2 * (1 - x2);
+
+  default:
+    return 1;
+  }
+}
+
+void NearestPhotons::Reset(int max_photons_, RNScalar max_distance_squared_) {
+  max_photons = max_photons_;
+  nphotons = 0;
+  max_distance_squared = max_distance_squared_;
+  if ((int) photons.size() < max_photons) {
+    photons.resize(max_photons);
+    distances_squared.resize(max_photons);
+  }
+}
+
+void NearestPhotons::Insert(const Photon *photon, RNScalar distance_squared) {
+  int i;
+  if (nphotons < max_photons) {
+    // Sift the new photon up from the end of the heap
+    i = nphotons++;
+    while (i > 0) {
+      int parent = (i - 1) / 2;
+      if (distances_squared[parent] >= distance_squared) break;
+      photons[i] = photons[parent];
+      distances_squared[i] = distances_squared[parent];
+      i = parent;
+    }
+  }
+  else {
+    // Replace the farthest photon and sift it down
+    i = 0;
+    while (TRUE) {
+      int child = 2 * i + 1;
+      if (child >= nphotons) break;
+      if ((child + 1 < nphotons) && (distances_squared[child + 1] > distances_squared[child])) child++;
+      if (distances_squared[child] <= distance_squared) break;
+      photons[i] = photons[child];
+      distances_squared[i] = distances_squared[child];
+      i = child;
+    }
+  }
+  photons[i] = photon;
+  distances_squared[i] = distance_squared;
+
+  // Shrink the search radius to the farthest photon once the heap is full
+  if (nphotons == max_photons) max_distance_squared = distances_squared[0];
 }
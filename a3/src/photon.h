@@ -3,6 +3,11 @@
 #ifndef PHOTON_H
 #define PHOTON_H
 
+#include <vector>
+
+// Define PHOTON_DEBUG (e.g., CPPFLAGS+=-DPHOTON_DEBUG) to keep the path
+// length and emission point of every stored photon for visualization.
+
 enum RR {
   DIFFUSE_REFLECTION,
   SPECULAR_REFLECTION,
@@ -10,45 +15,169 @@ enum RR {
   ABSORPTION
 };
 
+// Bits of Photon::flag: the kd-tree splitting axis, and a tag for caustic
+// photons stored in the same map as global ones
+static const short PHOTON_AXIS_MASK = 3;
+static const short PHOTON_CAUSTIC = 4;
+
+// Photon stored in a photon map, packed into 20 bytes as in Jensen's
+// photon: single precision position, power in shared-exponent RGBE
+// format, and incident direction quantized to spherical angles.
 class Photon {
 public:
   Photon(void) {}
-  Photon(R3Point start_, R3Vector direction_, RNRgb power_) :
-    position(start_), direction(direction_), power(power_), s_or_t(FALSE),
-    bounces(0), start_pos(start_) {}
-  Photon(R3Point start_, R3Vector direction_, RNRgb power_, RNBoolean s_or_t_) :
-    position(start_), direction(direction_), power(power_), s_or_t(s_or_t_),
-    bounces(0), start_pos(start_) {}
+  Photon(const R3Point& position_, const R3Vector& direction_, const RNRgb& power_);
 
   // Property functions
+  R3Point Position(void) const { return R3Point(position[0], position[1], position[2]); }
+  R3Vector Direction(void) const;
+  RNRgb Power(void) const;
   R3Ray Ray(void) const;
+  int Axis(void) const { return flag & PHOTON_AXIS_MASK; }
+  RNBoolean IsCaustic(void) const { return (flag & PHOTON_CAUSTIC) ? TRUE : FALSE; }
+
+  // Manipulation functions
+  void SetPower(const RNRgb& power);
 
-  R3Point position;   // incident position
-  R3Vector direction; // incident direction
-  RNRgb power;        // color (power)
-  RNBoolean s_or_t;   // started with specular reflection or tramission?
+  float position[3];       // incident position
+  unsigned char power[4];  // color (power) as RGBE
+  unsigned char theta;     // incident direction (polar angle)
+  unsigned char phi;       // incident direction (azimuth)
+  short flag;              // kd-tree splitting axis and caustic tag
 
+#ifdef PHOTON_DEBUG
   // Debugging properties
   int bounces;
-  R3Point start_pos;
+  float start_pos[3];
+#endif
+};
+
+// Result of a k-nearest photon search: a max-heap of at most max_photons
+// photons keyed on squared distance, so that the farthest photon found is
+// always at the top.  Reusing one object for many searches avoids any
+// allocation once it has grown to the largest k requested.
+class NearestPhotons {
+public:
+  // Constructors
+  NearestPhotons(void) : max_photons(0), nphotons(0), max_distance_squared(0) {}
+
+  // Property functions
+  int NPhotons(void) const { return nphotons; }
+  const Photon *Kth(int k) const { return photons[k]; }
+  RNScalar SquaredDistance(int k) const { return distances_squared[k]; }
+  RNScalar MaxSquaredDistance(void) const { return max_distance_squared; }
+
+  // Manipulation functions/operations
+  void Reset(int max_photons, RNScalar max_distance_squared);
+  void Insert(const Photon *photon, RNScalar distance_squared);
+
+private:
+  int max_photons;
+  int nphotons;
+  RNScalar max_distance_squared; // search radius (heap top once full)
+  std::vector<const Photon *> photons;
+  std::vector<RNScalar> distances_squared;
+};
+
+// Kernels weighting each photon of a density estimate by its distance
+// from the query point, relative to the radius of the disc holding them
+enum PhotonFilter {
+  BOX_FILTER,
+  CONE_FILTER,
+  GAUSSIAN_FILTER,
+  EPANECHNIKOV_FILTER
 };
 
+// Return the weight of a photon at distance_squared from the query point
+// of an estimate over a disc of radius_squared, normalized so that the
+// weights of uniformly spread photons average one (as the box filter's do)
+RNScalar PhotonFilterWeight(PhotonFilter filter, RNScalar distance_squared,
+  RNScalar radius_squared);
+
+// Result of gathering the photons nearest to one query point of a batch:
+// their summed power (weighted by the filter) and the squared distance to
+// the farthest of them
+struct PhotonGather {
+  RNRgb power;
+  RNScalar radius_squared;
+  int nphotons;
+};
+
+// Return the Morton code of point, quantized to 2^bits cells along each
+// axis of box, with the bits of the three coordinates interleaved
+// (bits <= 21)
+unsigned long long MortonCode(const R3Point& point, const R3Box& box, int bits);
+
+// Photon map stored as a left-balanced kd-tree in heap order: the
+// children of the photon at index i are at 2i+1 and 2i+2 (2i and 2i+1 when
+// counting from one), so the tree needs no pointers or leaf buckets.
 class PhotonMap {
 public:
   // Constructors
-  PhotonMap(void) {}
+  PhotonMap(void) : photons(NULL), nphotons(0) {}
 
   // Property functions
-  const R3Kdtree<Photon *> *Tree(void) const { return tree; }
-  const RNArray<Photon *>& Intersections(void) const { return intersections; }
+  int NPhotons(void) const { return nphotons; }
+  const Photon& Kth(int k) const { return photons[k]; }
 
   // Manipulation functions/operations
   int BuildKdTree(void);
-  void AddPhotonIntersection(Photon *photon);
+  void AddPhotons(const std::vector<Photon>& stored);
+
+  // Use the ntree photons at tree, already in kd-tree order (as Kth
+  // returns them after BuildKdTree), without copying them: the memory
+  // (e.g. a mapped cache file) must outlive the map
+  void SetKdTree(const Photon *tree, int ntree);
+
+  // Query functions (after BuildKdTree): find the max_photons photons
+  // closest to position within max_distance, returning how many were found
+  int FindClosest(const R3Point& position, RNLength max_distance, int max_photons,
+    NearestPhotons& nearest) const;
+
+  // Find the closest photons of each type in a map holding both global
+  // photons and caustic ones (tagged PHOTON_CAUSTIC) in one traversal,
+  // each type with its own number of photons and maximum distance
+  void FindClosest(const R3Point& position, RNLength max_global_distance,
+    int max_global_photons, RNLength max_caustic_distance, int max_caustic_photons,
+    NearestPhotons& global, NearestPhotons& caustic) const;
+
+  // Batch query functions: the same search as FindClosest for each of
+  // points, returning only the summed power of the photons found and the
+  // squared distance to the farthest.  Queries are answered in Morton
+  // order with one traversal stack and heap, each search starting from
+  // the bound on its radius given by the previous query's photons.  The
+  // second form gathers each type of photon in a combined map separately.
+  void GatherClosest(const R3Point *points, int npoints, RNLength max_distance,
+    int max_photons, PhotonGather *results, PhotonFilter filter = BOX_FILTER) const;
+  void GatherClosest(const R3Point *points, int npoints,
+    RNLength max_global_distance, int max_global_photons, PhotonGather *global_results,
+    RNLength max_caustic_distance, int max_caustic_photons, PhotonGather *caustic_results,
+    PhotonFilter filter = BOX_FILTER) const;
+
+  // Find the photon closest to position within max_distance whose
+  // direction makes at most an angle of acos(min_cosine) with normal
+  // (used to look up irradiance photons, which store a surface normal)
+  const Photon *FindNearest(const R3Point& position, const R3Vector& normal,
+    RNScalar min_cosine, RNLength max_distance) const;
+
+  // Sum the power of the photons within max_distance of position that
+  // arrived on the side normal points to, returning how many there were
+  int SumPower(const R3Point& position, const R3Vector& normal, RNLength max_distance,
+    RNRgb *power) const;
 
 private:
-  R3Kdtree<Photon *> *tree;
-  RNArray<Photon *> intersections;
+  void FindClosest(int index, const RNScalar position[3], NearestPhotons& nearest) const;
+  void FindClosest(int index, const RNScalar position[3], NearestPhotons *nearest[2]) const;
+  void GatherClosest(const R3Point *points, int npoints, const RNLength max_distance[2],
+    const int max_photons[2], PhotonGather *results[2], PhotonFilter filter) const;
+  void FindNearest(int index, const RNScalar position[3], const R3Vector& normal,
+    RNScalar min_cosine, const Photon *& nearest, RNScalar& max_distance_squared) const;
+  int SumPower(int index, const RNScalar position[3], const R3Vector& normal,
+    RNScalar max_distance_squared, RNRgb *power) const;
+
+  std::vector<Photon> storage; // photons owned by the map
+  const Photon *photons;       // in heap order after BuildKdTree
+  int nphotons;
 };
 
 
@@ -0,0 +1,168 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "R3Graphics/R3Graphics.h"
+#include "photoncache.h"
+
+// Version of the cache file format (increase whenever the layout of the
+// file or of a photon, or the way photons are traced, changes)
+static const unsigned int PHOTON_CACHE_VERSION = 2;
+
+// Maximum number of photon arrays in a file
+static const int PHOTON_CACHE_MAX_SECTIONS = 8;
+
+// Alignment of photon arrays within a file
+static const size_t PHOTON_CACHE_ALIGNMENT = 64;
+
+// Layout of the start of a cache file
+struct PhotonCacheHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int photon_size;
+  unsigned long long key;
+  unsigned long long nsections;
+  unsigned long long offsets[PHOTON_CACHE_MAX_SECTIONS]; // from start of file
+  unsigned long long counts[PHOTON_CACHE_MAX_SECTIONS];
+};
+
+static const char PHOTON_CACHE_MAGIC[8] = { 'P', 'H', 'O', 'T', 'O', 'N', 'C', '\0' };
+
+PhotonCache::PhotonCache(void)
+  : data(NULL),
+    size(0)
+{
+}
+
+PhotonCache::~PhotonCache(void)
+{
+  if (data) munmap(data, size);
+}
+
+int PhotonCache::Read(const char *filename, unsigned long long key, int nsections,
+  const Photon *photons[], int nphotons[])
+{
+  // Map whole file
+  if (data) { munmap(data, size); data = NULL; size = 0; }
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat status;
+  if ((fstat(fd, &status) != 0) || (status.st_size < (off_t) sizeof(PhotonCacheHeader))) {
+    close(fd);
+    return 0;
+  }
+  size = (size_t) status.st_size;
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) { data = NULL; size = 0; return 0; }
+
+  // Check header
+  const PhotonCacheHeader *header = (const PhotonCacheHeader *) data;
+  RNBoolean valid = TRUE;
+  if (memcmp(header->magic, PHOTON_CACHE_MAGIC, sizeof(header->magic))) valid = FALSE;
+  else if (header->version != PHOTON_CACHE_VERSION) valid = FALSE;
+  else if (header->photon_size != sizeof(Photon)) valid = FALSE;
+  else if (header->key != key) valid = FALSE;
+  else if (header->nsections != (unsigned long long) nsections) valid = FALSE;
+  for (int i = 0; valid && (i < nsections); i++) {
+    if ((header->offsets[i] > size) ||
+        (header->counts[i] > (size - header->offsets[i]) / sizeof(Photon))) valid = FALSE;
+  }
+  if (!valid) {
+    munmap(data, size);
+    data = NULL;
+    size = 0;
+    return 0;
+  }
+
+  // Point at photon arrays
+  for (int i = 0; i < nsections; i++) {
+    photons[i] = (const Photon *) ((const char *) data + header->offsets[i]);
+    nphotons[i] = (int) header->counts[i];
+  }
+
+  // Return success
+  return 1;
+}
+
+int PhotonCache::Write(const char *filename, unsigned long long key, int nsections,
+  const Photon *const photons[], const int nphotons[])
+{
+  if (nsections > PHOTON_CACHE_MAX_SECTIONS) return 0;
+
+  // Fill in header
+  PhotonCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PHOTON_CACHE_MAGIC, sizeof(header.magic));
+  header.version = PHOTON_CACHE_VERSION;
+  header.photon_size = sizeof(Photon);
+  header.key = key;
+  header.nsections = nsections;
+  size_t offset = sizeof(header);
+  for (int i = 0; i < nsections; i++) {
+    offset = (offset + PHOTON_CACHE_ALIGNMENT - 1) / PHOTON_CACHE_ALIGNMENT * PHOTON_CACHE_ALIGNMENT;
+    header.offsets[i] = offset;
+    header.counts[i] = nphotons[i];
+    offset += nphotons[i] * sizeof(Photon);
+  }
+
+  // Write to a uniquely named temporary file in the same directory,
+  // renamed when complete so that concurrent renders never read a
+  // partial file (nor write into the same temporary file)
+  std::string temporary_filename = std::string(filename) + ".XXXXXX";
+  int fd = mkstemp(&temporary_filename[0]);
+  if (fd < 0) return 0;
+  fchmod(fd, 0644);
+  FILE *fp = fdopen(fd, "wb");
+  if (!fp) {
+    close(fd);
+    remove(temporary_filename.c_str());
+    return 0;
+  }
+  RNBoolean ok = (fwrite(&header, sizeof(header), 1, fp) == 1) ? TRUE : FALSE;
+  static const char zeros[PHOTON_CACHE_ALIGNMENT] = { 0 };
+  size_t position = sizeof(header);
+  for (int i = 0; ok && (i < nsections); i++) {
+    size_t padding = header.offsets[i] - position;
+    if ((padding > 0) && (fwrite(zeros, 1, padding, fp) != padding)) ok = FALSE;
+    size_t count = nphotons[i];
+    if ((count > 0) && (fwrite(photons[i], sizeof(Photon), count, fp) != count)) ok = FALSE;
+    position = header.offsets[i] + count * sizeof(Photon);
+  }
+  if (fclose(fp) != 0) ok = FALSE;
+  if (!ok || (rename(temporary_filename.c_str(), filename) != 0)) {
+    remove(temporary_filename.c_str());
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+unsigned long long HashBytes(const void *data, size_t size, unsigned long long hash)
+{
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+unsigned long long HashFile(const char *filename)
+{
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return 0;
+  unsigned long long hash = HashBytes(NULL, 0);
+  char buffer[65536];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    hash = HashBytes(buffer, count, hash);
+  }
+  fclose(fp);
+  return hash;
+}
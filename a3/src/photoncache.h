@@ -0,0 +1,43 @@
+// Include file for the binary photon cache file
+
+#ifndef PHOTONCACHE_H
+#define PHOTONCACHE_H
+
+#include <stddef.h>
+
+#include "photon.h"
+
+// Photons traced for a scene, saved so that later renders with the same
+// scene and photon parameters can skip photon tracing.  A cache file is
+// a header (with a version, the size of a photon and the key it was
+// written for) followed by arrays of photons, such as the photon maps in
+// kd-tree order.  Reading a file maps it into memory whole, so the
+// photons can be used in place, for as long as the cache object lives.
+class PhotonCache {
+public:
+  // Constructors
+  PhotonCache(void);
+  ~PhotonCache(void);
+
+  // Input/output functions: return 0 if the file cannot be read, or was
+  // written by another version or for another key.  Reading points
+  // photons[i] at the nphotons[i] photons of each of the nsections arrays.
+  int Read(const char *filename, unsigned long long key, int nsections,
+    const Photon *photons[], int nphotons[]);
+  static int Write(const char *filename, unsigned long long key, int nsections,
+    const Photon *const photons[], const int nphotons[]);
+
+private:
+  void *data;
+  size_t size;
+};
+
+// Return the 64-bit FNV-1a hash of size bytes at data, continuing the
+// hash of earlier bytes if one is given
+unsigned long long HashBytes(const void *data, size_t size,
+  unsigned long long hash = 14695981039346656037ULL);
+
+// Return the hash of the contents of a file (0 if it cannot be read)
+unsigned long long HashFile(const char *filename);
+
+#endif
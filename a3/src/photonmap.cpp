@@ -8,9 +8,16 @@
 #include "fglut/fglut.h"
 #include "render.h"
 #include "photon.h"
+#include "photoncache.h"
+#include "sampler.h"
+#include "threadpool.h"
+#include "warp.h"
 
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
 
 // Program variables
 
@@ -21,6 +28,10 @@ static int num_samples = 1;
 static int render_image_width = 64;
 static int render_image_height = 64;
 static int print_verbose = 0;
+static int num_threads = 0; // 0 = one per core
+static unsigned int seed = 0;
+static SamplerType sampler_type = INDEPENDENT_SAMPLER;
+static int jitter_pixels = 0;
 
 
 
@@ -47,14 +58,59 @@ static R3Point center(0, 0, 0);
 
 static PhotonMap *global_photon_map = NULL;
 static PhotonMap *caustic_photon_map = NULL;
+static PhotonMap *direct_photon_map = NULL; // only for final gathering
+static PhotonMap *irradiance_photon_map = NULL;
+static std::vector<Photon> irradiance_photons; // positions and normals
 static int num_global_photons = 1000;
 static int num_caustic_photons = 10000;
 static int N = 0; // number of photons to use in radiance estimate
+static int Nc = -1; // number of caustic photons to use (< 0 = N)
+static double max_photon_distance = -1; // relative to scene radius (< 0 = automatic, 0 = no limit)
+static double max_caustic_photon_distance = -1; // relative to scene radius (< 0 = automatic, 0 = no limit)
+static int min_nearest_photons = 0; // fewer photons estimate zero irradiance
+static PhotonFilter photon_filter = BOX_FILTER;
+static int num_light_samples = 0; // area light samples per hit (0 = one shadow ray per light)
+static int power_heuristic = 1; // MIS weights by power (else balance) heuristic
+static int combined_photon_map = 0; // store caustic photons in the global map
+static int caustic_projection = 1; // emit caustic photons only toward specular objects
+static std::vector<R3Sphere> caustic_targets; // bounding spheres of specular elements
+static char *photon_cache_directory = NULL; // NULL = always trace photons
+static PhotonCache photon_cache; // mapped file holding the photon maps
+static int num_stored_global_photons = 0;
+static int num_stored_caustic_photons = 0;
 static int E = 10; // specular exponent
-static int build_global_map = TRUE;
-
-// Normal vector of coordinate system used to sample vectors
-static const R3Vector BASE = R3Vector(0.0, 0.0, 1.0);
+static double irradiance_cache_error = 0; // 0 = gather at every hit
+static int num_gather_rays = 0; // 0 = no final gather
+static int num_passes = 0; // progressive photon passes (0 = off, < 0 = no limit)
+static double initial_radius = 0.02; // progressive gather radius, relative to scene radius
+static int progressive = 0; // render passes of one sample per pixel
+static double time_budget = 0; // seconds (0 = no limit)
+static int snapshot_passes = 0; // passes between snapshots (0 = none)
+static double snapshot_interval = 0; // seconds between snapshots (0 = none)
+static double adaptive_threshold = 0; // 0 = same samples at every pixel
+static char *sample_count_image_name = NULL;
+static int ray_packets = 1; // trace camera and shadow rays in packets
+static int wavefront = 0; // trace paths breadth first
+static RNTime program_start_time;
+
+// Number of photons emitted by each photon tracing task
+static const int PHOTON_BATCH_SIZE = 4096;
+
+// Random number streams of photon batches (disjoint from render tiles)
+static const unsigned int PHOTON_STREAM_OFFSET = 0x80000000;
+
+// Candidate caustic photon rays drawn per photon emitted toward specular
+// objects, at most (so that lights that see none of them give up)
+static const int MAX_CAUSTIC_PROJECTION_DRAWS = 1000;
+
+// Automatic maximum photon gather radius, in multiples of the radius
+// that would hold the photons requested if they were spread evenly over
+// the surface of the scene's bounding box
+static const RNScalar AUTO_PHOTON_DISTANCE_SCALE = 4;
+
+// Fraction of global photons (one in this many) at which irradiance is
+// precomputed for final gathering
+static const int IRRADIANCE_PHOTON_SPACING = 4;
 
 // Display variables
 
@@ -293,17 +349,20 @@ DrawRays(R3Scene *scene)
 static void
 DrawGlobalPhotons(void)
 {
-  const RNArray<Photon *>& photons = global_photon_map->Intersections();
-  for (int i = 0; i < photons.NEntries(); i++) {
-    Photon *p = photons.Kth(i);
-    R3Point position = p->position;
-    R3Vector direction = p->direction;
+  for (int i = 0; i < global_photon_map->NPhotons(); i++) {
+    const Photon *p = &global_photon_map->Kth(i);
+    R3Point position = p->Position();
+    R3Vector direction = p->Direction();
 
+#ifdef PHOTON_DEBUG
     if (p->bounces > 0) {
       glColor3d(0.0, 0.0, 1.0);
     } else {
       glColor3d(0.0, 1.0, 0.0);
     }
+#else
+    glColor3d(0.0, 0.0, 1.0);
+#endif
 
     R3Sphere(position, 0.01).Draw();
 
@@ -318,11 +377,10 @@ DrawGlobalPhotons(void)
 static void
 DrawCausticPhotons(void)
 {
-  const RNArray<Photon *>& photons = caustic_photon_map->Intersections();
-  for (int i = 0; i < photons.NEntries(); i++) {
-    Photon *p = photons.Kth(i);
-    R3Point position = p->position;
-    R3Vector direction = p->direction;
+  for (int i = 0; i < caustic_photon_map->NPhotons(); i++) {
+    const Photon *p = &caustic_photon_map->Kth(i);
+    R3Point position = p->Position();
+    R3Vector direction = p->Direction();
 
     glColor3d(1.0, 1.0, 1.0);
     R3Sphere(position, 0.01).Draw();
@@ -786,12 +844,99 @@ ParseArgs(int argc, char **argv)
       else if (!strcmp(*argv, "-N")) {
         argc--; argv++; N = atoi(*argv);
       }
+      else if (!strcmp(*argv, "-Nc")) {
+        argc--; argv++; Nc = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-R")) {
+        argc--; argv++; max_photon_distance = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-Rc")) {
+        argc--; argv++; max_caustic_photon_distance = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-Nmin")) {
+        argc--; argv++; min_nearest_photons = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-filter")) {
+        argc--; argv++;
+        if (!strcmp(*argv, "box")) photon_filter = BOX_FILTER;
+        else if (!strcmp(*argv, "cone")) photon_filter = CONE_FILTER;
+        else if (!strcmp(*argv, "gaussian")) photon_filter = GAUSSIAN_FILTER;
+        else if (!strcmp(*argv, "epanechnikov")) photon_filter = EPANECHNIKOV_FILTER;
+        else { fprintf(stderr, "Invalid photon filter: %s", *argv); exit(1); }
+      }
+      else if (!strcmp(*argv, "-sampler")) {
+        argc--; argv++;
+        if (!ParseSamplerType(*argv, &sampler_type)) { fprintf(stderr, "Invalid sampler: %s", *argv); exit(1); }
+      }
+      else if (!strcmp(*argv, "-jitter")) {
+        jitter_pixels = 1;
+      }
+      else if (!strcmp(*argv, "-ls")) {
+        argc--; argv++; num_light_samples = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-balance")) {
+        power_heuristic = 0;
+      }
+      else if (!strcmp(*argv, "-photon_cache")) {
+        argc--; argv++; photon_cache_directory = *argv;
+      }
+      else if (!strcmp(*argv, "-noprojection")) {
+        caustic_projection = 0;
+      }
+      else if (!strcmp(*argv, "-combined")) {
+        combined_photon_map = 1;
+      }
       else if (!strcmp(*argv, "-E")) {
         argc--; argv++; E = atoi(*argv);
       }
       else if (!strcmp(*argv, "-ns")) {
         argc--; argv++; num_samples = atoi(*argv);
       }
+      else if (!strcmp(*argv, "-threads")) {
+        argc--; argv++; num_threads = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-seed")) {
+        argc--; argv++; seed = (unsigned int) atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-ic")) {
+        argc--; argv++; irradiance_cache_error = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-fg")) {
+        argc--; argv++; num_gather_rays = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-ppm")) {
+        argc--; argv++; num_passes = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-radius")) {
+        argc--; argv++; initial_radius = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-progressive")) {
+        progressive = 1;
+      }
+      else if (!strcmp(*argv, "-time")) {
+        argc--; argv++; time_budget = atof(*argv);
+        progressive = 1;
+      }
+      else if (!strcmp(*argv, "-snapshot")) {
+        argc--; argv++; snapshot_passes = atoi(*argv);
+        progressive = 1;
+      }
+      else if (!strcmp(*argv, "-snapshot_time")) {
+        argc--; argv++; snapshot_interval = atof(*argv);
+        progressive = 1;
+      }
+      else if (!strcmp(*argv, "-adaptive")) {
+        argc--; argv++; adaptive_threshold = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-sample_image")) {
+        argc--; argv++; sample_count_image_name = *argv;
+      }
+      else if (!strcmp(*argv, "-nopackets")) {
+        ray_packets = 0;
+      }
+      else if (!strcmp(*argv, "-wavefront")) {
+        wavefront = 1;
+      }
       else {
         fprintf(stderr, "Invalid program argument: %s", *argv);
         exit(1);
@@ -809,7 +954,7 @@ ParseArgs(int argc, char **argv)
   // Check scene filename
   if (!input_scene_name) {
     fprintf(stderr, "Usage: photonmap inputscenefile [outputimagefile]");
-    fprintf(stderr, "[-resolution <int> <int>] [-gp <int>] [-cp <int>] [-v]\n");
+    fprintf(stderr, "[-resolution <int> <int>] [-gp <int>] [-cp <int>] [-N <int>] [-Nc <int>] [-R <float>] [-Rc <float>] [-Nmin <int>] [-filter box|cone|gaussian|epanechnikov] [-combined] [-noprojection] [-ls <int>] [-balance] [-sampler independent|stratified|halton|sobol] [-jitter] [-photon_cache <directory>] [-threads <int>] [-seed <int>] [-ic <float>] [-fg <int>] [-ppm <int>] [-radius <float>] [-progressive] [-time <float>] [-snapshot <int>] [-snapshot_time <float>] [-adaptive <float>] [-sample_image <file>] [-nopackets] [-wavefront] [-v]\n");
     return 0;
   }
 
@@ -826,28 +971,28 @@ static void InitializePhotonMaps(void)
 {
   global_photon_map = new PhotonMap();
   caustic_photon_map = new PhotonMap();
+  direct_photon_map = new PhotonMap();
+  irradiance_photon_map = new PhotonMap();
 }
 
-// Rotate sample to the coordinate system defined by normal.
-static void RotateTo(R3Vector& sample, R3Vector &normal)
-{
-  // Normalize the normal vector defining the new coordinate system
-  normal.Normalize();
-
-  // Compute the axis of rotation
-  R3Vector rotation_axis = BASE;
-  rotation_axis.Cross(normal);
-
-  // Compute number of radians to rotate by
-  RNAngle angle = acos(BASE.Dot(normal));
-
-  // Rotate the sample (by mutation)
-  sample.Rotate(rotation_axis, angle);
-}
+// State of a photon while it is traced through the scene
+struct PhotonPath {
+  PhotonPath(const R3Point& start_, const R3Vector& direction_, const RNRgb& power_) :
+    position(start_), direction(direction_), power(power_), s_or_t(FALSE),
+    bounces(0), start_pos(start_) {}
+  R3Ray Ray(void) const { return R3Ray(position, direction); }
+
+  R3Point position;   // incident position
+  R3Vector direction; // incident direction
+  RNRgb power;        // color (power)
+  RNBoolean s_or_t;   // started with specular reflection or tramission?
+  int bounces;
+  R3Point start_pos;
+};
 
 // Compute probabilities for diffuse reflection, specular reflection, and
 // transmission
-static RR RussianRoulette(const R3Brdf *brdf, Photon *p)
+static RR RussianRoulette(const R3Brdf *brdf, PhotonPath *p)
 {
   // Photon power properties
   double pr = p->power.R();
@@ -906,7 +1051,7 @@ static RR RussianRoulette(const R3Brdf *brdf, Photon *p)
   }
 
   // Perform Russian Roulette to determine which action to take next
-  double k = RNRandomScalar();
+  double k = Sample1D();
   if (k < pd) {
     p->power = RNRgb(pr * dr, pg * dg, pb * db) / pd;
     return DIFFUSE_REFLECTION;
@@ -927,7 +1072,39 @@ static RR RussianRoulette(const R3Brdf *brdf, Photon *p)
   }
 }
 
-static void TracePhoton(Photon *p)
+// Append a compact copy of the photon at the current path vertex
+static void StorePhoton(const PhotonPath& path, std::vector<Photon>& stored)
+{
+  stored.push_back(Photon(path.position, path.direction, path.power));
+#ifdef PHOTON_DEBUG
+  Photon& photon = stored.back();
+  photon.bounces = path.bounces;
+  photon.start_pos[0] = (float) path.start_pos.X();
+  photon.start_pos[1] = (float) path.start_pos.Y();
+  photon.start_pos[2] = (float) path.start_pos.Z();
+#endif
+}
+
+// A batch of photons emitted from one light, traced by a single task
+struct PhotonBatch {
+  R3Light *light;
+  unsigned int sequence;                  // of the light's photons in the sampler
+  int first_sample;                       // of the batch within the sequence
+  int num_samples;                        // photons of the light in all batches
+  int num_photons;
+  long long num_emitted;                  // rays drawn, including those not traced
+  RNRgb power;
+  RNBoolean global;
+  std::vector<Photon> stored;
+  std::vector<Photon> direct;             // first-hit photons (final gather only)
+  std::vector<Photon> irradiance_photons; // directions are surface normals
+};
+
+// Trace the path of a photon through the scene, storing a photon in the
+// batch at every diffuse surface it hits (global or caustic photons as
+// requested).  The path is followed iteratively by updating its state in
+// place at each bounce.
+static void TracePhoton(PhotonPath photon, PhotonBatch& batch)
 {
   // Local variables
   R3SceneNode *node;
@@ -937,64 +1114,56 @@ static void TracePhoton(Photon *p)
   R3Vector normal;
   RNScalar t;
 
-  R3Ray ray = p->Ray();
+  while (TRUE) {
+    R3Ray ray = photon.Ray();
+    if (!scene->Intersects(ray, &node, &element, &shape, &point, &normal, &t)) return;
+    normal.Normalize();
 
-  if (scene->Intersects(ray, &node, &element, &shape, &point, &normal, &t)) {
     // Grab BRDF of material at intersection
     const R3Brdf *brdf = element->Material()->Brdf();
 
     // Store intersection point in the photon
-    p->position = point;
-
-    if (build_global_map == TRUE) {
-      // Store photon-surface intersection if surface is diffuse
-      if (p->bounces > 0 && brdf->IsDiffuse()) {
-        global_photon_map->AddPhotonIntersection(p);
+    photon.position = point;
+
+    if (batch.global == TRUE) {
+      // Store photon-surface intersection if surface is diffuse (direct
+      // photons are kept separately, for precomputing irradiance only)
+      if (brdf->IsDiffuse() && ((photon.bounces > 0) || (num_gather_rays > 0))) {
+        StorePhoton(photon, (photon.bounces > 0) ? batch.stored : batch.direct);
+
+        // Remember position and normal (on the side the photon came from)
+        // of some photons for precomputing irradiance
+        size_t count = batch.stored.size() + batch.direct.size();
+        if ((num_gather_rays > 0) && (count % IRRADIANCE_PHOTON_SPACING == 1)) {
+          R3Vector n = (normal.Dot(ray.Vector()) > 0) ? -normal : normal;
+          batch.irradiance_photons.push_back(Photon(point, n, RNblack_rgb));
+        }
       }
     } else { // Building caustic photon map
       // Store photon-surface intersection if surface is diffuse
       // -- AND --
       // photon started with specular reflection or transmission
-      if (p->s_or_t == TRUE && brdf->IsDiffuse()) {
-        caustic_photon_map->AddPhotonIntersection(p);
+      if (photon.s_or_t == TRUE && brdf->IsDiffuse()) {
+        StorePhoton(photon, batch.stored);
       }
     }
 
     // Russian Roulette to determine secondary photon behavior
-    RR rr = RussianRoulette(brdf, p);
+    R3Vector dir;
+    RR rr = RussianRoulette(brdf, &photon);
     switch (rr) {
       case DIFFUSE_REFLECTION: {
         // Sample a diffuse reflection direction
-        RNScalar u1 = RNRandomScalar();
-        RNScalar u2 = RNRandomScalar();
-        RNAngle pitch = 2.0 * RN_PI * u2;
-        RNAngle yaw = acos(sqrt(u1));
-        R3Vector dir = R3Vector(pitch, yaw);
-        RotateTo(dir, normal);
-
-        // Create new secondary photon to trace
-        Photon *next_photon = new Photon(point + 0.05 * dir, dir, p->power, p->s_or_t);
-        next_photon->bounces = p->bounces + 1;
-        next_photon->start_pos = point;
-        TracePhoton(next_photon);
-
+        RNScalar u1, u2;
+        Sample2D(&u1, &u2);
+        dir = OrthonormalBasis(normal).ToWorld(CosineHemisphereSample(u1, u2));
         break;
       }
       case SPECULAR_REFLECTION: {
         // Sample a specular reflection direction
-        RNScalar u1 = RNRandomScalar();
-        RNScalar u2 = RNRandomScalar();
-        RNAngle pitch = 2.0 * RN_PI * u2;
-        RNAngle yaw = acos(pow(u1, 1.0 / (E + 1.0)));
-        R3Vector dir = R3Vector(pitch, yaw);
-        RotateTo(dir, normal);
-
-        // Create new secondary photon to trace
-        Photon *next_photon = new Photon(point + 0.05 * dir, dir, p->power, p->s_or_t);
-        next_photon->bounces = p->bounces + 1;
-        next_photon->start_pos = point;
-        TracePhoton(next_photon);
-
+        RNScalar u1, u2;
+        Sample2D(&u1, &u2);
+        dir = OrthonormalBasis(normal).ToWorld(SpecularBounceSample(u1, u2, E));
         break;
       }
       case TRANSMISSION: {
@@ -1024,92 +1193,452 @@ static void TracePhoton(Photon *p)
         RNScalar r = ior1 / ior2;
         RNScalar s2 = r * sqrt(1.0 - pow(c, 2));
         if (s2 > 1.0) { // Total internal reflection
-          break; // Terminate the photon; treat as ABSORPTION case
-        }
-        else {
-          // Compute refracted direction
-          R3Vector dir = r * l + (r * c - sqrt(1 - pow(r, 2) * (1 - pow(c, 2)))) * n;
-
-          // Create new secondary photon to trace
-          Photon *next_photon = new Photon(point + 0.05 * dir, dir, p->power, p->s_or_t);
-          next_photon->bounces = p->bounces + 1;
-          next_photon->start_pos = point;
-          TracePhoton(next_photon);
+          return; // Terminate the photon; treat as ABSORPTION case
         }
 
+        // Compute refracted direction
+        dir = r * l + (r * c - sqrt(1 - pow(r, 2) * (1 - pow(c, 2)))) * n;
         break;
       }
       case ABSORPTION: {
-        break;
+        return;
       }
       default: {
         std::cerr << "Invalid Russian Roulette state while photon-tracing" << std::endl;
         exit(-1);
       }
     }
+
+    // Continue path with the secondary photon
+    photon.position = point + 0.05 * dir;
+    photon.direction = dir;
+    photon.bounces++;
+    photon.start_pos = point;
   }
 }
 
-static int BuildPhotonMaps(void)
+// Return the power carried by all the photons emitted from light (as
+// the photons of every light have always carried its color)
+static RNRgb LightPower(const R3Light *light)
 {
-  int num_lights = scene->NLights();
-  int num_gphotons_per_light = (int)(1.0 * num_global_photons / num_lights);
-  int num_cphotons_per_light = (int)(1.0 * num_caustic_photons / num_lights);
+  return light->Color();
+}
 
-  std::cerr << "Emitting " << num_gphotons_per_light
-            << " global photons per light"
-            << std::endl;
-  std::cerr << "Emitting " << num_cphotons_per_light
-            << " caustic photons per light"
-            << std::endl;
+// Split num_photons photons among the lights in proportion to their
+// power (by stratified inversion of the CDF of light power), and those
+// of each light into batches
+static void CreatePhotonBatches(int num_photons, RNBoolean global,
+  std::vector<PhotonBatch>& batches)
+{
+  // Compute CDF of light power
+  int num_lights = scene->NLights();
+  std::vector<RNScalar> cdf(num_lights + 1, 0.0);
+  for (int k = 0; k < num_lights; k++) {
+    cdf[k + 1] = cdf[k] + std::max(LightPower(scene->Light(k)).Luminance(), 0.0);
+  }
+  if (cdf[num_lights] <= 0) return;
 
-  // -- Build the global photon map. --
-  std::cerr << "Building global photon map..." << std::endl;
-  build_global_map = TRUE;
   for (int k = 0; k < num_lights; k++) {
     R3Light *light = scene->Light(k);
-    RNRgb gphoton_power = light->Color() / (1.0 * num_gphotons_per_light);
+    int first = (int) (num_photons * cdf[k] / cdf[num_lights] + 0.5);
+    int last = (int) (num_photons * cdf[k + 1] / cdf[num_lights] + 0.5);
+    int num_photons_per_light = last - first;
+    if (num_photons_per_light <= 0) continue;
+    RNRgb power = LightPower(light) / (1.0 * num_photons_per_light);
+    for (int i = 0; i < num_photons_per_light; i += PHOTON_BATCH_SIZE) {
+      PhotonBatch batch;
+      batch.light = light;
+      batch.sequence = 2 * k + ((global) ? 0 : 1);
+      batch.first_sample = i;
+      batch.num_samples = num_photons_per_light;
+      batch.num_photons = std::min(PHOTON_BATCH_SIZE, num_photons_per_light - i);
+      batch.num_emitted = 0;
+      batch.power = power;
+      batch.global = global;
+      batches.push_back(batch);
+    }
+  }
+}
+
+// Add the bounding sphere of every element below node whose material
+// reflects or transmits specularly to the targets of caustic photons
+static void FindCausticTargets(R3SceneNode *node, const R3Affine& parent_transformation)
+{
+  R3Affine transformation = parent_transformation;
+  transformation.Transform(node->Transformation());
+  for (int i = 0; i < node->NElements(); i++) {
+    R3SceneElement *element = node->Element(i);
+    if (!element->Material()) continue;
+    const R3Brdf *brdf = element->Material()->Brdf();
+    if (!brdf || !(brdf->IsSpecular() || brdf->IsTransparent())) continue;
+    R3Box bbox = element->BBox();
+    bbox.Transform(transformation);
+    caustic_targets.push_back(R3Sphere(bbox.Centroid(), 1.01 * bbox.DiagonalRadius()));
+  }
+  for (int i = 0; i < node->NChildren(); i++) {
+    FindCausticTargets(node->Child(i), transformation);
+  }
+}
 
-    // Trace photons for this light
-    for (int i = 0; i < num_gphotons_per_light; i++) {
-      R3Ray ray = light->GetPhotonRay();
-      Photon *p = new Photon(ray.Start(), ray.Vector(), gphoton_power);
-      TracePhoton(p);
+// Return whether a photon ray can reach a caustic target
+static RNBoolean HitsCausticTarget(const R3Ray& ray)
+{
+  for (size_t i = 0; i < caustic_targets.size(); i++) {
+    if (R3Intersects(ray, caustic_targets[i])) return TRUE;
+  }
+  return FALSE;
+}
+
+// Draw the ray of a photon emitted from light from the next four
+// dimensions of the calling thread's sampler (position, then direction),
+// with the distribution of R3Light::GetPhotonRay, which draws it for
+// lights of other kinds
+static R3Ray SamplePhotonRay(R3Light *light)
+{
+  RNScalar u1, u2, u3, u4;
+  Sample2D(&u1, &u2);
+  Sample2D(&u3, &u4);
+  RNAngle phi = 2.0 * RN_PI * u4;
+  if (light->ClassID() == R3PointLight::CLASS_ID()) {
+    // Uniform direction over the sphere
+    R3PointLight *point_light = (R3PointLight *) light;
+    RNScalar z = 1.0 - 2.0 * u3;
+    RNScalar r = sqrt(std::max(0.0, 1.0 - z * z));
+    return R3Ray(point_light->Position(), R3Vector(r * cos(phi), r * sin(phi), z));
+  }
+  else if (light->ClassID() == R3SpotLight::CLASS_ID()) {
+    // Uniform direction over the part of the hemisphere about the spot
+    // direction that GetPhotonRay accepts (angles beyond the cutoff)
+    R3SpotLight *spot_light = (R3SpotLight *) light;
+    R3Vector axis = spot_light->Direction();
+    axis.Normalize();
+    R3Vector axis1 = axis % R3xyz_triad[axis.MinDimension()];
+    axis1.Normalize();
+    R3Vector axis2 = axis % axis1;
+    RNScalar max_cos = cos(std::min(fabs(spot_light->CutOffAngle()), RN_PI_OVER_TWO));
+    RNScalar z = u3 * max_cos;
+    RNScalar r = sqrt(std::max(0.0, 1.0 - z * z));
+    return R3Ray(spot_light->Position(), (r * cos(phi)) * axis1 + (r * sin(phi)) * axis2 + z * axis);
+  }
+  else if (light->ClassID() == R3AreaLight::CLASS_ID()) {
+    // Uniform point on the quarter of the disc GetPhotonRay draws from,
+    // and uniform direction over the hemisphere about its normal
+    R3AreaLight *area_light = (R3AreaLight *) light;
+    R3Vector axis = area_light->Direction();
+    axis.Normalize();
+    R3Vector axis1 = axis % R3xyz_triad[axis.MinDimension()];
+    axis1.Normalize();
+    R3Vector axis2 = axis % axis1;
+    axis2.Normalize();
+    RNScalar x, y;
+    ConcentricDiscSample(u1, u2, &x, &y);
+    R3Point position = area_light->Position() + area_light->Radius() * (fabs(x) * axis1 + fabs(y) * axis2);
+    RNScalar z = 1.0 - u3;
+    RNScalar r = sqrt(std::max(0.0, 1.0 - z * z));
+    return R3Ray(position, (r * cos(phi)) * axis1 + (r * sin(phi)) * axis2 + z * axis);
+  }
+  else if (light->ClassID() == R3DirectionalLight::CLASS_ID()) {
+    // Uniform point on the quarter of the disc beyond the scene that
+    // GetPhotonRay draws from
+    R3DirectionalLight *directional_light = (R3DirectionalLight *) light;
+    const R3Vector& direction = directional_light->Direction();
+    RNLength radius = scene->BBox().DiagonalRadius();
+    R3Point center = scene->BBox().Centroid() - 1.25 * radius * direction;
+    R3Vector axis1 = direction % R3xyz_triad[direction.MinDimension()];
+    axis1.Normalize();
+    R3Vector axis2 = direction % axis1;
+    axis2.Normalize();
+    RNScalar x, y;
+    ConcentricDiscSample(u1, u2, &x, &y);
+    return R3Ray(center + radius * (fabs(x) * axis1 + fabs(y) * axis2), direction);
+  }
+  return light->GetPhotonRay();
+}
+
+// Trace batches on all threads.  Each batch has its own random number
+// stream (numbered from first_stream) and photon buffer, so the photons
+// depend only on the seed.  The photons of each light are the samples of
+// one sequence of the sampler (scrambled by first_stream), numbered by
+// the draws from the light.  With a caustic projection, caustic photons
+// are drawn from each light until the requested number of them head for
+// a specular object, and the power of those stored is then set to that of
+// all the photons drawn from the light, as if all of them had been traced.
+// Since a batch may then draw up to MAX_CAUSTIC_PROJECTION_DRAWS times
+// its photons, each such batch draws from a sequence of its own
+// (scrambled by its stream and numbered from zero), which keeps sample
+// numbers within 32 bits however many photons a light emits.
+static void TracePhotonBatches(std::vector<PhotonBatch>& batches, unsigned int first_stream)
+{
+  // Compute the (lazily updated) scene bounding boxes, which lights read
+  // when emitting photons, before any threads start
+  scene->BBox();
+
+  ThreadPool pool(num_threads);
+  pool.Run((int) batches.size(), [&](int b, int) {
+    PhotonBatch& batch = batches[b];
+    RNSeedRandomScalarStream(seed, first_stream + b);
+    RNBoolean project = (caustic_projection && !batch.global) ? TRUE : FALSE;
+    if (project && caustic_targets.empty()) return;
+    long long max_emitted = (project) ? (long long) MAX_CAUSTIC_PROJECTION_DRAWS * batch.num_photons : batch.num_photons;
+    unsigned int first_sample = (project) ? 0 : batch.first_sample;
+    unsigned int sampler_seed = (project) ? seed ^ (first_stream + b) : seed ^ first_stream;
+    Sampler& sampler = ThreadSampler();
+    sampler = Sampler(sampler_type, batch.num_samples, sampler_seed);
+    int num_traced = 0;
+    while ((num_traced < batch.num_photons) && (batch.num_emitted < max_emitted)) {
+      sampler.StartSample(batch.sequence, (unsigned int) (first_sample + batch.num_emitted));
+      R3Ray ray = (sampler_type == INDEPENDENT_SAMPLER) ? batch.light->GetPhotonRay() : SamplePhotonRay(batch.light);
+      batch.num_emitted++;
+      if (project && !HitsCausticTarget(ray)) continue;
+      TracePhoton(PhotonPath(ray.Start(), ray.Vector(), batch.power), batch);
+      num_traced++;
+    }
+    sampler = Sampler();
+  });
+
+  // Rescale the power of projected caustic photons by the fraction of
+  // each light's photons that were traced
+  if (!caustic_projection) return;
+  std::map<R3Light *, std::pair<long long, long long> > counts;
+  for (size_t b = 0; b < batches.size(); b++) {
+    if (batches[b].global) continue;
+    counts[batches[b].light].first += batches[b].num_photons;
+    counts[batches[b].light].second += batches[b].num_emitted;
+  }
+  for (size_t b = 0; b < batches.size(); b++) {
+    PhotonBatch& batch = batches[b];
+    if (batch.global || batch.stored.empty()) continue;
+    const std::pair<long long, long long>& count = counts[batch.light];
+    RNScalar scale = (RNScalar) count.first / count.second;
+    for (size_t i = 0; i < batch.stored.size(); i++) {
+      batch.stored[i].SetPower(scale * batch.stored[i].Power());
     }
   }
+}
 
-  // -- Build the caustic photon map. --
-  std::cerr << "Building caustic photon map..." << std::endl;
-  build_global_map = FALSE;
-  for (int k = 0; k < num_lights; k++) {
-    R3Light *light = scene->Light(k);
-    RNRgb cphoton_power = light->Color() / (1.0 * num_cphotons_per_light);
+// Return the automatic maximum radius of gathers of k photons from a map
+// of nphotons of them
+static RNLength AutoPhotonDistance(int k, int nphotons)
+{
+  if ((k <= 0) || (nphotons <= 0)) return FLT_MAX;
+  RNArea area = scene->BBox().Area();
+  return AUTO_PHOTON_DISTANCE_SCALE * sqrt(k * area / (RN_PI * nphotons));
+}
+
+static int BuildPhotonMaps(void)
+{
+  std::cerr << "Emitting " << num_global_photons
+            << " global photons"
+            << std::endl;
+  std::cerr << "Emitting " << num_caustic_photons
+            << " caustic photons"
+            << std::endl;
 
-    // Trace photons for this light
-    for (int i = 0; i < num_cphotons_per_light; i++) {
-      R3Ray ray = light->GetPhotonRay();
-      Photon *p = new Photon(ray.Start(), ray.Vector(), cphoton_power);
-      TracePhoton(p);
+  // Find the objects toward which caustic photons are emitted
+  if (caustic_projection) {
+    caustic_targets.clear();
+    FindCausticTargets(scene->Root(), R3identity_affine);
+  }
+
+  // Split photons of both maps into batches that can be traced in parallel
+  std::vector<PhotonBatch> batches;
+  CreatePhotonBatches(num_global_photons, TRUE, batches);
+  CreatePhotonBatches(num_caustic_photons, FALSE, batches);
+
+  // Trace batches in parallel
+  std::cerr << "Tracing global and caustic photons..." << std::endl;
+  TracePhotonBatches(batches, PHOTON_STREAM_OFFSET);
+  if (caustic_projection) {
+    long long num_emitted = 0;
+    for (size_t b = 0; b < batches.size(); b++) {
+      if (!batches[b].global) num_emitted += batches[b].num_emitted;
+    }
+    std::cerr << "Drew " << num_emitted << " caustic photons to trace those toward "
+              << caustic_targets.size() << " specular objects" << std::endl;
+  }
+
+  // Merge photon buffers in batch order (caustic photons are tagged and
+  // stored with the global ones if the maps are combined)
+  for (size_t b = 0; b < batches.size(); b++) {
+    PhotonBatch& batch = batches[b];
+    PhotonMap *photon_map = (batch.global) ? global_photon_map : caustic_photon_map;
+    if (!batch.global && combined_photon_map) {
+      for (size_t i = 0; i < batch.stored.size(); i++) batch.stored[i].flag |= PHOTON_CAUSTIC;
+      photon_map = global_photon_map;
     }
+    photon_map->AddPhotons(batch.stored);
+    std::vector<Photon>().swap(batch.stored);
+    direct_photon_map->AddPhotons(batch.direct);
+    std::vector<Photon>().swap(batch.direct);
+    irradiance_photons.insert(irradiance_photons.end(),
+      batch.irradiance_photons.begin(), batch.irradiance_photons.end());
+    std::vector<Photon>().swap(batch.irradiance_photons);
   }
 
   // Create balanced kd-trees within each photon map.
   std::cerr << "Building kd-tree for global photon map..." << std::endl;
   if (!global_photon_map->BuildKdTree()) { return 0; }
-  std::cerr << "Building kd-tree for caustic photon map..." << std::endl;
-  if (!caustic_photon_map->BuildKdTree()) { return 0; }
+  if (!combined_photon_map) {
+    std::cerr << "Building kd-tree for caustic photon map..." << std::endl;
+    if (!caustic_photon_map->BuildKdTree()) { return 0; }
+  }
+  if (num_gather_rays > 0) {
+    std::cerr << "Building kd-tree for direct photon map..." << std::endl;
+    if (!direct_photon_map->BuildKdTree()) { return 0; }
+  }
 
   // Return success.
   std::cerr << "Done building photon maps!" << std::endl;
   return 1;
 }
 
+// Count the global and caustic photons stored
+static void CountStoredPhotons(void)
+{
+  num_stored_global_photons = global_photon_map->NPhotons();
+  num_stored_caustic_photons = caustic_photon_map->NPhotons();
+  if (combined_photon_map) {
+    for (int i = 0; i < global_photon_map->NPhotons(); i++) {
+      if (!global_photon_map->Kth(i).IsCaustic()) continue;
+      num_stored_global_photons--;
+      num_stored_caustic_photons++;
+    }
+  }
+}
+
+// Return the key of the photon cache file for the scene and the photon
+// parameters.  Only the scene file itself is hashed, so edits to meshes
+// it includes are not noticed.
+static unsigned long long PhotonCacheKey(void)
+{
+  unsigned long long key = HashFile(input_scene_name);
+  int parameters[] = {
+    num_global_photons, num_caustic_photons, (int) seed, (int) sampler_type, E,
+    (num_gather_rays > 0) ? 1 : 0, caustic_projection, combined_photon_map,
+    PHOTON_BATCH_SIZE, IRRADIANCE_PHOTON_SPACING, MAX_CAUSTIC_PROJECTION_DRAWS
+  };
+  return HashBytes(parameters, sizeof(parameters), key);
+}
+
+// Read the photon maps from the cache file for this scene and these
+// photon parameters if there is one, or else trace them and write the
+// file (if a cache directory was given)
+static int ReadOrBuildPhotonMaps(void)
+{
+  // Check cache file
+  std::string filename;
+  unsigned long long key = 0;
+  if (photon_cache_directory) {
+    key = PhotonCacheKey();
+    char name[64];
+    snprintf(name, sizeof(name), "/photons-%016llx.bin", key);
+    filename = std::string(photon_cache_directory) + name;
+    const Photon *photons[4];
+    int nphotons[4];
+    if (photon_cache.Read(filename.c_str(), key, 4, photons, nphotons)) {
+      global_photon_map->SetKdTree(photons[0], nphotons[0]);
+      caustic_photon_map->SetKdTree(photons[1], nphotons[1]);
+      direct_photon_map->SetKdTree(photons[2], nphotons[2]);
+      irradiance_photons.assign(photons[3], photons[3] + nphotons[3]);
+      CountStoredPhotons();
+      std::cerr << "Read photon maps from " << filename << std::endl;
+      return 1;
+    }
+  }
+
+  // Trace photons
+  if (!BuildPhotonMaps()) return 0;
+  CountStoredPhotons();
+
+  // Write cache file
+  if (photon_cache_directory) {
+    const PhotonMap *maps[3] = { global_photon_map, caustic_photon_map, direct_photon_map };
+    const Photon *photons[4];
+    int nphotons[4];
+    for (int i = 0; i < 3; i++) {
+      nphotons[i] = maps[i]->NPhotons();
+      photons[i] = (nphotons[i] > 0) ? &maps[i]->Kth(0) : NULL;
+    }
+    nphotons[3] = (int) irradiance_photons.size();
+    photons[3] = irradiance_photons.data();
+    if (PhotonCache::Write(filename.c_str(), key, 4, photons, nphotons)) {
+      std::cerr << "Wrote photon maps to " << filename << std::endl;
+    }
+    else {
+      std::cerr << "Unable to write photon cache file " << filename << std::endl;
+    }
+  }
+
+  // Return success
+  return 1;
+}
+
+// Render with progressive photon mapping: trace eye paths once, then
+// alternate between tracing a pass of global photons (all the light
+// arriving at diffuse surfaces after the first bounce, caustics
+// included) and adding it to the visible points.  Only one pass of
+// photons is kept.  The output image is rewritten after every pass (or
+// as often as snapshots are requested) and when the time budget runs out.
+static int RenderProgressive(const RenderOptions& options)
+{
+  RNTime start_time;
+  start_time.Read();
+
+  // Trace eye paths
+  std::cerr << "Tracing eye paths..." << std::endl;
+  RNLength radius = initial_radius * scene->BBox().DiagonalRadius();
+  ProgressivePhotonMap progressive_photon_map(scene, radius, options);
+
+  RNTime snapshot_time;
+  snapshot_time.Read();
+  for (int pass = 0; (num_passes < 0) || (pass < num_passes); pass++) {
+    // Trace a pass of photons (with random streams not used by earlier passes)
+    std::vector<PhotonBatch> batches;
+    CreatePhotonBatches(num_global_photons, TRUE, batches);
+    TracePhotonBatches(batches, PHOTON_STREAM_OFFSET + pass * (unsigned int) batches.size());
+
+    // Gather them at the visible points and discard them
+    PhotonMap photon_map;
+    for (size_t b = 0; b < batches.size(); b++) {
+      photon_map.AddPhotons(batches[b].stored);
+      std::vector<Photon>().swap(batches[b].stored);
+    }
+    if (!photon_map.BuildKdTree()) return 0;
+    progressive_photon_map.AddPass(photon_map);
+    std::cerr << "Pass " << pass + 1 << ": " << photon_map.NPhotons()
+              << " photons stored" << std::endl;
+
+    // Write image of the passes so far if it is due
+    RNBoolean out_of_time = (options.time_budget > 0) && (start_time.Elapsed() > options.time_budget);
+    RNBoolean last = out_of_time || (pass + 1 == num_passes);
+    RNBoolean snapshot = (options.snapshot_passes == 0) && (options.snapshot_interval == 0);
+    if ((options.snapshot_passes > 0) && ((pass + 1) % options.snapshot_passes == 0)) snapshot = TRUE;
+    if ((options.snapshot_interval > 0) && (snapshot_time.Elapsed() >= options.snapshot_interval)) snapshot = TRUE;
+    if (last || snapshot) {
+      R2Image *image = progressive_photon_map.Image();
+      if (!image) return 0;
+      if (!WriteImage(image, output_image_name)) return 0;
+      delete image;
+      snapshot_time.Read();
+    }
+
+    // Stop when out of time
+    if (out_of_time) break;
+  }
+
+  // Return success
+  return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Main program
 ////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv)
 {
+  // Start the clock for the time budget
+  program_start_time.Read();
+
   // Parse program arguments
   if (!ParseArgs(argc, argv)) exit(-1);
 
@@ -1122,16 +1651,86 @@ int main(int argc, char **argv)
     // Set scene viewport
     scene->SetViewport(R2Viewport(0, 0, render_image_width, render_image_height));
 
+    // Set render options
+    RenderOptions options;
+    options.num_nearest_photons = N;
+    options.num_nearest_caustic_photons = (Nc < 0) ? N : Nc;
+    if (max_photon_distance > 0) {
+      options.max_photon_distance = max_photon_distance * scene->BBox().DiagonalRadius();
+    }
+    if (max_caustic_photon_distance > 0) {
+      options.max_caustic_photon_distance = max_caustic_photon_distance * scene->BBox().DiagonalRadius();
+    }
+    options.combined_photon_map = combined_photon_map;
+    options.min_nearest_photons = min_nearest_photons;
+    options.photon_filter = photon_filter;
+    options.num_light_samples = num_light_samples;
+    options.power_heuristic = power_heuristic;
+    options.sampler = sampler_type;
+    options.jitter_pixels = jitter_pixels;
+    options.specular_exponent = E;
+    options.num_samples = num_samples;
+    options.width = render_image_width;
+    options.height = render_image_height;
+    options.num_threads = num_threads;
+    options.seed = seed;
+    options.irradiance_cache_error = irradiance_cache_error;
+    options.num_gather_rays = num_gather_rays;
+    options.print_verbose = print_verbose;
+    options.progressive = progressive;
+    options.snapshot_passes = snapshot_passes;
+    options.snapshot_interval = snapshot_interval;
+    options.snapshot_image_name = output_image_name;
+    options.adaptive_threshold = adaptive_threshold;
+    options.sample_count_image_name = sample_count_image_name;
+    options.ray_packets = ray_packets;
+    options.wavefront = wavefront;
+
+    // Render progressively with bounded memory if requested (the time
+    // budget counts from program start)
+    if (num_passes != 0) {
+      if (time_budget > 0) {
+        options.time_budget = std::max(time_budget - program_start_time.Elapsed(), 1.0E-3);
+      }
+      if (!RenderProgressive(options)) exit(-1);
+      std::cerr << "Wrote image out to " << output_image_name << std::endl;
+      return 0;
+    }
+
     // Initialize photon maps
     InitializePhotonMaps();
 
     // Perform photon-tracing to build out photon maps
-    if (!BuildPhotonMaps()) { exit(-1); }
+    if (!ReadOrBuildPhotonMaps()) { exit(-1); }
 
+    // Bound photon gathers automatically by the density of photons stored
+    if (max_photon_distance < 0) {
+      options.max_photon_distance = AutoPhotonDistance(options.num_nearest_photons, num_stored_global_photons);
+    }
+    if (max_caustic_photon_distance < 0) {
+      options.max_caustic_photon_distance = AutoPhotonDistance(options.num_nearest_caustic_photons, num_stored_caustic_photons);
+    }
+
+    // Precompute irradiance for final gathering
+    if (num_gather_rays > 0) {
+      std::cerr << "Computing irradiance at " << irradiance_photons.size()
+                << " photons..." << std::endl;
+      PhotonMap *caustic_map = (combined_photon_map) ? global_photon_map : caustic_photon_map;
+      if (!BuildIrradiancePhotonMap(scene, direct_photon_map, global_photon_map,
+        caustic_map, irradiance_photons, irradiance_photon_map, options)) exit(-1);
+      std::vector<Photon>().swap(irradiance_photons);
+      delete direct_photon_map;
+      direct_photon_map = NULL;
+    }
+
+    // Render image (with what remains of the time budget)
+    if (time_budget > 0) {
+      options.time_budget = std::max(time_budget - program_start_time.Elapsed(), 1.0E-3);
+    }
     std::cerr << "Using photon maps to render image..." << std::endl;
-    // Render image
-    R2Image *image = RenderImage(scene, global_photon_map, caustic_photon_map,
-      N, E, num_samples, render_image_width, render_image_height, print_verbose);
+    PhotonMap *caustic_map = (combined_photon_map) ? global_photon_map : caustic_photon_map;
+    R2Image *image = RenderImage(scene, global_photon_map, caustic_map,
+      irradiance_photon_map, options);
     if (!image) exit(-1);
 
     // Write image
@@ -1153,7 +1752,7 @@ int main(int argc, char **argv)
     InitializePhotonMaps();
 
     // Build photon maps for viewing
-    if (!BuildPhotonMaps()) { exit(-1); }
+    if (!ReadOrBuildPhotonMaps()) { exit(-1); }
 
     // Run GLUT interface
     GLUTMainLoop();
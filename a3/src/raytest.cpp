@@ -0,0 +1,316 @@
+// Source file for the ray query test program
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Include files
+////////////////////////////////////////////////////////////////////////
+
+#include <map>
+#include <vector>
+
+#include "R3Graphics/R3Graphics.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Type definitions
+////////////////////////////////////////////////////////////////////////
+
+struct TestTriangle {
+  R3Point vertices[3];  // in world coordinates, rounded to single precision
+  R3Vector normal;
+};
+
+typedef std::vector<float> TestKey;  // coordinates of a vertex or the two of an edge
+
+struct TestCounts {
+  TestCounts(void) : nrays(0), nmisses(0), nocclusion_misses(0), npacket_misses(0) {};
+  int nrays;
+  int nmisses;
+  int nocclusion_misses;
+  int npacket_misses;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Test functions
+////////////////////////////////////////////////////////////////////////
+
+static void
+CollectTriangles(R3SceneNode *node, const R3Affine& parent_transformation,
+  RNArray<TestTriangle *>& triangles)
+{
+  // Compute transformation
+  R3Affine transformation = R3identity_affine;
+  transformation.Transform(parent_transformation);
+  transformation.Transform(node->Transformation());
+
+  // Collect triangles of node in world coordinates
+  for (int i = 0; i < node->NElements(); i++) {
+    R3SceneElement *element = node->Element(i);
+    for (int j = 0; j < element->NShapes(); j++) {
+      R3Shape *shape = element->Shape(j);
+      RNArray<R3Triangle *> shape_triangles;
+      if (shape->ClassID() == R3Triangle::CLASS_ID()) {
+        shape_triangles.Insert((R3Triangle *) shape);
+      }
+      else if (shape->ClassID() == R3TriangleArray::CLASS_ID()) {
+        R3TriangleArray *array = (R3TriangleArray *) shape;
+        for (int k = 0; k < array->NTriangles(); k++) shape_triangles.Insert(array->Triangle(k));
+      }
+      for (int k = 0; k < shape_triangles.NEntries(); k++) {
+        R3Triangle *triangle = shape_triangles.Kth(k);
+        TestTriangle *test_triangle = new TestTriangle();
+        test_triangle->vertices[0] = triangle->V0()->Position();
+        test_triangle->vertices[1] = triangle->V1()->Position();
+        test_triangle->vertices[2] = triangle->V2()->Position();
+        for (int v = 0; v < 3; v++) {
+          R3Point& p = test_triangle->vertices[v];
+          p.Transform(transformation);
+          p.Reset((float) p.X(), (float) p.Y(), (float) p.Z());
+        }
+        const R3Point *p = test_triangle->vertices;
+        test_triangle->normal = (p[1] - p[0]) % (p[2] - p[0]);
+        test_triangle->normal.Normalize();
+        triangles.Insert(test_triangle);
+      }
+    }
+  }
+
+  // Collect triangles of children
+  for (int i = 0; i < node->NChildren(); i++) {
+    CollectTriangles(node->Child(i), transformation, triangles);
+  }
+}
+
+
+
+static void
+TracePacket(R3Scene *scene, const R3Ray *rays, const RNScalar *max_ts, int nrays, TestCounts& counts)
+{
+  // Check that each ray of packet hits before its max_t
+  RNScalar hit_ts[R3_RAY_PACKET_SIZE];
+  int hits = scene->Intersects(rays, nrays, NULL, NULL, NULL, NULL, NULL, hit_ts);
+  for (int r = 0; r < nrays; r++) {
+    if (!(hits & (1 << r)) || (hit_ts[r] > max_ts[r])) counts.npacket_misses++;
+  }
+}
+
+
+
+static void
+TraceTestRays(R3Scene *scene, const R3Point& origin, const R3Point *targets, int ntargets,
+  TestCounts& counts)
+{
+  // Every ray from origin toward a point on a surface must hit a surface
+  // no further away than that point (give or take single precision
+  // rounding, magnified at oblique angles), traced alone, as an occlusion
+  // query and in packets
+  RNLength tolerance = 1.0E-4 * scene->BBox().DiagonalRadius();
+  R3Ray rays[R3_RAY_PACKET_SIZE];
+  RNScalar max_ts[R3_RAY_PACKET_SIZE];
+  int nrays = 0;
+  for (int i = 0; i < ntargets; i++) {
+    R3Vector vector = targets[i] - origin;
+    RNLength distance = vector.Length();
+    if (distance <= tolerance) continue;
+    R3Ray ray(origin, vector / distance);
+    RNScalar t;
+    counts.nrays++;
+    if (!scene->Intersects(ray, NULL, NULL, NULL, NULL, NULL, &t) || (t > distance + tolerance)) counts.nmisses++;
+    if (!scene->Occluded(ray, distance + tolerance)) counts.nocclusion_misses++;
+    rays[nrays] = ray;
+    max_ts[nrays] = distance + tolerance;
+    if (++nrays == R3_RAY_PACKET_SIZE) {
+      TracePacket(scene, rays, max_ts, nrays, counts);
+      nrays = 0;
+    }
+  }
+  if (nrays > 0) TracePacket(scene, rays, max_ts, nrays, counts);
+}
+
+
+
+static TestKey
+VertexKey(const R3Point& p)
+{
+  // Return key of vertex
+  TestKey key(3);
+  for (int dim = RN_X; dim <= RN_Z; dim++) key[dim] = (float) p[dim];
+  return key;
+}
+
+
+
+static TestKey
+EdgeKey(const R3Point& p, const R3Point& q)
+{
+  // Return key of edge (the same in either direction)
+  TestKey key = VertexKey(p);
+  TestKey key_q = VertexKey(q);
+  if (key_q < key) key.swap(key_q);
+  key.insert(key.end(), key_q.begin(), key_q.end());
+  return key;
+}
+
+
+
+static RNBoolean
+Crosses(const RNArray<TestTriangle *>& triangles, const std::vector<int>& indices, const R3Vector& direction)
+{
+  // Return whether triangles all face the same way along direction, clearly
+  // enough that a ray in direction near them must cross one of them
+  R3Vector vector = direction;
+  vector.Normalize();
+  int sign = 0;
+  for (size_t i = 0; i < indices.size(); i++) {
+    RNScalar dot = triangles.Kth(indices[i])->normal.Dot(vector);
+    if (fabs(dot) < 1.0E-2) return FALSE;
+    int triangle_sign = (dot > 0) ? 1 : -1;
+    if (sign == 0) sign = triangle_sign;
+    else if (triangle_sign != sign) return FALSE;
+  }
+  return TRUE;
+}
+
+
+
+static int
+TestScene(R3Scene *scene, const char *name, int nedge_points)
+{
+  // Collect triangles in world coordinates
+  RNArray<TestTriangle *> triangles;
+  CollectTriangles(scene->Root(), R3identity_affine, triangles);
+
+  // Find triangles around each vertex and edge
+  std::map<TestKey, std::vector<int> > vertex_triangles;
+  std::map<TestKey, std::vector<int> > edge_triangles;
+  for (int i = 0; i < triangles.NEntries(); i++) {
+    const R3Point *v = triangles.Kth(i)->vertices;
+    for (int e = 0; e < 3; e++) {
+      vertex_triangles[VertexKey(v[e])].push_back(i);
+      edge_triangles[EdgeKey(v[e], v[(e + 1) % 3])].push_back(i);
+    }
+  }
+
+  // Aim rays from scene center at points around which the surface is
+  // closed and crossed by the ray: interiors of triangles, points of edges
+  // between two triangles facing the same way along the ray, and vertices
+  // whose triangles all do so and whose edges all have two triangles
+  // (elsewhere rays may rightly pass, as they do past silhouettes)
+  R3Point origin = scene->BBox().Centroid();
+  std::vector<R3Point> targets;
+  for (int i = 0; i < triangles.NEntries(); i++) {
+    const R3Point *v = triangles.Kth(i)->vertices;
+    R3Point target = (v[0] + v[1] + v[2]) / 3.0;
+    if (RNIsZero(((v[1] - v[0]) % (v[2] - v[0])).Length())) continue;
+    if (Crosses(triangles, std::vector<int>(1, i), target - origin)) targets.push_back(target);
+  }
+  std::map<TestKey, std::vector<int> >::const_iterator it;
+  for (it = edge_triangles.begin(); it != edge_triangles.end(); it++) {
+    if (it->second.size() != 2) continue;
+    R3Point p(it->first[0], it->first[1], it->first[2]);
+    R3Point q(it->first[3], it->first[4], it->first[5]);
+    for (int k = 0; k < nedge_points; k++) {
+      R3Point target = p + ((k + 0.5) / nedge_points) * (q - p);
+      if (Crosses(triangles, it->second, target - origin)) targets.push_back(target);
+    }
+  }
+  for (it = vertex_triangles.begin(); it != vertex_triangles.end(); it++) {
+    R3Point p(it->first[0], it->first[1], it->first[2]);
+    RNBoolean closed = TRUE;
+    for (size_t i = 0; closed && (i < it->second.size()); i++) {
+      const R3Point *v = triangles.Kth(it->second[i])->vertices;
+      for (int e = 0; e < 3; e++) {
+        if ((VertexKey(v[e]) != it->first) && (VertexKey(v[(e + 1) % 3]) != it->first)) continue;
+        if (edge_triangles[EdgeKey(v[e], v[(e + 1) % 3])].size() != 2) closed = FALSE;
+      }
+    }
+    if (closed && Crosses(triangles, it->second, p - origin)) targets.push_back(p);
+  }
+
+  // Trace rays
+  TestCounts counts;
+  if (!targets.empty()) TraceTestRays(scene, origin, &targets[0], (int) targets.size(), counts);
+
+  // Delete triangles
+  for (int i = 0; i < triangles.NEntries(); i++) delete triangles.Kth(i);
+
+  // Print results
+  int nfailures = counts.nmisses + counts.nocclusion_misses + counts.npacket_misses;
+  printf("%-24s %8d rays  %d misses  %d occlusion misses  %d packet misses  %s\n",
+    name, counts.nrays, counts.nmisses, counts.nocclusion_misses, counts.npacket_misses,
+    (nfailures == 0) ? "ok" : "FAILED");
+  return (nfailures == 0) ? 1 : 0;
+}
+
+
+
+static R3Scene *
+CreateOctahedronScene(const R3Vector& translation)
+{
+  // Create closed octahedron with its vertices on the coordinate axes, so
+  // that every vertex and edge lies on coordinate planes
+  static const int faces[8][3] = {
+    { 0, 2, 4 }, { 2, 1, 4 }, { 1, 3, 4 }, { 3, 0, 4 },
+    { 2, 0, 5 }, { 1, 2, 5 }, { 3, 1, 5 }, { 0, 3, 5 }
+  };
+  RNArray<R3TriangleVertex *> vertices;
+  vertices.Insert(new R3TriangleVertex(R3Point(1, 0, 0) + translation));
+  vertices.Insert(new R3TriangleVertex(R3Point(-1, 0, 0) + translation));
+  vertices.Insert(new R3TriangleVertex(R3Point(0, 1, 0) + translation));
+  vertices.Insert(new R3TriangleVertex(R3Point(0, -1, 0) + translation));
+  vertices.Insert(new R3TriangleVertex(R3Point(0, 0, 1) + translation));
+  vertices.Insert(new R3TriangleVertex(R3Point(0, 0, -1) + translation));
+  RNArray<R3Triangle *> triangles;
+  for (int i = 0; i < 8; i++) {
+    triangles.Insert(new R3Triangle(vertices[faces[i][0]], vertices[faces[i][1]], vertices[faces[i][2]]));
+  }
+
+  // Create scene with octahedron
+  R3Scene *scene = new R3Scene();
+  R3SceneElement *element = new R3SceneElement();
+  element->InsertShape(new R3TriangleArray(vertices, triangles));
+  R3SceneNode *node = new R3SceneNode(scene);
+  node->InsertElement(element);
+  scene->Root()->InsertChild(node);
+  scene->UpdateBvh();
+  return scene;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Main program
+////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char **argv)
+{
+  // Test octahedra with vertices on coordinate planes, at the origin and
+  // where the planes are offset
+  int status = 1;
+  R3Scene *octahedron = CreateOctahedronScene(R3zero_vector);
+  status &= TestScene(octahedron, "octahedron", 64);
+  delete octahedron;
+  octahedron = CreateOctahedronScene(R3Vector(1000, 0, -1000));
+  status &= TestScene(octahedron, "offset octahedron", 64);
+  delete octahedron;
+
+  // Test scene files
+  for (int i = 1; i < argc; i++) {
+    R3Scene *scene = new R3Scene();
+    if (!scene->ReadFile(argv[i])) {
+      fprintf(stderr, "Unable to read scene from %s\n", argv[i]);
+      exit(-1);
+    }
+    const char *name = strrchr(argv[i], '/');
+    status &= TestScene(scene, (name) ? name + 1 : argv[i], 4);
+    delete scene;
+  }
+
+  // Return success if no ray missed
+  return (status) ? 0 : 1;
+}
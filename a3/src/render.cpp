@@ -10,19 +10,67 @@
 #include <iostream>
 #include <algorithm>
 #include <cmath>
+#include <vector>
 
 #include "R3Graphics/R3Graphics.h"
 #include "render.h"
+#include "irradiancecache.h"
+#include "sampler.h"
+#include "threadpool.h"
+#include "warp.h"
 
 ////////////////////////////////////////////////////////////////////////
 // Function to render image with photon mapping
 ////////////////////////////////////////////////////////////////////////
 
+// Width and height of the image tiles scheduled on render threads
+static const int TILE_SIZE = 16;
+
 static const RNScalar LOW = 0.0;
 static const RNScalar HIGH = 1.0;
 
-// Normal vector of coordinate system used to sample vectors
-static const R3Vector BASE = R3Vector(0.0, 0.0, 1.0);
+// Offset of shadow ray endpoints from surfaces, relative to scene radius
+static const RNScalar SHADOW_RAY_EPSILON = 1.0E-4;
+
+// Number of probe rays cast to find the validity radius of an irradiance
+// cache record, and bounds on that radius relative to the scene radius
+static const int IRRADIANCE_PROBE_RAYS = 16;
+static const RNScalar IRRADIANCE_MIN_RADIUS = 0.01;
+static const RNScalar IRRADIANCE_MAX_RADIUS = 0.5;
+
+// Minimum cosine between the normals at a final gather hit and at the
+// irradiance photon looked up for it
+static const RNScalar IRRADIANCE_NORMAL_COSINE = 0.9;
+
+// Number of irradiance photons computed by each task
+static const int IRRADIANCE_BATCH_SIZE = 1024;
+
+// Samples taken at every pixel before adaptive sampling may stop (or
+// num_samples, if fewer), and the most samples it may take at one pixel
+// (times num_samples)
+static const int ADAPTIVE_MIN_SAMPLES = 8;
+static const int ADAPTIVE_MAX_SAMPLES_FACTOR = 8;
+
+// Fraction of the photons gathered in each progressive pass that a
+// visible point keeps, shrinking its radius accordingly (alpha in PPM)
+static const RNScalar PPM_ALPHA = 0.7;
+
+// Maximum number of specular bounces followed by a progressive eye path
+static const int PPM_MAX_EYE_PATH_DEPTH = 32;
+
+// Number of visible points updated by each task in a progressive pass
+static const int PPM_BATCH_SIZE = 1024;
+
+// Number of paths traced together by the wavefront integrator, and of
+// queue entries processed by each task of one of its stages
+static const int WAVEFRONT_SIZE = 1 << 16;
+static const int WAVEFRONT_BATCH_SIZE = 256;
+
+// Sampler dimensions of a pixel sample used by its camera ray (its path
+// draws the rest), and those set aside for each stage of each bounce of
+// a wavefront path
+static const int CAMERA_SAMPLE_DIMENSIONS = 2;
+static const int WAVEFRONT_STAGE_DIMENSIONS = 64;
 
 static RNScalar clamp(RNScalar value, RNScalar low, RNScalar high)
 {
@@ -38,22 +86,6 @@ static void clampColor(RNRgb *color)
   color->Reset(clamp(r, LOW, HIGH), clamp(g, LOW, HIGH), clamp(b, LOW, HIGH));
 }
 
-// Rotate sample to the coordinate system defined by normal.
-static void RotateTo(R3Vector& sample, R3Vector &normal)
-{
-  // Normalize the normal vector defining the new coordinate system
-  normal.Normalize();
-
-  // Compute the axis of rotation
-  R3Vector rotation_axis = BASE;
-  rotation_axis.Cross(normal);
-
-  // Compute number of radians to rotate by
-  RNAngle angle = acos(BASE.Dot(normal));
-
-  // Rotate the sample (by mutation)
-  sample.Rotate(rotation_axis, angle);
-}
 
 static RR RussianRoulette(const R3Brdf *brdf, RNRgb *brdf_val)
 {
@@ -100,7 +132,7 @@ static RR RussianRoulette(const R3Brdf *brdf, RNRgb *brdf_val)
   }
 
   // Perform Russian Roulette to determine which action to take next
-  double k = RNRandomScalar();
+  double k = Sample1D();
   if (k < pd) {
     *brdf_val = brdf->Diffuse();
     brdf_val->SetRed(brdf_val->R() / (pd * total_r));
@@ -124,338 +156,1764 @@ static RR RussianRoulette(const R3Brdf *brdf, RNRgb *brdf_val)
   }
 }
 
-static int ShadowRay(R3Scene *scene, R3SceneElement *hit_elem,
-  R3Point pt, R3Light *light)
+// Sample the direction in which a ray continues from a surface with
+// (unit) normal n after Russian Roulette chose rr for incident direction
+// l, returning FALSE if the path ends there (absorption or total internal
+// reflection)
+static RNBoolean SampleDirection(RR rr, const R3Brdf *brdf, R3Vector l, R3Vector n,
+  int specular_exponent, R3Vector *dir)
 {
-  // Local variables
-  R3SceneNode *node;
-  R3SceneElement *element;
-  R3Shape *shape;
-  R3Point point;
-  R3Vector normal;
-  RNScalar t;
+  switch (rr) {
+    case DIFFUSE_REFLECTION: {
+      // Sample a diffuse reflection direction
+      RNScalar u1, u2;
+      Sample2D(&u1, &u2);
+      *dir = OrthonormalBasis(n).ToWorld(CosineHemisphereSample(u1, u2));
+      return TRUE;
+    }
+    case SPECULAR_REFLECTION: {
+      // Sample a specular reflection direction
+      RNScalar u1, u2;
+      Sample2D(&u1, &u2);
+      *dir = OrthonormalBasis(n).ToWorld(SpecularBounceSample(u1, u2, specular_exponent));
+      return TRUE;
+    }
+    case TRANSMISSION: {
+      RNScalar ior1 = 1.0; // incoming index of refraction
+      RNScalar ior2 = 1.0; // outgoing index of refraction
 
+      RNScalar c = -n.Dot(l);
+      RNBoolean inside = (c < 0) ? TRUE : FALSE;
+
+      if (inside == TRUE) { // Light is coming from inside the object
+        n = -n;
+        c = -n.Dot(l);
+        ior1 = brdf->IndexOfRefraction();
+      }
+      else {
+        ior2 = brdf->IndexOfRefraction();
+      }
+
+      RNScalar r = ior1 / ior2;
+      RNScalar s2 = r * sqrt(1.0 - pow(c, 2));
+      if (s2 > 1.0) { // Total internal reflection
+        return FALSE; // Terminate the ray; treat as ABSORPTION case
+      }
+
+      // Compute refracted direction
+      *dir = r * l + (r * c - sqrt(1 - pow(r, 2) * (1 - pow(c, 2)))) * n;
+      return TRUE;
+    }
+    case ABSORPTION: {
+      return FALSE;
+    }
+    default: {
+      std::cerr << "Invalid Russian Roulette state while ray-tracing" << std::endl;
+      exit(-1);
+    }
+  }
+}
+
+// Compute the shadow ray from pt toward (a sample point on) light and the
+// distance along it to the light, returning FALSE if pt is too close to
+// the light to be shadowed
+static RNBoolean ShadowSegment(R3Scene *scene, R3Point pt, R3Light *light,
+  R3Ray *ray, RNLength *max_t)
+{
   // Shadow ray variables
   R3Vector direction;
-  R3Point origin;
-
-  // Scene properties
-  double radius = scene->BBox().DiagonalRadius();
-  R3Point centroid = scene->BBox().Centroid();
+  RNLength distance;
 
   if (light->ClassID() == R3DirectionalLight::CLASS_ID()) {
     R3DirectionalLight *directional_light = (R3DirectionalLight *) light;
-    direction = directional_light->Direction();
-    origin = centroid - 1.25 * radius * direction;
+    direction = -(directional_light->Direction());
+    distance = RN_INFINITY;
   }
   else if (light->ClassID() == R3PointLight::CLASS_ID()) {
     R3PointLight *point_light = (R3PointLight *) light;
-    origin = point_light->Position();
-    direction = pt - origin;
+    direction = point_light->Position() - pt;
+    distance = direction.Length();
   }
   else if (light->ClassID() == R3SpotLight::CLASS_ID()) {
     R3SpotLight *spot_light = (R3SpotLight *) light;
-    origin = spot_light->Position();
-    direction = pt - origin;
+    direction = spot_light->Position() - pt;
+    distance = direction.Length();
   }
   else if (light->ClassID() == R3AreaLight::CLASS_ID()) {
     R3AreaLight *area_light = (R3AreaLight *) light;
-    origin = area_light->SamplePoint();
-    direction = pt - origin;
+    direction = area_light->SamplePoint() - pt;
+    distance = direction.Length();
   }
   else {
     std::cerr << "Unrecognized light ID" << std::endl;
     exit(-1);
   }
 
-  R3Ray ray = R3Ray(origin + 0.05 * direction, direction);
-  if (scene->Intersects(ray, &node, &element, &shape, &point, &normal, &t)) {
-    if (element == hit_elem) {
-      return 0;
-    } else {
-      return 1;
+  // Offset both ends of the segment to avoid hitting the surface at pt
+  // (and any geometry the light sits on)
+  RNLength epsilon = SHADOW_RAY_EPSILON * scene->BBox().DiagonalRadius();
+  if (distance <= 2 * epsilon) return FALSE;
+  direction.Normalize();
+  *ray = R3Ray(pt + epsilon * direction, direction);
+  *max_t = distance - 2 * epsilon;
+  return TRUE;
+}
+
+// Return whether the segment from pt to (a sample point on) light is blocked
+static int ShadowRay(R3Scene *scene, R3Point pt, R3Light *light)
+{
+  R3Ray ray;
+  RNLength max_t;
+  if (!ShadowSegment(scene, pt, light, &ray, &max_t)) return 0;
+  return scene->Occluded(ray, max_t) ? 1 : 0;
+}
+
+// Return whether shadow rays toward light can be traced in packets (those
+// toward area lights sample the light, in the order pixels are shaded)
+static RNBoolean IsPacketShadowLight(R3Light *light)
+{
+  return (light->ClassID() == R3AreaLight::CLASS_ID()) ? FALSE : TRUE;
+}
+
+// Return the light reflected toward V per unit of light arriving along
+// L at a surface with normal, as R3AreaLight evaluates it for each point
+// of the light (a diffuse term, and a Phong term with the exponent of
+// the BRDF's shininess)
+static RNRgb
+AreaLightReflectance(const R3Brdf *brdf, const R3Vector& V, const R3Vector& normal,
+  const R3Vector& L)
+{
+  RNScalar NL = normal.Dot(L);
+  if (NL <= 0) return RNblack_rgb;
+  RNRgb reflectance = NL * brdf->Diffuse();
+  R3Vector R = (2.0 * NL) * normal - L;
+  RNScalar VR = V.Dot(R);
+  if (VR > 0) reflectance += pow(VR, brdf->Shininess()) * brdf->Specular();
+  return reflectance;
+}
+
+// Return the light arriving at distance d from a point of light
+static RNRgb
+AreaLightIntensity(const R3AreaLight *light, RNLength d)
+{
+  RNScalar I = light->Intensity();
+  RNScalar denom = light->ConstantAttenuation();
+  denom += d * light->LinearAttenuation();
+  denom += d * d * light->QuadraticAttenuation();
+  if (RNIsPositive(denom)) I /= denom;
+  return I * light->Color();
+}
+
+// Return the density (per solid angle) with which AreaLightSampler draws
+// direction L from the BRDF: a cosine-weighted lobe around the normal
+// with probability diffuse_probability, and otherwise a Phong lobe
+// around the mirror direction of V
+static RNScalar
+BrdfSamplePdf(const R3Brdf *brdf, RNScalar diffuse_probability, const R3Vector& V,
+  const R3Vector& normal, const R3Vector& L)
+{
+  RNScalar pdf = 0;
+  RNScalar NL = normal.Dot(L);
+  if (NL > 0) pdf += diffuse_probability * NL / RN_PI;
+  R3Vector R = (2.0 * normal.Dot(V)) * normal - V;
+  RNScalar RL = R.Dot(L);
+  if (RL > 0) {
+    RNScalar s = brdf->Shininess();
+    pdf += (1 - diffuse_probability) * (s + 1) / (2 * RN_PI) * pow(RL, s);
+  }
+  return pdf;
+}
+
+// Return the multiple importance sampling weight of a sample drawn by
+// the first of two techniques, which took n1 and n2 samples with
+// densities pdf1 and pdf2 there (Veach's balance or power heuristic)
+static RNScalar
+MISWeight(int n1, RNScalar pdf1, int n2, RNScalar pdf2, RNBoolean power_heuristic)
+{
+  RNScalar a = n1 * pdf1;
+  RNScalar b = n2 * pdf2;
+  if (a >= RN_INFINITY) return 1;
+  if (power_heuristic) { a *= a; b *= b; }
+  return (a + b > 0) ? a / (a + b) : 0;
+}
+
+AreaLightSampler::AreaLightSampler(R3Scene *scene_, const RenderOptions& options)
+  : scene(scene_),
+    cdf(1, 0.0),
+    nsamples(options.num_light_samples),
+    power_heuristic(options.power_heuristic)
+{
+  // Collect area lights with the CDF of their power (that of a disc of
+  // point lights)
+  if (nsamples <= 0) return;
+  for (int k = 0; k < scene->NLights(); k++) {
+    R3Light *light = scene->Light(k);
+    if (light->ClassID() != R3AreaLight::CLASS_ID()) continue;
+    R3AreaLight *area_light = (R3AreaLight *) light;
+    RNScalar power = area_light->IsActive() ? area_light->Intensity() * area_light->Color().Luminance() *
+      RN_PI * area_light->Radius() * area_light->Radius() : 0;
+    lights.push_back(area_light);
+    cdf.push_back(cdf.back() + std::max(power, 0.0));
+  }
+}
+
+RNBoolean
+AreaLightSampler::IsSampled(const R3Light *light) const
+{
+  if (nsamples <= 0) return FALSE;
+  return (light->ClassID() == R3AreaLight::CLASS_ID()) ? TRUE : FALSE;
+}
+
+RNRgb
+AreaLightSampler::Estimate(const R3Brdf *brdf, const R3Point& eye, const R3Point& point,
+  const R3Vector& normal) const
+{
+  RNRgb direct = RNblack_rgb;
+  int nlights = (int) lights.size();
+  if ((nsamples <= 0) || (nlights == 0) || (cdf[nlights] <= 0)) return direct;
+  RNScalar diffuse_weight = brdf->Diffuse().Luminance();
+  RNScalar specular_weight = brdf->Specular().Luminance();
+  if (diffuse_weight + specular_weight <= 0) return direct;
+  RNScalar diffuse_probability = diffuse_weight / (diffuse_weight + specular_weight);
+  R3Vector V = eye - point;
+  V.Normalize();
+  RNLength epsilon = SHADOW_RAY_EPSILON * scene->BBox().DiagonalRadius();
+
+  // Choose the light of each light sample i at (i + u) / nsamples along
+  // the CDF of light power, so that each light gets its share of the
+  // samples, which are consecutive
+  static thread_local std::vector<int> sample_lights;
+  static thread_local std::vector<int> permutation;
+  sample_lights.resize(nsamples);
+  for (int i = 0; i < nsamples; i++) {
+    RNScalar u = (i + RNRandomScalar()) / nsamples * cdf[nlights];
+    int k = (int) (std::upper_bound(cdf.begin() + 1, cdf.end(), u) - (cdf.begin() + 1));
+    sample_lights[i] = std::min(k, nlights - 1);
+  }
+
+  // Sample points on the lights, spreading the samples of each light over
+  // its disc by Latin hypercube sampling of the unit square
+  for (int first = 0; first < nsamples; ) {
+    int k = sample_lights[first];
+    int last = first + 1;
+    while ((last < nsamples) && (sample_lights[last] == k)) last++;
+    int n = last - first;
+    permutation.resize(n);
+    for (int j = 0; j < n; j++) permutation[j] = j;
+    for (int j = n - 1; j > 0; j--) std::swap(permutation[j], permutation[(int) (RNRandomScalar() * (j + 1)) % (j + 1)]);
+
+    const R3AreaLight *light = lights[k];
+    RNScalar probability = (cdf[k + 1] - cdf[k]) / cdf[nlights];
+    RNArea area = RN_PI * light->Radius() * light->Radius();
+    R3Vector light_normal = light->Direction();
+    light_normal.Normalize();
+    R3Vector axis1 = light_normal % R3xyz_triad[light_normal.MinDimension()];
+    axis1.Normalize();
+    R3Vector axis2 = light_normal % axis1;
+    axis2.Normalize();
+    for (int j = 0; j < n; j++) {
+      RNScalar x, y;
+      ConcentricDiscSample((j + RNRandomScalar()) / n, (permutation[j] + RNRandomScalar()) / n, &x, &y);
+      R3Point sample_point = light->Position() + light->Radius() * (x * axis1 + y * axis2);
+      R3Vector L = sample_point - point;
+      RNLength d = L.Length();
+      if (d <= 2 * epsilon) continue;
+      L /= d;
+      RNRgb reflectance = AreaLightReflectance(brdf, V, normal, L);
+      if (reflectance == RNblack_rgb) continue;
+      if (scene->Occluded(R3Ray(point + epsilon * L, L), d - 2 * epsilon)) continue;
+      RNScalar cos_light = fabs(L.Dot(light_normal));
+      RNScalar light_pdf = (cos_light > 0) ? probability * d * d / (area * cos_light) : RN_INFINITY;
+      RNScalar brdf_pdf = BrdfSamplePdf(brdf, diffuse_probability, V, normal, L);
+      RNScalar weight = MISWeight(nsamples, light_pdf, nsamples, brdf_pdf, power_heuristic);
+      direct += (weight * area / (probability * nsamples)) * reflectance * AreaLightIntensity(light, d);
     }
-  } else {
-    return 0;
+    first = last;
+  }
+
+  // Sample directions from the BRDF, counting those that reach a light
+  R3Vector R = (2.0 * normal.Dot(V)) * normal - V;
+  R.Normalize();
+  OrthonormalBasis normal_basis(normal);
+  OrthonormalBasis mirror_basis(R);
+  for (int i = 0; i < nsamples; i++) {
+    RNBoolean diffuse = (RNRandomScalar() < diffuse_probability) ? TRUE : FALSE;
+    RNScalar u1 = RNRandomScalar();
+    RNScalar u2 = RNRandomScalar();
+    R3Vector L = (diffuse) ? normal_basis.ToWorld(CosineHemisphereSample(u1, u2)) :
+      mirror_basis.ToWorld(PhongLobeSample(u1, u2, brdf->Shininess()));
+    L.Normalize();
+    RNRgb reflectance = AreaLightReflectance(brdf, V, normal, L);
+    if (reflectance == RNblack_rgb) continue;
+
+    // Find the nearest light disc along L
+    int hit_light = -1;
+    RNScalar hit_t = RN_INFINITY;
+    RNScalar hit_cos = 0;
+    for (int k = 0; k < nlights; k++) {
+      if (cdf[k + 1] <= cdf[k]) continue;
+      const R3AreaLight *light = lights[k];
+      R3Vector light_normal = light->Direction();
+      light_normal.Normalize();
+      RNScalar cos_light = L.Dot(light_normal);
+      if (cos_light == 0) continue;
+      RNScalar t = (light->Position() - point).Dot(light_normal) / cos_light;
+      if ((t <= 2 * epsilon) || (t >= hit_t)) continue;
+      R3Point hit_point = point + t * L;
+      if (R3SquaredDistance(hit_point, light->Position()) > light->Radius() * light->Radius()) continue;
+      hit_light = k;
+      hit_t = t;
+      hit_cos = fabs(cos_light);
+    }
+    if (hit_light < 0) continue;
+    if (scene->Occluded(R3Ray(point + epsilon * L, L), hit_t - 2 * epsilon)) continue;
+
+    const R3AreaLight *light = lights[hit_light];
+    RNScalar probability = (cdf[hit_light + 1] - cdf[hit_light]) / cdf[nlights];
+    RNArea area = RN_PI * light->Radius() * light->Radius();
+    RNScalar light_pdf = probability * hit_t * hit_t / (area * hit_cos);
+    RNScalar brdf_pdf = BrdfSamplePdf(brdf, diffuse_probability, V, normal, L);
+    if (brdf_pdf <= 0) continue;
+    RNScalar weight = MISWeight(nsamples, brdf_pdf, nsamples, light_pdf, power_heuristic);
+    RNScalar jacobian = hit_t * hit_t / hit_cos;
+    direct += (weight * jacobian / (brdf_pdf * nsamples)) * reflectance * AreaLightIntensity(light, hit_t);
   }
+
+  return direct;
 }
 
+// Sum the light reflected toward eye from every light, with the shadow
+// ray results in occluded (one per light, negative if not yet traced),
+// estimating that of the lights area_lights samples with it instead
 static RNRgb
-EstimateDirect(R3Scene *scene, R3SceneElement *element,
-  R3Point point, const R3Brdf *brdf, R3Point eye, R3Vector normal)
+EstimateDirect(R3Scene *scene, R3Point point, const R3Brdf *brdf,
+  R3Point eye, R3Vector normal, const int *occluded = NULL,
+  const AreaLightSampler *area_lights = NULL)
 {
   RNRgb direct = RNblack_rgb;
   for (int k = 0; k < scene->NLights(); k++) {
     R3Light *light = scene->Light(k);
+    if (area_lights && area_lights->IsSampled(light)) continue;
 
-    if (!ShadowRay(scene, element, point, light)) {
+    int blocked = (occluded && (occluded[k] >= 0)) ? occluded[k] : ShadowRay(scene, point, light);
+    if (!blocked) {
       direct += light->Reflection(*brdf, eye, point, normal);
     }
   }
+  if (area_lights) direct += area_lights->Estimate(brdf, eye, point, normal);
 
   return direct;
 }
 
+// Estimate the gradient of irradiance at point from the photons gathered
+// there: if irradiance varies linearly over the gather disc of radius r,
+// the sum of photon power times the photon offset u_p in the tangent
+// plane is grad(E) * pi r^4 / 4.  Each channel's estimate is shrunk
+// toward zero by its own variance, so that photon noise is not
+// extrapolated across the irradiance cache.
+static void
+EstimateIrradianceGradient(const NearestPhotons& nearest_photons, R3Point point,
+  R3Vector normal, double radius_squared, R3Vector gradient[3])
+{
+  R3Vector sum[3] = { R3zero_vector, R3zero_vector, R3zero_vector };
+  double variance[3] = { 0, 0, 0 };
+  for (int i = 0; i < nearest_photons.NPhotons(); i++) {
+    const Photon *p = nearest_photons.Kth(i);
+    R3Vector u = p->Position() - point;
+    u -= normal.Dot(u) * normal;
+    RNRgb power = p->Power();
+    for (int c = 0; c < 3; c++) {
+      sum[c] += power[c] * u;
+      variance[c] += power[c] * power[c] * u.Dot(u);
+    }
+  }
+
+  double scale = 4.0 / (RN_PI * radius_squared * radius_squared);
+  for (int c = 0; c < 3; c++) {
+    gradient[c] = scale * sum[c];
+    double magnitude_squared = gradient[c].Dot(gradient[c]);
+    double error_squared = scale * scale * variance[c];
+    double shrink = (magnitude_squared > error_squared) ? 1.0 - error_squared / magnitude_squared : 0.0;
+    gradient[c] *= shrink;
+  }
+}
+
+// Return the harmonic mean distance to the surfaces seen from point over
+// the hemisphere about normal, which is Ward's validity radius for an
+// irradiance cache record there
+static RNLength
+HarmonicMeanDistance(R3Scene *scene, R3Point point, R3Vector normal)
+{
+  RNLength scene_radius = scene->BBox().DiagonalRadius();
+  RNLength epsilon = SHADOW_RAY_EPSILON * scene_radius;
+  double sum = 0;
+  normal.Normalize();
+  OrthonormalBasis basis(normal);
+  for (int k = 0; k < IRRADIANCE_PROBE_RAYS; k++) {
+    // Sample a cosine-weighted direction
+    RNScalar u1 = RNRandomScalar();
+    RNScalar u2 = RNRandomScalar();
+    R3Vector dir = basis.ToWorld(CosineHemisphereSample(u1, u2));
+
+    // Accumulate inverse distance to the first surface hit
+    RNScalar t;
+    R3Ray ray(point + epsilon * dir, dir);
+    if (scene->Intersects(ray, NULL, NULL, NULL, NULL, NULL, &t)) {
+      sum += 1.0 / std::max(t + epsilon, epsilon);
+    }
+  }
+
+  RNLength radius = (sum > 0) ? IRRADIANCE_PROBE_RAYS / sum : RN_INFINITY;
+  return clamp(radius, IRRADIANCE_MIN_RADIUS * scene_radius, IRRADIANCE_MAX_RADIUS * scene_radius);
+}
+
+// Estimate irradiance at point from the photons found near it (their
+// power, weighted by the filter, divided by the area of the disc that
+// holds them), adding a record to the irradiance cache if there is one.
+// Estimates from fewer than the minimum number of photons are zero.
 static RNRgb
-EstimateIndirect(PhotonMap *global_photon_map, R3Point point,
-  int num_nearest_photons)
+NearestIrradiance(R3Scene *scene, const NearestPhotons& nearest_photons,
+  IrradianceCache *irradiance_cache, R3Point point, R3Vector normal,
+  const RenderOptions& options)
 {
-  RNRgb indirect = RNblack_rgb;
-  if (num_nearest_photons > 0) {
-    // Find the nearest k photons to intersection point
-    RNArray<Photon *> nearest_photons;
-    RNLength distances[num_nearest_photons];
-    global_photon_map->Tree()->FindClosest(point, 0, FLT_MAX,
-        num_nearest_photons, nearest_photons, distances);
+  RNRgb irradiance = RNblack_rgb;
+  if (nearest_photons.NPhotons() == 0) return irradiance;
+  if (nearest_photons.NPhotons() < options.min_nearest_photons) return irradiance;
+
+  // Sum up photon power and divide by approximated sphere radius
+  // (the farthest photon found is at the top of the heap)
+  double radius_squared = nearest_photons.SquaredDistance(0);
+  for (int i = 0; i < nearest_photons.NPhotons(); i++) {
+    const Photon *p = nearest_photons.Kth(i);
+    if (options.photon_filter == BOX_FILTER) irradiance += p->Power();
+    else irradiance += PhotonFilterWeight(options.photon_filter,
+      nearest_photons.SquaredDistance(i), radius_squared) * p->Power();
+  }
+  double area = 1.0 * RN_PI * radius_squared;
+  irradiance /= area;
+
+  // Add a record to the irradiance cache
+  if (irradiance_cache && (radius_squared > 0)) {
+    R3Vector gradient[3];
+    EstimateIrradianceGradient(nearest_photons, point, normal, radius_squared, gradient);
+    RNLength radius = HarmonicMeanDistance(scene, point, normal);
+    irradiance_cache->Insert(point, normal, irradiance, gradient, radius);
+  }
+
+  return irradiance;
+}
 
-    for (int i = 0; i < nearest_photons.NEntries(); i++) {
-      Photon *p = nearest_photons.Kth(i);
-      indirect += p->power;
+static RNRgb
+EstimateIndirect(R3Scene *scene, PhotonMap *global_photon_map,
+  IrradianceCache *irradiance_cache, R3Point point, R3Vector normal,
+  const RenderOptions& options)
+{
+  RNRgb indirect = RNblack_rgb;
+  if (options.num_nearest_photons > 0) {
+    // Interpolate cached irradiance if there are valid records nearby
+    if (irradiance_cache && irradiance_cache->Interpolate(point, normal, &indirect)) {
+      return indirect;
     }
 
-    // Sum up photon power and divide by approximated sphere radius
-    double radius = distances[nearest_photons.NEntries() - 1];
-    double area = 1.0 * RN_PI * radius * radius;
-    indirect /= area;
+    // Find the nearest k photons to intersection point
+    static thread_local NearestPhotons nearest_photons;
+    global_photon_map->FindClosest(point, options.max_photon_distance,
+      options.num_nearest_photons, nearest_photons);
+    indirect = NearestIrradiance(scene, nearest_photons, irradiance_cache, point, normal, options);
   }
 
   return indirect;
 }
 
 static RNRgb
-EstimateCaustic(PhotonMap *caustic_photon_map, R3Point point,
-  int num_nearest_photons)
+EstimateCaustic(PhotonMap *caustic_photon_map, R3Point point, const RenderOptions& options)
 {
   RNRgb caustic = RNblack_rgb;
-  if (num_nearest_photons > 0) {
+  if (options.num_nearest_caustic_photons > 0) {
     // Find the nearest k photons to intersection point
-    RNArray<Photon *> nearest_photons;
-    RNLength distances[num_nearest_photons];
-    caustic_photon_map->Tree()->FindClosest(point, 0, FLT_MAX,
-        num_nearest_photons, nearest_photons, distances);
+    static thread_local NearestPhotons nearest_photons;
+    caustic_photon_map->FindClosest(point, options.max_caustic_photon_distance,
+      options.num_nearest_caustic_photons, nearest_photons);
+    caustic = NearestIrradiance(NULL, nearest_photons, NULL, point, R3zero_vector, options);
+  }
+
+  return caustic;
+}
+
+// Return the irradiance estimated from a batch gather of photons, as
+// EstimateIndirect and EstimateCaustic estimate it from a single search
+static RNRgb
+GatherIrradiance(const PhotonGather& gather, const RenderOptions& options)
+{
+  if (gather.nphotons == 0) return RNblack_rgb;
+  if (gather.nphotons < options.min_nearest_photons) return RNblack_rgb;
+  return gather.power / (RN_PI * gather.radius_squared);
+}
 
-    for (int i = 0; i < nearest_photons.NEntries(); i++) {
-      Photon *p = nearest_photons.Kth(i);
-      caustic += p->power;
+// Gather global photons at the first nglobal points and caustic photons
+// at all npoints of them (global must have room for npoints results),
+// with one search for both if they are stored in one map
+static void
+GatherPhotons(PhotonMap *global_photon_map, PhotonMap *caustic_photon_map,
+  const RenderOptions& options, const R3Point *points, int npoints, int nglobal,
+  PhotonGather *global, PhotonGather *caustic)
+{
+  if (options.combined_photon_map) {
+    global_photon_map->GatherClosest(points, nglobal,
+      options.max_photon_distance, options.num_nearest_photons, global,
+      options.max_caustic_photon_distance, options.num_nearest_caustic_photons, caustic,
+      options.photon_filter);
+    global_photon_map->GatherClosest(points + nglobal, npoints - nglobal,
+      options.max_photon_distance, 0, global + nglobal,
+      options.max_caustic_photon_distance, options.num_nearest_caustic_photons, caustic + nglobal,
+      options.photon_filter);
+  }
+  else {
+    global_photon_map->GatherClosest(points, nglobal,
+      options.max_photon_distance, options.num_nearest_photons, global, options.photon_filter);
+    caustic_photon_map->GatherClosest(points, npoints,
+      options.max_caustic_photon_distance, options.num_nearest_caustic_photons, caustic,
+      options.photon_filter);
+  }
+}
+
+// Data shared by all the rays traced for an image
+struct RenderContext {
+  R3Scene *scene;
+  PhotonMap *global_photon_map;
+  PhotonMap *caustic_photon_map;
+  PhotonMap *irradiance_photon_map; // precomputed irradiance for final gather
+  IrradianceCache *irradiance_cache;
+  const AreaLightSampler *area_lights;
+  const RenderOptions *options;
+};
+
+// Estimate the irradiance at point due to global photons (or the
+// irradiance cache) unless indirect is NULL, and due to caustic photons,
+// as EstimateIndirect and EstimateCaustic do, but with a single search
+// if both types of photon are stored in one map
+static void
+EstimatePhotonIrradiance(const RenderContext& context, IrradianceCache *irradiance_cache,
+  R3Point point, R3Vector normal, RNRgb *indirect, RNRgb *caustic)
+{
+  R3Scene *scene = context.scene;
+  const RenderOptions& options = *context.options;
+  if (!options.combined_photon_map) {
+    if (indirect) {
+      *indirect = EstimateIndirect(scene, context.global_photon_map, irradiance_cache,
+        point, normal, options);
     }
+    *caustic = EstimateCaustic(context.caustic_photon_map, point, options);
+    return;
+  }
 
-    // Sum up photon power and divide by approximated sphere radius
-    double radius = distances[nearest_photons.NEntries() - 1];
-    double area = 1.0 * RN_PI * radius * radius;
-    caustic /= area;
+  // Search for global photons only if there are no valid cache records
+  RNBoolean search_global = FALSE;
+  if (indirect) {
+    *indirect = RNblack_rgb;
+    if ((options.num_nearest_photons > 0) &&
+        !(irradiance_cache && irradiance_cache->Interpolate(point, normal, indirect))) {
+      search_global = TRUE;
+    }
   }
 
-  return caustic;
+  // Find the nearest photons of both types at once
+  static thread_local NearestPhotons global_photons;
+  static thread_local NearestPhotons caustic_photons;
+  context.global_photon_map->FindClosest(point,
+    options.max_photon_distance, (search_global) ? options.num_nearest_photons : 0,
+    options.max_caustic_photon_distance, std::max(options.num_nearest_caustic_photons, 0),
+    global_photons, caustic_photons);
+  if (search_global) {
+    *indirect = NearestIrradiance(scene, global_photons, irradiance_cache, point, normal, options);
+  }
+  *caustic = NearestIrradiance(NULL, caustic_photons, NULL, point, R3zero_vector, options);
 }
 
+// Estimate indirect irradiance at point by final gathering: cast
+// cosine-distributed rays over the hemisphere about normal and look up
+// the precomputed irradiance photon nearest to each diffuse surface they
+// hit.  Radiance leaving that surface is irradiance * diffuse / pi, and
+// the pi cancels with the cosine-weighted sampling density.
 static RNRgb
-TraceRay(R3Scene *scene, PhotonMap *global_photon_map,
-  PhotonMap *caustic_photon_map,
-  int num_nearest_photons, int specular_exponent, R3Ray ray, int depth,
-  int *ray_count)
+FinalGather(const RenderContext& context, R3Point point, R3Vector normal)
+{
+  R3Scene *scene = context.scene;
+  int num_gather_rays = context.options->num_gather_rays;
+
+  // Interpolate cached irradiance if there are valid records nearby
+  RNRgb indirect = RNblack_rgb;
+  IrradianceCache *irradiance_cache = context.irradiance_cache;
+  if (irradiance_cache && irradiance_cache->Interpolate(point, normal, &indirect)) {
+    return indirect;
+  }
+
+  RNLength scene_radius = scene->BBox().DiagonalRadius();
+  RNLength epsilon = SHADOW_RAY_EPSILON * scene_radius;
+  double inverse_distance_sum = 0;
+  normal.Normalize();
+  OrthonormalBasis basis(normal);
+  for (int k = 0; k < num_gather_rays; k++) {
+    // Sample a cosine-weighted direction
+    RNScalar u1, u2;
+    Sample2D(&u1, &u2);
+    R3Vector dir = basis.ToWorld(CosineHemisphereSample(u1, u2));
+
+    // Find the surface seen along the gather ray
+    R3SceneElement *element;
+    R3Point hit_point;
+    R3Vector hit_normal;
+    RNScalar t;
+    R3Ray ray(point + epsilon * dir, dir);
+    if (!scene->Intersects(ray, NULL, &element, NULL, &hit_point, &hit_normal, &t)) continue;
+    inverse_distance_sum += 1.0 / std::max(t + epsilon, epsilon);
+
+    // Add radiance leaving the surface toward point
+    const R3Material *material = (element) ? element->Material() : &R3default_material;
+    const R3Brdf *brdf = (material) ? material->Brdf() : &R3default_brdf;
+    if (!brdf || !brdf->IsDiffuse()) continue;
+    if (hit_normal.Dot(dir) > 0) hit_normal = -hit_normal;
+    hit_normal.Normalize();
+    const Photon *photon = context.irradiance_photon_map->FindNearest(hit_point,
+      hit_normal, IRRADIANCE_NORMAL_COSINE, FLT_MAX);
+    if (photon) indirect += photon->Power() * brdf->Diffuse();
+  }
+  if (num_gather_rays > 0) indirect /= num_gather_rays;
+
+  // Add a record to the irradiance cache, using the gather rays for
+  // its validity radius (gradients are not estimated)
+  if (irradiance_cache) {
+    R3Vector gradient[3] = { R3zero_vector, R3zero_vector, R3zero_vector };
+    RNLength radius = (inverse_distance_sum > 0) ? num_gather_rays / inverse_distance_sum : RN_INFINITY;
+    radius = clamp(radius, IRRADIANCE_MIN_RADIUS * scene_radius, IRRADIANCE_MAX_RADIUS * scene_radius);
+    irradiance_cache->Insert(point, normal, indirect, gradient, radius);
+  }
+
+  return indirect;
+}
+
+static RNRgb
+TraceRay(const RenderContext& context, R3Ray ray, int depth,
+  RNBoolean final_gather, long long *ray_count);
+
+// Compute the color seen along ray at its intersection with element, with
+// the shadow rays toward the lights traced already if occluded is not NULL
+static RNRgb
+Shade(const RenderContext& context, const R3Ray& ray, R3SceneElement *element,
+  const R3Point& point, const R3Vector& normal, const int *occluded, int depth,
+  RNBoolean final_gather, long long *ray_count)
 {
   // Local variables
+  R3Scene *scene = context.scene;
+  int specular_exponent = context.options->specular_exponent;
   const R3Point& eye = scene->Camera().Origin();
-  R3SceneNode *node;
+
+  // Initial color
+  RNRgb color = RNblack_rgb;
+
+  // Get intersection information
+  const R3Material *material = (element) ? element->Material() : &R3default_material;
+  const R3Brdf *brdf = (material) ? material->Brdf() : &R3default_brdf;
+
+  // Get light vector
+  R3Vector l = ray.Vector();
+  l.Normalize();
+
+  // Get normal vector
+  R3Vector n = normal;
+  n.Normalize();
+
+  // Add ambient lighting
+  color += scene->Ambient();
+
+  // Add emission from intersecting material
+  if (brdf) {
+    color += brdf->Emission();
+  }
+
+  // Add direct lighting
+  RNRgb direct = EstimateDirect(scene, point, brdf, eye, n, occluded, context.area_lights);
+  color += direct;
+
+  // Add indirect lighting (irradiance is cached on the side facing the
+  // ray), final gathering at the first diffuse surface if requested, and
+  // caustics.  The cache holds final gathers if there are any.
+  R3Vector facing_normal = (n.Dot(l) > 0) ? -n : n;
+  RNBoolean gather = (final_gather && brdf->IsDiffuse()) ? TRUE : FALSE;
+  IrradianceCache *irradiance_cache = (context.irradiance_photon_map) ? NULL : context.irradiance_cache;
+  RNRgb indirect, caustics;
+  if (gather) indirect = FinalGather(context, point, facing_normal);
+  EstimatePhotonIrradiance(context, irradiance_cache, point, facing_normal,
+    (gather) ? NULL : &indirect, &caustics);
+  color += indirect * brdf->Diffuse();
+  color += caustics * brdf->Diffuse();
+
+  // Russian Roulette + recursive ray tracing for specular component
+  // (gathering again only at the end of specular chains)
+  if (brdf) {
+    RNRgb brdf_val;
+    RR rr = RussianRoulette(brdf, &brdf_val);
+    R3Vector dir;
+    if (SampleDirection(rr, brdf, l, n, specular_exponent, &dir)) {
+      // Create new secondary ray to trace
+      R3Ray next_ray = R3Ray(point + 0.05 * dir, dir);
+
+      // Add recursive ray-traced color
+      RNBoolean next_final_gather = (rr == DIFFUSE_REFLECTION) ? FALSE : final_gather;
+      RNRgb mc_color = TraceRay(context, next_ray, depth + 1, next_final_gather, ray_count);
+      mc_color = mc_color * brdf_val;
+      // clampColor(&mc_color);
+
+      color += mc_color;
+    }
+  }
+
+  clampColor(&color);
+  return color;
+}
+
+static RNRgb
+TraceRay(const RenderContext& context, R3Ray ray, int depth,
+  RNBoolean final_gather, long long *ray_count)
+{
+  // Increment ray count
+  (*ray_count)++;
+
+  // Shade closest intersection
   R3SceneElement *element;
-  R3Shape *shape;
   R3Point point;
   R3Vector normal;
-  RNScalar t;
+  if (!context.scene->Intersects(ray, NULL, &element, NULL, &point, &normal)) return RNblack_rgb;
+  return Shade(context, ray, element, point, normal, NULL, depth, final_gather, ray_count);
+}
 
-  // Increment ray count
-  (*ray_count)++;
+RenderOptions::RenderOptions(void)
+  : num_nearest_photons(0),
+    num_nearest_caustic_photons(0),
+    max_photon_distance(FLT_MAX),
+    max_caustic_photon_distance(FLT_MAX),
+    combined_photon_map(FALSE),
+    min_nearest_photons(0),
+    photon_filter(BOX_FILTER),
+    num_light_samples(0),
+    power_heuristic(TRUE),
+    sampler(INDEPENDENT_SAMPLER),
+    jitter_pixels(FALSE),
+    specular_exponent(10),
+    num_samples(1),
+    width(64), height(64),
+    num_threads(0),
+    seed(0),
+    irradiance_cache_error(0),
+    num_gather_rays(0),
+    progressive(FALSE),
+    time_budget(0),
+    snapshot_passes(0),
+    snapshot_interval(0),
+    snapshot_image_name(NULL),
+    adaptive_threshold(0),
+    sample_count_image_name(NULL),
+    ray_packets(TRUE),
+    wavefront(FALSE),
+    print_verbose(0)
+{
+}
 
-  // Initial color
-  RNRgb color = RNblack_rgb;
+// Per-thread statistics, padded to avoid false sharing between threads
+struct RenderThreadStatistics {
+  alignas(64) long long ray_count;
+  long long sample_count;
+};
+
+// Samples taken at a pixel: their sum, and the running mean and sum of
+// squared deviations of their luminance (Welford's update), from which
+// the confidence interval of the pixel's value is estimated
+struct PixelSamples {
+  PixelSamples(void) : sum(RNblack_rgb), count(0), mean(0), m2(0), converged(FALSE) {}
+
+  void Add(const RNRgb& color) {
+    sum += color;
+    count++;
+    RNScalar x = color.Luminance();
+    RNScalar delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
 
-  if (scene->Intersects(ray, &node, &element, &shape, &point, &normal, &t)) {
-    // Get intersection information
-    const R3Material *material = (element) ? element->Material() : &R3default_material;
-    const R3Brdf *brdf = (material) ? material->Brdf() : &R3default_brdf;
+  // Half width of the 95% confidence interval of the mean luminance
+  RNScalar Error(void) const {
+    if (count < 2) return RN_INFINITY;
+    return 1.96 * sqrt(m2 / ((count - 1.0) * count));
+  }
 
-    // Get light vector
-    R3Vector l = ray.Vector();
-    l.Normalize();
+  RNRgb sum;
+  int count;
+  RNScalar mean;
+  RNScalar m2;
+  RNBoolean converged; // no more samples needed
+};
 
-    // Get normal vector
-    R3Vector n = normal;
-    n.Normalize();
+int
+BuildIrradiancePhotonMap(R3Scene *scene,
+  PhotonMap *direct_photon_map,
+  PhotonMap *global_photon_map,
+  PhotonMap *caustic_photon_map,
+  std::vector<Photon>& irradiance_photons,
+  PhotonMap *irradiance_photon_map,
+  const RenderOptions& options)
+{
+  // Compute irradiance at each photon from density estimates in all
+  // three maps, so that it includes direct lighting in photon power
+  // units.  The photon direction holds the surface normal.  Each batch
+  // of photons is gathered from each map in one batch query.
+  int nphotons = (int) irradiance_photons.size();
+  int nbatches = (nphotons + IRRADIANCE_BATCH_SIZE - 1) / IRRADIANCE_BATCH_SIZE;
+  ThreadPool pool(options.num_threads);
+  pool.Run(nbatches, [&](int batch, int) {
+    int first = batch * IRRADIANCE_BATCH_SIZE;
+    int last = std::min(first + IRRADIANCE_BATCH_SIZE, nphotons);
+    std::vector<R3Point> points(last - first);
+    std::vector<PhotonGather> direct_gathers(last - first);
+    std::vector<PhotonGather> global_gathers(last - first);
+    std::vector<PhotonGather> caustic_gathers(last - first);
+    for (int i = first; i < last; i++) points[i - first] = irradiance_photons[i].Position();
+    direct_photon_map->GatherClosest(points.data(), last - first,
+      options.max_photon_distance, options.num_nearest_photons, direct_gathers.data(),
+      options.photon_filter);
+    GatherPhotons(global_photon_map, caustic_photon_map, options, points.data(), last - first,
+      last - first, global_gathers.data(), caustic_gathers.data());
+    for (int i = first; i < last; i++) {
+      Photon& photon = irradiance_photons[i];
+      RNRgb irradiance = RNblack_rgb;
+      irradiance += GatherIrradiance(direct_gathers[i - first], options);
+      irradiance += GatherIrradiance(global_gathers[i - first], options);
+      irradiance += GatherIrradiance(caustic_gathers[i - first], options);
+      photon = Photon(points[i - first], photon.Direction(), irradiance);
+    }
+  });
 
-    // Add ambient lighting
-    color += scene->Ambient();
+  // Store irradiance photons in their own kd-tree
+  irradiance_photon_map->AddPhotons(irradiance_photons);
+  return irradiance_photon_map->BuildKdTree();
+}
 
-    // Add emission from intersecting material
-    if (brdf) {
-      color += brdf->Emission();
+// Set each pixel of image to the average of the samples accumulated
+// for it (pixels without any samples are black)
+static void
+ResolveImage(const std::vector<PixelSamples>& pixels, R2Image *image)
+{
+  int width = image->Width();
+  for (int i = 0; i < width; i++) {
+    for (int j = 0; j < image->Height(); j++) {
+      const PixelSamples& samples = pixels[j * width + i];
+      RNRgb color = (samples.count > 0) ? samples.sum / samples.count : RNblack_rgb;
+      clampColor(&color);
+      image->SetPixelRGB(i, j, color);
     }
+  }
+}
 
-    // Add direct lighting
-    RNRgb direct = EstimateDirect(scene, element, point, brdf, eye, n);
-    color += direct;
+// Write an image of the number of samples taken at each pixel, scaled so
+// that the pixel with the most samples is white
+static int
+WriteSampleCountImage(const std::vector<PixelSamples>& pixels, int width, int height,
+  const char *filename)
+{
+  int max_count = 1;
+  for (size_t i = 0; i < pixels.size(); i++) max_count = std::max(max_count, pixels[i].count);
+  R2Image image(width, height);
+  for (int i = 0; i < width; i++) {
+    for (int j = 0; j < height; j++) {
+      RNScalar value = (RNScalar) pixels[j * width + i].count / max_count;
+      image.SetPixelRGB(i, j, RNRgb(value, value, value));
+    }
+  }
+  return image.Write(filename);
+}
 
-    // Add indirect lighting
-    RNRgb indirect = EstimateIndirect(global_photon_map, point, num_nearest_photons);
-    color += indirect * brdf->Diffuse();
+// Return the camera ray of a sample of pixel (i, j) (the pixel's index
+// in the image), starting the thread's sampler at the sample.  The ray
+// is jittered within the pixel by the sample's first two dimensions if
+// requested, and otherwise goes through the same point for every sample.
+static R3Ray
+CameraRay(R3Scene *scene, int i, int j, int pixel, int sample, const RenderOptions& options)
+{
+  Sampler& sampler = ThreadSampler();
+  if (!options.jitter_pixels) {
+    sampler.StartSample(pixel, sample, CAMERA_SAMPLE_DIMENSIONS);
+    return scene->Viewer().WorldRay(i, j);
+  }
 
-    // Add caustics
-    RNRgb caustics = EstimateCaustic(caustic_photon_map, point, num_nearest_photons);
-    color += caustics * brdf->Diffuse();
+  // Offset the point R3Viewer::WorldRay aims at by the jitter
+  RNScalar u1, u2;
+  sampler.StartSample(pixel, sample, 0);
+  sampler.Next2D(&u1, &u2);
+  const R3Camera& camera = scene->Viewer().Camera();
+  const R2Viewport& viewport = scene->Viewer().Viewport();
+  RNScalar dx = 2 * (i + u1 - 0.5 - viewport.XCenter()) / viewport.Width();
+  RNScalar dy = 2 * (j + u2 - 0.5 - viewport.YCenter()) / viewport.Height();
+  R3Point far_origin = camera.Origin() + camera.Towards() * camera.Far();
+  R3Vector far_right = camera.Right() * camera.Far() * tan(camera.XFOV());
+  R3Vector far_up = camera.Up() * camera.Far() * tan(camera.YFOV());
+  return R3Ray(camera.Origin(), far_origin + (far_right * dx) + (far_up * dy));
+}
 
-    // Russian Roulette + recursive ray tracing for specular component
-    RNRgb mc_color = RNblack_rgb;
-    if (brdf) {
-      RNRgb brdf_val;
-      RR rr = RussianRoulette(brdf, &brdf_val);
+// Add nsamples samples to each pixel of packet, whose camera rays are
+// rays (pixels are their indices in the image).  The camera rays, and
+// the shadow rays from their hits toward point, spot and directional
+// lights, are the same for every sample (as camera rays are not
+// jittered, or nsamples is one), so they are traced once as packets.
+// Samples are shaded in the same order as they would be one at a time.
+static void
+SamplePacket(const RenderContext& context, const R3Ray *rays, const int *pixels, int nrays,
+  int nsamples, RNBoolean final_gather, PixelSamples **packet, long long *ray_count)
+{
+  // Intersect camera rays
+  R3Scene *scene = context.scene;
+  R3SceneElement *elements[R3_RAY_PACKET_SIZE];
+  R3Point points[R3_RAY_PACKET_SIZE];
+  R3Vector normals[R3_RAY_PACKET_SIZE];
+  int hits = scene->Intersects(rays, nrays, NULL, elements, NULL, points, normals);
+
+  // Trace shadow rays from the hits toward each light that allows it
+  int nlights = scene->NLights();
+  std::vector<int> occluded(nrays * nlights, -1);
+  for (int k = 0; k < nlights; k++) {
+    R3Light *light = scene->Light(k);
+    if (!IsPacketShadowLight(light)) continue;
+    R3Ray shadow_rays[R3_RAY_PACKET_SIZE];
+    RNScalar max_ts[R3_RAY_PACKET_SIZE];
+    int lanes[R3_RAY_PACKET_SIZE];
+    int nshadow_rays = 0;
+    for (int r = 0; r < nrays; r++) {
+      if (!(hits & (1 << r))) continue;
+      if (ShadowSegment(scene, points[r], light, &shadow_rays[nshadow_rays], &max_ts[nshadow_rays])) {
+        lanes[nshadow_rays++] = r;
+      }
+      else {
+        occluded[r * nlights + k] = 0;
+      }
+    }
+    if (nshadow_rays == 0) continue;
+    int blocked = scene->Occluded(shadow_rays, max_ts, nshadow_rays);
+    for (int s = 0; s < nshadow_rays; s++) {
+      occluded[lanes[s] * nlights + k] = (blocked >> s) & 1;
+    }
+  }
 
-      switch (rr) {
-        case DIFFUSE_REFLECTION: {
-          // Sample a diffuse reflection direction
-          RNScalar u1 = RNRandomScalar();
-          RNScalar u2 = RNRandomScalar();
-          RNAngle pitch = 2.0 * RN_PI * u2;
-          RNAngle yaw = acos(sqrt(u1));
-          R3Vector dir = R3Vector(pitch, yaw);
-          RotateTo(dir, n);
+  // Shade samples
+  for (int r = 0; r < nrays; r++) {
+    for (int k = 0; k < nsamples; k++) {
+      (*ray_count)++;
+      ThreadSampler().StartSample(pixels[r], packet[r]->count, CAMERA_SAMPLE_DIMENSIONS);
+      RNRgb color = RNblack_rgb;
+      if (hits & (1 << r)) {
+        color = Shade(context, rays[r], elements[r], points[r], normals[r],
+          occluded.data() + r * nlights, 0, final_gather, ray_count);
+      }
+      packet[r]->Add(color);
+    }
+  }
+}
 
-          // Create new secondary ray to trace
-          R3Ray next_ray = R3Ray(point + 0.05 * dir, dir);
+// Stop sampling a pixel once its value is known well enough
+static void
+UpdateConvergence(PixelSamples& samples, const RenderOptions& options)
+{
+  int min_samples = std::min(ADAPTIVE_MIN_SAMPLES, options.num_samples);
+  if ((options.adaptive_threshold > 0) && (samples.count >= min_samples) &&
+      (samples.Error() <= options.adaptive_threshold)) {
+    samples.converged = TRUE;
+  }
+}
 
-          // Get recursive ray-traced color
-          mc_color = TraceRay(scene, global_photon_map, caustic_photon_map,
-            num_nearest_photons, specular_exponent, next_ray, depth + 1, ray_count);
-          mc_color = mc_color * brdf_val;
-          // clampColor(&mc_color);
+// Return a key that orders rays by the octant of their direction and then
+// along a Morton curve through their origins
+static unsigned long long
+RayKey(const R3Ray& ray, const R3Box& box)
+{
+  const R3Vector& vector = ray.Vector();
+  unsigned long long octant = ((vector.X() < 0) ? 1 : 0) | ((vector.Y() < 0) ? 2 : 0) | ((vector.Z() < 0) ? 4 : 0);
+  return (octant << 60) | MortonCode(ray.Start(), box, 20);
+}
 
-          color += mc_color;
+// Sort queue by keys (one per entry)
+static void
+SortQueue(std::vector<int>& queue, const std::vector<unsigned long long>& keys)
+{
+  std::vector<std::pair<unsigned long long, int> > entries(queue.size());
+  for (size_t i = 0; i < queue.size(); i++) entries[i] = std::make_pair(keys[i], queue[i]);
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < queue.size(); i++) queue[i] = entries[i].second;
+}
 
-          break;
-        }
-        case SPECULAR_REFLECTION: {
-          // Sample a specular reflection direction
-          RNScalar u1 = RNRandomScalar();
-          RNScalar u2 = RNRandomScalar();
-          RNAngle pitch = 2.0 * RN_PI * u2;
-          RNAngle yaw = acos(pow(u1, 1.0 / (specular_exponent + 1.0)));
-          R3Vector dir = R3Vector(pitch, yaw);
-          RotateTo(dir, n);
-
-          // Create new secondary ray to trace
-          R3Ray next_ray = R3Ray(point + 0.05 * dir, dir);
-
-          // Add recursive ray-traced color
-          mc_color = TraceRay(scene, global_photon_map, caustic_photon_map,
-            num_nearest_photons, specular_exponent, next_ray, depth + 1, ray_count);
-          mc_color = mc_color * brdf_val;
-          // clampColor(&mc_color);
-
-          color += mc_color;
-
-          break;
-        }
-        case TRANSMISSION: {
-          RNScalar ior1 = 1.0; // incoming index of refraction
-          RNScalar ior2 = 1.0; // outgoing index of refraction
+// Run task(first, last) over the entries of a queue of n entries in batches
+static void
+RunBatches(ThreadPool& pool, int n, const std::function<void(int, int)>& task)
+{
+  int nbatches = (n + WAVEFRONT_BATCH_SIZE - 1) / WAVEFRONT_BATCH_SIZE;
+  pool.Run(nbatches, [&](int batch, int) {
+    task(batch * WAVEFRONT_BATCH_SIZE, std::min((batch + 1) * WAVEFRONT_BATCH_SIZE, n));
+  });
+}
+
+// Seed the random stream of a path for one stage of one bounce, and
+// start the thread's sampler at the dimensions of that stage of the
+// path's pixel sample, so that the random numbers a path uses do not
+// depend on the order of queues
+static void
+SeedPathStream(const RenderOptions& options, unsigned int path_id, int pixel, int sample,
+  int depth, int stage, int nstages)
+{
+  RNSeedRandomScalarStream(options.seed + 0x9E3779B9U * (unsigned int) (depth * nstages + stage + 1), path_id);
+  Sampler& sampler = ThreadSampler();
+  sampler = Sampler(options.sampler, options.num_samples, options.seed);
+  sampler.StartSample(pixel, sample, CAMERA_SAMPLE_DIMENSIONS + WAVEFRONT_STAGE_DIMENSIONS * (depth * nstages + stage));
+}
 
-          RNScalar c = -n.Dot(l);
-          RNBoolean inside = (c < 0) ? TRUE : FALSE;
+// Trace the paths starting with camera rays breadth first, stage by stage
+// over queues of path states, and return the color of each path (as
+// TraceRay would compute it, with different random numbers).  The pixel
+// and sample number of each ray index the numbers its path draws from
+// the sampler.
+//
+// Each bounce runs an extend stage (intersect rays, sorted by direction
+// and origin, in packets), a shadow stage per light, a gather stage
+// (photon map and final gather lookups, sorted by the Morton code of the
+// hit point) and a scatter stage (sample the next ray).  The color a hit
+// adds is stored at a path vertex, and since TraceRay clamps the color
+// returned at every bounce, colors are resolved from the last vertex of a
+// path back to its first once all paths have ended.
+static void
+TraceWavefront(const RenderContext& context, ThreadPool& pool, const std::vector<R3Ray>& rays,
+  const std::vector<int>& ray_pixels, const std::vector<int>& ray_samples,
+  unsigned int first_path_id, RNBoolean final_gather, std::vector<RNRgb>& colors, long long *ray_count)
+{
+  // Path state, and a hit along it
+  struct Path {
+    R3Ray ray;
+    int pixel;
+    int sample;
+    RNBoolean final_gather;
+    int vertex; // last vertex, or -1
+  };
+  struct Vertex {
+    RNRgb color;  // light added at hit
+    RNRgb weight; // brdf weight of the light returned by the next hit
+    int parent;   // previous vertex of path, or -1
+  };
+  struct Hit {
+    int path;
+    int vertex;
+    R3SceneElement *element;
+    const R3Brdf *brdf;
+    R3Point point;
+    R3Vector normal; // normalized
+    RNRgb direct;
+    RNBoolean hit;
+  };
+
+  // Local variables
+  R3Scene *scene = context.scene;
+  const RenderOptions& options = *context.options;
+  const R3Box& bbox = scene->BBox();
+  const R3Point& eye = scene->Camera().Origin();
+  int nlights = scene->NLights();
+  int nstages = nlights + 2;
+  int npaths = (int) rays.size();
+
+  // Start paths with camera rays
+  std::vector<Path> paths(npaths);
+  std::vector<Vertex> vertices;
+  std::vector<int> queue(npaths);
+  for (int p = 0; p < npaths; p++) {
+    paths[p].ray = rays[p];
+    paths[p].pixel = ray_pixels[p];
+    paths[p].sample = ray_samples[p];
+    paths[p].final_gather = final_gather;
+    paths[p].vertex = -1;
+    queue[p] = p;
+  }
 
-          if (inside == TRUE) { // Light is coming from inside the object
-            n = -n;
-            c = -n.Dot(l);
-            ior1 = brdf->IndexOfRefraction();
+  // Trace bounces until all paths have ended
+  std::vector<unsigned long long> keys;
+  std::vector<Hit> hits;
+  for (int depth = 0; !queue.empty(); depth++) {
+    // Extend stage: sort rays and find their closest hits
+    *ray_count += queue.size();
+    keys.resize(queue.size());
+    for (size_t q = 0; q < queue.size(); q++) keys[q] = RayKey(paths[queue[q]].ray, bbox);
+    SortQueue(queue, keys);
+    hits.resize(queue.size());
+    RunBatches(pool, (int) queue.size(), [&](int first, int last) {
+      for (int q = first; q < last; q += R3_RAY_PACKET_SIZE) {
+        int n = std::min(last - q, R3_RAY_PACKET_SIZE);
+        R3Ray packet_rays[R3_RAY_PACKET_SIZE];
+        R3SceneElement *elements[R3_RAY_PACKET_SIZE];
+        R3Point points[R3_RAY_PACKET_SIZE];
+        R3Vector normals[R3_RAY_PACKET_SIZE];
+        int mask = 0;
+        for (int r = 0; r < n; r++) packet_rays[r] = paths[queue[q + r]].ray;
+        if (options.ray_packets) {
+          mask = scene->Intersects(packet_rays, n, NULL, elements, NULL, points, normals);
+        }
+        else {
+          for (int r = 0; r < n; r++) {
+            if (scene->Intersects(packet_rays[r], NULL, &elements[r], NULL, &points[r], &normals[r])) mask |= 1 << r;
           }
-          else {
-            ior2 = brdf->IndexOfRefraction();
+        }
+        for (int r = 0; r < n; r++) {
+          Hit& hit = hits[q + r];
+          hit.path = queue[q + r];
+          hit.hit = (mask & (1 << r)) ? TRUE : FALSE;
+          if (!hit.hit) continue;
+          const R3Material *material = (elements[r]) ? elements[r]->Material() : &R3default_material;
+          hit.element = elements[r];
+          hit.brdf = (material) ? material->Brdf() : &R3default_brdf;
+          hit.point = points[r];
+          hit.normal = normals[r];
+          hit.normal.Normalize();
+          hit.direct = RNblack_rgb;
+        }
+      }
+    });
+
+    // Add a vertex for each hit (paths whose rays missed have ended)
+    int nhits = 0;
+    for (size_t h = 0; h < hits.size(); h++) {
+      if (!hits[h].hit) continue;
+      Hit& hit = hits[nhits++];
+      hit = hits[h];
+      Path& path = paths[hit.path];
+      hit.vertex = (int) vertices.size();
+      vertices.push_back({ RNblack_rgb, RNblack_rgb, path.vertex });
+      path.vertex = hit.vertex;
+    }
+    hits.resize(nhits);
+
+    // Shadow stage: trace sorted shadow rays toward each light in turn
+    std::vector<R3Ray> shadow_rays(nhits);
+    std::vector<RNScalar> shadow_max_ts(nhits);
+    std::vector<int> shadow_queue;
+    std::vector<char> occluded(nhits);
+    std::vector<RNRgb> reflections(nhits);
+    int first_sampled_light = -1;
+    for (int k = 0; k < nlights; k++) {
+      R3Light *light = scene->Light(k);
+
+      // Sample all the area lights that are sampled at once, with the
+      // random stream of the first of them
+      if (context.area_lights->IsSampled(light)) {
+        if (first_sampled_light >= 0) continue;
+        first_sampled_light = k;
+        RunBatches(pool, nhits, [&](int first, int last) {
+          for (int h = first; h < last; h++) {
+            SeedPathStream(options, first_path_id + hits[h].path, paths[hits[h].path].pixel,
+              paths[hits[h].path].sample, depth, 2 + k, nstages);
+            hits[h].direct += context.area_lights->Estimate(hits[h].brdf, eye, hits[h].point, hits[h].normal);
           }
+        });
+        continue;
+      }
 
-          RNScalar r = ior1 / ior2;
-          RNScalar s2 = r * sqrt(1.0 - pow(c, 2));
-          if (s2 > 1.0) { // Total internal reflection
-            break; // Terminate the ray; treat as ABSORPTION case
+      // (occluded marks the hits with a shadow ray to trace until it is
+      // traced, and the light reflected if unoccluded is computed from the
+      // same seeded stream, as area lights draw random numbers for it)
+      RunBatches(pool, nhits, [&](int first, int last) {
+        for (int h = first; h < last; h++) {
+          SeedPathStream(options, first_path_id + hits[h].path, paths[hits[h].path].pixel,
+            paths[hits[h].path].sample, depth, 2 + k, nstages);
+          occluded[h] = ShadowSegment(scene, hits[h].point, light, &shadow_rays[h], &shadow_max_ts[h]) ? 1 : 0;
+          reflections[h] = light->Reflection(*hits[h].brdf, eye, hits[h].point, hits[h].normal);
+        }
+      });
+      shadow_queue.clear();
+      for (int h = 0; h < nhits; h++) {
+        if (occluded[h]) shadow_queue.push_back(h);
+      }
+      keys.resize(shadow_queue.size());
+      for (size_t q = 0; q < shadow_queue.size(); q++) keys[q] = RayKey(shadow_rays[shadow_queue[q]], bbox);
+      SortQueue(shadow_queue, keys);
+      RunBatches(pool, (int) shadow_queue.size(), [&](int first, int last) {
+        for (int q = first; q < last; q += R3_RAY_PACKET_SIZE) {
+          int n = std::min(last - q, R3_RAY_PACKET_SIZE);
+          R3Ray packet_rays[R3_RAY_PACKET_SIZE];
+          RNScalar max_ts[R3_RAY_PACKET_SIZE];
+          for (int r = 0; r < n; r++) {
+            packet_rays[r] = shadow_rays[shadow_queue[q + r]];
+            max_ts[r] = shadow_max_ts[shadow_queue[q + r]];
           }
+          int mask = 0;
+          if (options.ray_packets) mask = scene->Occluded(packet_rays, max_ts, n);
           else {
-            // Compute refracted direction
-            R3Vector dir = r * l + (r * c - sqrt(1 - pow(r, 2) * (1 - pow(c, 2)))) * n;
-
-            // Create new secondary ray to trace
-            R3Ray next_ray = R3Ray(point + 0.05 * dir, dir);
-
-            // Add recursive ray-traced color
-            mc_color = TraceRay(scene, global_photon_map, caustic_photon_map,
-              num_nearest_photons, specular_exponent, next_ray, depth + 1, ray_count);
-            mc_color = mc_color * brdf_val;
-            // clampColor(&mc_color);
-
-            color += mc_color;
+            for (int r = 0; r < n; r++) {
+              if (scene->Occluded(packet_rays[r], max_ts[r])) mask |= 1 << r;
+            }
           }
+          for (int r = 0; r < n; r++) occluded[shadow_queue[q + r]] = (mask >> r) & 1;
+        }
+      });
+      RunBatches(pool, nhits, [&](int first, int last) {
+        for (int h = first; h < last; h++) {
+          if (occluded[h]) continue;
+          hits[h].direct += reflections[h];
+        }
+      });
+    }
 
-          break;
+    // Gather stage: look up photons near hits in Morton order
+    std::vector<int> gather_queue(nhits);
+    keys.resize(nhits);
+    for (int h = 0; h < nhits; h++) {
+      gather_queue[h] = h;
+      keys[h] = MortonCode(hits[h].point, bbox, 21);
+    }
+    SortQueue(gather_queue, keys);
+    IrradianceCache *irradiance_cache = (context.irradiance_photon_map) ? NULL : context.irradiance_cache;
+    RunBatches(pool, nhits, [&](int first, int last) {
+      // Gather caustic photons for all of the batch's hits, and global
+      // photons for those whose indirect light comes straight from the
+      // global map (which are put first), in batch queries
+      R3Point points[WAVEFRONT_BATCH_SIZE];
+      PhotonGather global_gathers[WAVEFRONT_BATCH_SIZE];
+      PhotonGather caustic_gathers[WAVEFRONT_BATCH_SIZE];
+      RNBoolean global[WAVEFRONT_BATCH_SIZE];
+      int gather_index[WAVEFRONT_BATCH_SIZE];
+      int nglobal = 0;
+      for (int q = first; q < last; q++) {
+        const Hit& hit = hits[gather_queue[q]];
+        global[q - first] = TRUE;
+        if (paths[hit.path].final_gather && hit.brdf->IsDiffuse()) global[q - first] = FALSE;
+        if (irradiance_cache) global[q - first] = FALSE;
+        if (global[q - first]) nglobal++;
+      }
+      int nglobal_points = 0, nother_points = nglobal;
+      for (int q = first; q < last; q++) {
+        int index = (global[q - first]) ? nglobal_points++ : nother_points++;
+        gather_index[q - first] = index;
+        points[index] = hits[gather_queue[q]].point;
+      }
+      GatherPhotons(context.global_photon_map, context.caustic_photon_map, options,
+        points, last - first, nglobal, global_gathers, caustic_gathers);
+
+      for (int q = first; q < last; q++) {
+        Hit& hit = hits[gather_queue[q]];
+        const Path& path = paths[hit.path];
+        const R3Brdf *brdf = hit.brdf;
+        SeedPathStream(options, first_path_id + hit.path, path.pixel, path.sample, depth, 0, nstages);
+
+        // Add ambient, emitted and direct light
+        RNRgb color = RNblack_rgb;
+        color += scene->Ambient();
+        if (brdf) color += brdf->Emission();
+        color += hit.direct;
+
+        // Add indirect light and caustics, as TraceRay does
+        R3Vector l = path.ray.Vector();
+        l.Normalize();
+        R3Vector facing_normal = (hit.normal.Dot(l) > 0) ? -hit.normal : hit.normal;
+        RNRgb indirect;
+        if (global[q - first]) {
+          indirect = GatherIrradiance(global_gathers[gather_index[q - first]], options);
         }
-        case ABSORPTION: {
-          break;
+        else if (path.final_gather && brdf->IsDiffuse()) {
+          indirect = FinalGather(context, hit.point, facing_normal);
         }
-        default: {
-          std::cerr << "Invalid Russian Roulette state while ray-tracing" << std::endl;
-          exit(-1);
+        else {
+          indirect = EstimateIndirect(scene, context.global_photon_map, irradiance_cache,
+            hit.point, facing_normal, options);
         }
+        color += indirect * brdf->Diffuse();
+        RNRgb caustics = GatherIrradiance(caustic_gathers[gather_index[q - first]], options);
+        color += caustics * brdf->Diffuse();
+        vertices[hit.vertex].color = color;
+      }
+    });
+
+    // Scatter stage: sample the next ray of each path
+    std::vector<char> scattered(nhits, 0);
+    RunBatches(pool, nhits, [&](int first, int last) {
+      for (int h = first; h < last; h++) {
+        Hit& hit = hits[h];
+        Path& path = paths[hit.path];
+        if (!hit.brdf) continue;
+        SeedPathStream(options, first_path_id + hit.path, path.pixel, path.sample, depth, 1, nstages);
+        R3Vector l = path.ray.Vector();
+        l.Normalize();
+        RNRgb brdf_val;
+        RR rr = RussianRoulette(hit.brdf, &brdf_val);
+        R3Vector dir;
+        if (!SampleDirection(rr, hit.brdf, l, hit.normal, options.specular_exponent, &dir)) continue;
+        path.ray = R3Ray(hit.point + 0.05 * dir, dir);
+        if (rr == DIFFUSE_REFLECTION) path.final_gather = FALSE;
+        vertices[hit.vertex].weight = brdf_val;
+        scattered[h] = 1;
       }
+    });
+    queue.clear();
+    for (int h = 0; h < nhits; h++) {
+      if (scattered[h]) queue.push_back(hits[h].path);
     }
   }
 
-  clampColor(&color);
-  return color;
+  // Resolve path colors from their last vertices back to their first
+  colors.resize(npaths);
+  for (int p = 0; p < npaths; p++) {
+    RNRgb color = RNblack_rgb;
+    for (int v = paths[p].vertex; v >= 0; v = vertices[v].parent) {
+      color = vertices[v].color + vertices[v].weight * color;
+      clampColor(&color);
+    }
+    colors[p] = color;
+  }
 }
 
 R2Image *
 RenderImage(R3Scene *scene,
   PhotonMap *global_photon_map,
   PhotonMap *caustic_photon_map,
-  int num_nearest_photons,
-  int specular_exponent,
-  int num_samples,
-  int width, int height,
-  int print_verbose)
+  PhotonMap *irradiance_photon_map,
+  const RenderOptions& options)
 {
   // Start statistics
   RNTime start_time;
   start_time.Read();
-  int ray_count = 0;
 
   // Allocate image
+  int width = options.width;
+  int height = options.height;
   R2Image *image = new R2Image(width, height);
   if (!image) {
     fprintf(stderr, "Unable to allocate image\n");
     return NULL;
   }
 
-  // Draw intersection point and normal for some rays
-  for (int i = 0; i < width; i++) {
-    for (int j = 0; j < height; j++) {
-      RNRgb color = RNblack_rgb;
-      for (int k = 0; k < num_samples; k++) {
-        R3Ray ray = scene->Viewer().WorldRay(i, j);
-        color += TraceRay(scene, global_photon_map, caustic_photon_map,
-          num_nearest_photons, specular_exponent, ray, 0, &ray_count);
+  // Compute the (lazily updated) scene bounding boxes before any threads
+  // start intersecting rays with the scene
+  scene->BBox();
+
+  // Create irradiance cache shared by all render threads
+  IrradianceCache *irradiance_cache = NULL;
+  if ((options.irradiance_cache_error > 0) && global_photon_map) {
+    irradiance_cache = new IrradianceCache(scene->BBox(), options.irradiance_cache_error);
+  }
+
+  // Gather from precomputed irradiance if there is any
+  RNBoolean final_gather = (irradiance_photon_map && (options.num_gather_rays > 0)) ? TRUE : FALSE;
+  if (!final_gather) irradiance_photon_map = NULL;
+
+  // Collect data shared by all rays
+  AreaLightSampler area_lights(scene, options);
+  RenderContext context;
+  context.scene = scene;
+  context.global_photon_map = global_photon_map;
+  context.caustic_photon_map = caustic_photon_map;
+  context.irradiance_photon_map = irradiance_photon_map;
+  context.irradiance_cache = irradiance_cache;
+  context.area_lights = &area_lights;
+  context.options = &options;
+
+  // Split image into tiles and render them in parallel, in passes of
+  // one sample per pixel if rendering progressively or adaptively.
+  // Adaptive sampling stops sampling pixels whose confidence interval is
+  // narrow enough, spending the num_samples per pixel budget on the
+  // others (up to a limit per pixel).
+  int ntiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  int ntiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  int ntiles = ntiles_x * ntiles_y;
+  RNBoolean adaptive = (options.adaptive_threshold > 0) ? TRUE : FALSE;
+  RNBoolean progressive = (options.progressive || adaptive) ? TRUE : FALSE;
+  int samples_per_pass = (progressive) ? 1 : options.num_samples;
+  int npasses = (progressive) ? options.num_samples : 1;
+  if (adaptive) npasses = ADAPTIVE_MAX_SAMPLES_FACTOR * options.num_samples;
+  long long sample_budget = (long long) width * height * options.num_samples;
+  std::vector<PixelSamples> pixels(width * height);
+  ThreadPool pool(options.num_threads);
+  std::vector<RenderThreadStatistics> statistics(pool.NThreads());
+  for (int t = 0; t < pool.NThreads(); t++) {
+    statistics[t].ray_count = 0;
+    statistics[t].sample_count = 0;
+  }
+  RNTime snapshot_time;
+  snapshot_time.Read();
+  int pass = 0;
+  unsigned int path_id = 0;
+  std::vector<int> wave_pixels;
+  std::vector<R3Ray> wave_rays;
+  std::vector<int> wave_ray_pixels;
+  std::vector<int> wave_ray_samples;
+  std::vector<RNRgb> wave_colors;
+  ThreadSampler() = Sampler(options.sampler, options.num_samples, options.seed);
+  while (pass < npasses) {
+    if (options.wavefront) {
+      // Trace paths breadth first, in waves of the pixels that need more
+      // samples
+      for (int p = 0; p < width * height; ) {
+        // Skip the rest of the pass once out of time
+        if ((pass > 0) && (options.time_budget > 0) &&
+            (start_time.Elapsed() > options.time_budget)) break;
+
+        // Collect camera rays of the next pixels
+        wave_pixels.clear();
+        wave_rays.clear();
+        wave_ray_pixels.clear();
+        wave_ray_samples.clear();
+        while ((p < width * height) &&
+               (wave_rays.empty() || ((int) wave_rays.size() + samples_per_pass <= WAVEFRONT_SIZE))) {
+          if (!pixels[p].converged) {
+            wave_pixels.push_back(p);
+            for (int k = 0; k < samples_per_pass; k++) {
+              int sample = pixels[p].count + k;
+              wave_rays.push_back(CameraRay(scene, p % width, p / width, p, sample, options));
+              wave_ray_pixels.push_back(p);
+              wave_ray_samples.push_back(sample);
+            }
+          }
+          p++;
+        }
+
+        // Trace paths and add their colors to pixels
+        TraceWavefront(context, pool, wave_rays, wave_ray_pixels, wave_ray_samples, path_id,
+          final_gather, wave_colors, &statistics[0].ray_count);
+        path_id += (unsigned int) wave_rays.size();
+        statistics[0].sample_count += wave_rays.size();
+        for (size_t w = 0; w < wave_pixels.size(); w++) {
+          PixelSamples& samples = pixels[wave_pixels[w]];
+          for (int k = 0; k < samples_per_pass; k++) samples.Add(wave_colors[w * samples_per_pass + k]);
+          UpdateConvergence(samples, options);
+        }
       }
-      color /= num_samples;
-      clampColor(&color);
+    }
+    else {
+      // Render tiles depth first
+      pool.Run(ntiles, [&](int tile, int thread) {
+        // Skip the rest of the pass once out of time
+        if ((pass > 0) && (options.time_budget > 0) &&
+            (start_time.Elapsed() > options.time_budget)) return;
+
+        // Seed the random stream from the pass and tile indices, so that
+        // the image does not depend on which thread renders which tile
+        RNSeedRandomScalarStream(options.seed, pass * ntiles + tile);
+        ThreadSampler() = Sampler(options.sampler, options.num_samples, options.seed);
+
+        // Render pixels of tile that need more samples
+        long long ray_count = 0;
+        int sample_count = 0;
+        int imin = (tile % ntiles_x) * TILE_SIZE;
+        int jmin = (tile / ntiles_x) * TILE_SIZE;
+        int imax = std::min(imin + TILE_SIZE, width);
+        int jmax = std::min(jmin + TILE_SIZE, height);
+        for (int i = imin; i < imax; i++) {
+          int j = jmin;
+          while (j < jmax) {
+            // Collect the next pixels down the column that need samples
+            R3Ray rays[R3_RAY_PACKET_SIZE];
+            int packet_pixels[R3_RAY_PACKET_SIZE];
+            PixelSamples *packet[R3_RAY_PACKET_SIZE];
+            int nrays = 0;
+            while ((j < jmax) && (nrays < R3_RAY_PACKET_SIZE)) {
+              PixelSamples& samples = pixels[j * width + i];
+              if (!samples.converged) {
+                rays[nrays] = scene->Viewer().WorldRay(i, j);
+                packet_pixels[nrays] = j * width + i;
+                packet[nrays++] = &samples;
+              }
+              j++;
+            }
+
+            // Sample pixels (a packet of jittered rays per sample)
+            if (options.ray_packets && !options.jitter_pixels) {
+              SamplePacket(context, rays, packet_pixels, nrays, samples_per_pass, final_gather, packet, &ray_count);
+            }
+            else if (options.ray_packets) {
+              for (int k = 0; k < samples_per_pass; k++) {
+                for (int r = 0; r < nrays; r++) {
+                  int pixel = packet_pixels[r];
+                  rays[r] = CameraRay(scene, pixel % width, pixel / width, pixel, packet[r]->count, options);
+                }
+                SamplePacket(context, rays, packet_pixels, nrays, 1, final_gather, packet, &ray_count);
+              }
+            }
+            else {
+              for (int r = 0; r < nrays; r++) {
+                int pixel = packet_pixels[r];
+                for (int k = 0; k < samples_per_pass; k++) {
+                  R3Ray ray = CameraRay(scene, pixel % width, pixel / width, pixel, packet[r]->count, options);
+                  packet[r]->Add(TraceRay(context, ray, 0, final_gather, &ray_count));
+                }
+              }
+            }
+            sample_count += nrays * samples_per_pass;
+
+            // Stop sampling pixels once their values are known well enough
+            for (int r = 0; r < nrays; r++) UpdateConvergence(*packet[r], options);
+          }
+        }
+
+        statistics[thread].ray_count += ray_count;
+        statistics[thread].sample_count += sample_count;
+        ThreadSampler() = Sampler();
+      });
+    }
+    pass++;
+
+    // Stop adaptive sampling when the budget is spent or every pixel has
+    // converged
+    if (adaptive) {
+      long long sample_count = 0;
+      for (int t = 0; t < pool.NThreads(); t++) sample_count += statistics[t].sample_count;
+      int nactive = 0;
+      for (size_t i = 0; i < pixels.size(); i++) {
+        if (!pixels[i].converged) nactive++;
+      }
+      if ((nactive == 0) || (sample_count + nactive > sample_budget)) break;
+    }
 
-      // color *= 0.5;
+    // Stop when out of time
+    if ((options.time_budget > 0) && (start_time.Elapsed() > options.time_budget)) break;
+
+    // Write a snapshot of the passes so far if it is due
+    if (!options.snapshot_image_name || (pass == npasses)) continue;
+    RNBoolean snapshot = FALSE;
+    if ((options.snapshot_passes > 0) && (pass % options.snapshot_passes == 0)) snapshot = TRUE;
+    if ((options.snapshot_interval > 0) && (snapshot_time.Elapsed() >= options.snapshot_interval)) snapshot = TRUE;
+    if (snapshot) {
+      ResolveImage(pixels, image);
+      if (!image->Write(options.snapshot_image_name)) {
+        fprintf(stderr, "Unable to write snapshot to %s\n", options.snapshot_image_name);
+      }
+      else if (options.print_verbose) {
+        printf("Wrote snapshot of %d passes to %s\n", pass, options.snapshot_image_name);
+        fflush(stdout);
+      }
+      snapshot_time.Read();
+    }
+  }
 
-      // Set pixel color
-      image->SetPixelRGB(i, j, color);
+  ThreadSampler() = Sampler();
+
+  // Average samples of the passes rendered
+  ResolveImage(pixels, image);
+
+  // Write the number of samples taken at each pixel if requested
+  if (options.sample_count_image_name) {
+    if (!WriteSampleCountImage(pixels, width, height, options.sample_count_image_name)) {
+      fprintf(stderr, "Unable to write sample counts to %s\n", options.sample_count_image_name);
     }
   }
 
+  // Merge per-thread statistics
+  long long ray_count = 0;
+  long long sample_count = 0;
+  for (int t = 0; t < pool.NThreads(); t++) {
+    ray_count += statistics[t].ray_count;
+    sample_count += statistics[t].sample_count;
+  }
 
   // Print statistics
-  if (print_verbose) {
+  if (options.print_verbose) {
     printf("Rendered image ...\n");
     printf("  Time = %.2f seconds\n", start_time.Elapsed());
-    printf("  # Rays = %d\n", ray_count);
+    printf("  # Threads = %d\n", pool.NThreads());
+    if (progressive) printf("  # Passes = %d\n", pass);
+    printf("  # Samples = %lld\n", sample_count);
+    if (adaptive) {
+      int nconverged = 0;
+      for (size_t i = 0; i < pixels.size(); i++) {
+        if (pixels[i].converged) nconverged++;
+      }
+      printf("  # Converged pixels = %d\n", nconverged);
+    }
+    printf("  # Rays = %lld\n", ray_count);
+    if (irradiance_cache) printf("  # Irradiance records = %d\n", irradiance_cache->NRecords());
+    fflush(stdout);
+  }
+
+  // Delete irradiance cache
+  if (irradiance_cache) delete irradiance_cache;
+
+  // Return image
+  return image;
+}
+
+ProgressivePhotonMap::ProgressivePhotonMap(R3Scene *scene_, RNLength initial_radius,
+  const RenderOptions& options_)
+  : scene(scene_),
+    options(options_),
+    area_lights(scene_, options_),
+    npasses(0),
+    colors(options_.width * options_.height, RNblack_rgb),
+    points(options_.width * options_.height * std::max(options_.num_samples, 1))
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Compute the (lazily updated) scene bounding boxes before any threads
+  // start intersecting rays with the scene
+  scene->BBox();
+
+  // Trace eye paths of all pixel samples in parallel, seeding each tile
+  // like RenderImage does
+  int width = options.width;
+  int height = options.height;
+  int num_samples = std::max(options.num_samples, 1);
+  int ntiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  int ntiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  ThreadPool pool(options.num_threads);
+  pool.Run(ntiles_x * ntiles_y, [&](int tile, int) {
+    RNSeedRandomScalarStream(options.seed, tile);
+    ThreadSampler() = Sampler(options.sampler, num_samples, options.seed);
+    int imin = (tile % ntiles_x) * TILE_SIZE;
+    int jmin = (tile / ntiles_x) * TILE_SIZE;
+    int imax = std::min(imin + TILE_SIZE, width);
+    int jmax = std::min(jmin + TILE_SIZE, height);
+    for (int i = imin; i < imax; i++) {
+      for (int j = jmin; j < jmax; j++) {
+        int pixel = j * width + i;
+        RNRgb color = RNblack_rgb;
+        for (int k = 0; k < num_samples; k++) {
+          R3Ray ray = CameraRay(scene, i, j, pixel, k, options);
+          VisiblePoint& point = points[pixel * num_samples + k];
+          TraceEyePath(ray, &color, &point);
+          if (point.radius_squared > 0) point.radius_squared = initial_radius * initial_radius;
+        }
+        colors[pixel] = color / num_samples;
+      }
+    }
+    ThreadSampler() = Sampler();
+  });
+
+  // Print statistics
+  if (options.print_verbose) {
+    printf("Traced eye paths ...\n");
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  # Visible points = %d\n", NVisiblePoints());
+    printf("  Initial radius = %g\n", initial_radius);
     fflush(stdout);
   }
+}
+
+int
+ProgressivePhotonMap::NVisiblePoints(void) const
+{
+  int count = 0;
+  for (size_t i = 0; i < points.size(); i++) {
+    if (points[i].radius_squared > 0) count++;
+  }
+  return count;
+}
+
+void
+ProgressivePhotonMap::TraceEyePath(const R3Ray& eye_ray, RNRgb *color, VisiblePoint *point) const
+{
+  // No visible point until the path reaches a diffuse surface
+  point->weight = RNblack_rgb;
+  point->radius_squared = 0;
+  point->count = 0;
+  point->flux = RNblack_rgb;
+
+  const R3Point& eye = scene->Camera().Origin();
+  RNRgb throughput(1, 1, 1);
+  R3Ray ray = eye_ray;
+  for (int depth = 0; depth < PPM_MAX_EYE_PATH_DEPTH; depth++) {
+    R3SceneElement *element;
+    R3Point position;
+    R3Vector normal;
+    RNScalar t;
+    if (!scene->Intersects(ray, NULL, &element, NULL, &position, &normal, &t)) break;
+
+    // Get intersection information
+    const R3Material *material = (element) ? element->Material() : &R3default_material;
+    const R3Brdf *brdf = (material) ? material->Brdf() : &R3default_brdf;
+    R3Vector l = ray.Vector();
+    l.Normalize();
+    R3Vector n = normal;
+    n.Normalize();
+
+    // Add the light that does not come from photons, as TraceRay does
+    RNRgb direct = scene->Ambient() + brdf->Emission() + EstimateDirect(scene, position, brdf, eye, n, NULL, &area_lights);
+    *color += throughput * direct;
+
+    // Leave a visible point at the first diffuse surface
+    if ((point->radius_squared == 0) && brdf->IsDiffuse()) {
+      point->position = position;
+      point->normal = (n.Dot(l) > 0) ? -n : n;
+      point->weight = throughput * brdf->Diffuse();
+      point->radius_squared = 1;
+    }
+
+    // Follow specular reflections and transmissions (diffuse
+    // interreflections are carried by the photons)
+    RNRgb brdf_val;
+    RR rr = RussianRoulette(brdf, &brdf_val);
+    if (rr == DIFFUSE_REFLECTION) break;
+    R3Vector dir;
+    if (!SampleDirection(rr, brdf, l, n, options.specular_exponent, &dir)) break;
+    throughput *= brdf_val;
+    ray = R3Ray(position + 0.05 * dir, dir);
+  }
+}
+
+void
+ProgressivePhotonMap::AddPass(const PhotonMap& photon_map)
+{
+  // Gather the photons of this pass at every visible point in parallel
+  // (each task owns its points, so no synchronization is needed)
+  int npoints = (int) points.size();
+  int nbatches = (npoints + PPM_BATCH_SIZE - 1) / PPM_BATCH_SIZE;
+  ThreadPool pool(options.num_threads);
+  pool.Run(nbatches, [&](int batch, int) {
+    int last = std::min((batch + 1) * PPM_BATCH_SIZE, npoints);
+    for (int i = batch * PPM_BATCH_SIZE; i < last; i++) {
+      VisiblePoint& point = points[i];
+      if (point.radius_squared <= 0) continue;
+      RNRgb power;
+      int m = photon_map.SumPower(point.position, point.normal, sqrt(point.radius_squared), &power);
+      if (m == 0) continue;
+
+      // Keep a fraction alpha of the new photons, shrinking the radius
+      // (and the flux within it) so that the photon density is unchanged
+      RNScalar count = point.count + PPM_ALPHA * m;
+      RNScalar scale = count / (point.count + m);
+      point.radius_squared *= scale;
+      point.flux = (point.flux + power) * scale;
+      point.count = count;
+    }
+  });
+
+  npasses++;
+}
+
+R2Image *
+ProgressivePhotonMap::Image(void) const
+{
+  // Allocate image
+  int width = options.width;
+  int height = options.height;
+  R2Image *image = new R2Image(width, height);
+  if (!image) {
+    fprintf(stderr, "Unable to allocate image\n");
+    return NULL;
+  }
+
+  // Add the radiance estimate of each visible point, whose flux is the
+  // sum over passes of photon power normalized per pass
+  int num_samples = std::max(options.num_samples, 1);
+  for (int i = 0; i < width; i++) {
+    for (int j = 0; j < height; j++) {
+      int pixel = j * width + i;
+      RNRgb color = colors[pixel];
+      for (int k = 0; k < num_samples; k++) {
+        const VisiblePoint& point = points[pixel * num_samples + k];
+        if ((point.radius_squared <= 0) || (npasses == 0)) continue;
+        RNScalar area = RN_PI * point.radius_squared;
+        color += point.weight * point.flux / (area * npasses * num_samples);
+      }
+      clampColor(&color);
+      image->SetPixelRGB(i, j, color);
+    }
+  }
 
   // Return image
   return image;
@@ -2,11 +2,135 @@
 #ifndef RENDER_H
 #define RENDER_H
 
+#include <vector>
+
 #include "photon.h"
+#include "sampler.h"
+
+// Parameters controlling how an image is rendered
+struct RenderOptions {
+  RenderOptions(void);
+
+  int num_nearest_photons; // global photons per radiance estimate
+  int num_nearest_caustic_photons; // caustic photons per radiance estimate
+  RNLength max_photon_distance; // max radius of global photon gathers
+  RNLength max_caustic_photon_distance; // max radius of caustic photon gathers
+  RNBoolean combined_photon_map; // caustic photons are tagged in the global map
+  int min_nearest_photons; // fewer photons than this estimate zero irradiance
+  PhotonFilter photon_filter; // kernel weighting photons by distance
+  int num_light_samples;   // area light samples per hit (0 = one shadow ray per light)
+  RNBoolean power_heuristic; // MIS weights by power (else balance) heuristic
+  SamplerType sampler;     // generator of pixel sample numbers
+  RNBoolean jitter_pixels; // jitter camera rays within pixels
+  int specular_exponent;   // exponent used to sample glossy reflections
+  int num_samples;         // samples per pixel
+  int width, height;       // image resolution
+  int num_threads;         // render threads (0 = one per core)
+  unsigned int seed;       // seed for the per-tile random streams
+  double irradiance_cache_error; // max irradiance cache error (0 = no cache)
+  int num_gather_rays;     // final gather rays per diffuse hit (0 = no final gather)
+  RNBoolean progressive;   // render passes of one sample per pixel
+  double time_budget;      // seconds after which passes stop (0 = no limit)
+  int snapshot_passes;     // passes between snapshot images (0 = none)
+  double snapshot_interval; // seconds between snapshot images (0 = none)
+  const char *snapshot_image_name; // file overwritten by each snapshot
+  double adaptive_threshold; // max 95% interval half width of pixel luminance (0 = off)
+  const char *sample_count_image_name; // debug image of samples per pixel
+  RNBoolean ray_packets;   // trace camera and shadow rays in packets
+  RNBoolean wavefront;     // trace paths breadth first, stage by stage
+  int print_verbose;
+};
+
+// Next-event estimation of the direct light from a scene's area lights:
+// each estimate takes num_light_samples points on the lights, chosen in
+// proportion to light power from a CDF and stratified on each light's
+// disc, and as many directions sampled from the BRDF, combining the two
+// with multiple importance sampling.  Lights are treated as R3AreaLight
+// does, as discs of point lights.  With no samples requested, area lights
+// keep one shadow ray each, and this estimates nothing.
+class AreaLightSampler {
+public:
+  // Constructors
+  AreaLightSampler(R3Scene *scene, const RenderOptions& options);
+
+  // Property functions
+  int NSamples(void) const { return nsamples; }
+  RNBoolean IsSampled(const R3Light *light) const;
+
+  // Estimate the light from all sampled lights reflected toward eye
+  RNRgb Estimate(const R3Brdf *brdf, const R3Point& eye, const R3Point& point,
+    const R3Vector& normal) const;
+
+private:
+  R3Scene *scene;
+  std::vector<R3AreaLight *> lights;
+  std::vector<RNScalar> cdf; // of light power, with cdf[0] = 0
+  int nsamples;
+  RNBoolean power_heuristic;
+};
+
+// Compute the irradiance at each of irradiance_photons (whose directions
+// are surface normals) from the photon maps, including one of photons
+// stored at their first hit, and store them in irradiance_photon_map
+int BuildIrradiancePhotonMap(R3Scene *scene, PhotonMap *direct_photon_map,
+  PhotonMap *global_photon_map, PhotonMap *caustic_photon_map,
+  std::vector<Photon>& irradiance_photons, PhotonMap *irradiance_photon_map,
+  const RenderOptions& options);
 
+// Render an image, final gathering from irradiance_photon_map (if any).
+// Progressive rendering accumulates one sample per pixel per pass,
+// writing snapshots of the passes so far as requested, and stops early
+// (after at least one pass) when the time budget runs out.  Adaptive
+// rendering is progressive, but only samples pixels whose 95% confidence
+// interval is still wider than the threshold, until the budget of
+// num_samples per pixel is spent.  The wavefront integrator traces the
+// same paths as the recursive one, but breadth first over queues of path
+// states, so that each stage runs over sorted batches of rays or queries.
 R2Image *RenderImage(R3Scene *scene, PhotonMap *global_photon_map,
-  PhotonMap *caustic_photon_map, int num_nearest_photons,
-  int specular_exponent, int num_samples, int width, int height,
-  int print_verbose);
+  PhotonMap *caustic_photon_map, PhotonMap *irradiance_photon_map,
+  const RenderOptions& options);
+
+// Progressive photon mapping (Hachisuka et al. 2008, with the radius
+// update of stochastic PPM): eye paths are traced once, to the first
+// diffuse surface seen by each pixel sample, where a visible point
+// accumulates photon flux from any number of photon passes while its
+// gather radius shrinks.  Only one pass of photons needs to be in memory.
+class ProgressivePhotonMap {
+public:
+  // Constructors: trace eye paths, starting every visible point with a
+  // gather radius of initial_radius
+  ProgressivePhotonMap(R3Scene *scene, RNLength initial_radius, const RenderOptions& options);
+
+  // Property functions
+  int NPasses(void) const { return npasses; }
+  int NVisiblePoints(void) const;
+
+  // Manipulation functions: add a pass of photons that carry indirect
+  // light (each light's power divided by the photons it emitted in the
+  // pass), after which the photons may be discarded
+  void AddPass(const PhotonMap& photon_map);
+
+  // Create an image of the passes added so far
+  R2Image *Image(void) const;
+
+private:
+  struct VisiblePoint {
+    R3Point position;
+    R3Vector normal;         // on the side facing the eye
+    RNRgb weight;            // path throughput times diffuse reflectance
+    RNScalar radius_squared; // gather radius (zero if no diffuse surface)
+    RNScalar count;          // photons gathered, scaled by radius updates
+    RNRgb flux;              // unnormalized flux within radius
+  };
+
+  void TraceEyePath(const R3Ray& ray, RNRgb *color, VisiblePoint *point) const;
+
+  R3Scene *scene;
+  RenderOptions options;
+  AreaLightSampler area_lights;
+  int npasses;
+  std::vector<RNRgb> colors;         // emitted and direct light, per pixel
+  std::vector<VisiblePoint> points;  // num_samples per pixel
+};
 
 #endif
@@ -0,0 +1,227 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "sampler.h"
+
+// Largest double below one, to which numbers drawn are clamped
+static const RNScalar ONE_MINUS_EPSILON = 0x1.fffffffffffffp-1;
+
+// Bases of the dimensions of Halton samples (dimensions beyond them are
+// padded with scrambled base 2 sequences)
+static const int HALTON_PRIMES[] = {
+  2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+  59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+static const int HALTON_NPRIMES = sizeof(HALTON_PRIMES) / sizeof(HALTON_PRIMES[0]);
+
+// Mix the bits of x (Wellons' lowbias32 hash)
+static unsigned int Hash(unsigned int x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+// Return a hash of seed and value
+static unsigned int HashCombine(unsigned int seed, unsigned int value)
+{
+  return Hash(seed ^ (value + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+// Return a number in [0, 1) from the bits of x
+static RNScalar UnitScalar(unsigned int x)
+{
+  return std::min(x * 0x1p-32, ONE_MINUS_EPSILON);
+}
+
+static unsigned int ReverseBits(unsigned int x)
+{
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+  x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+  x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+  x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+  return x;
+}
+
+// Return element i of a random permutation of [0, n) chosen by seed
+// (Kensler's hash-based permutation)
+static unsigned int PermutationElement(unsigned int i, unsigned int n, unsigned int seed)
+{
+  unsigned int w = n - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= seed;
+    i *= 0xe170893dU;
+    i ^= seed >> 16;
+    i ^= (i & w) >> 4;
+    i ^= seed >> 8;
+    i *= 0x0929eb3fU;
+    i ^= seed >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | seed >> 27;
+    i *= 0x6935fa69U;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303U;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3U;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3dfU;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= n);
+  return (i + seed) % n;
+}
+
+// Owen-scramble the bits of a base 2 fraction x, flipping each bit by a
+// hash of the bits above it (Burley's hash-based nested uniform scramble,
+// with the Laine-Karras permutation)
+static unsigned int NestedUniformScramble(unsigned int x, unsigned int seed)
+{
+  x = ReverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cU;
+  x ^= x * 0xb82f1e52U;
+  x ^= x * 0xc7afe638U;
+  x ^= x * 0x8d22f6e6U;
+  return ReverseBits(x);
+}
+
+// Return the first two dimensions of Sobol point i, as base 2 fractions
+static void SobolPoint(unsigned int i, unsigned int *x, unsigned int *y)
+{
+  *x = ReverseBits(i);
+  *y = 0;
+  for (unsigned int v = 1U << 31; i; i >>= 1, v ^= v >> 1) {
+    if (i & 1) *y ^= v;
+  }
+}
+
+// Return the radical inverse of a in the given base, with the digits
+// permuted by a hash of the digits before them (Owen scrambling)
+static RNScalar OwenScrambledRadicalInverse(int base, unsigned int a, unsigned int seed)
+{
+  const unsigned long long limit = ~0ULL / base - base;
+  RNScalar inverse_base = 1.0 / base;
+  RNScalar inverse_base_power = 1;
+  unsigned long long reversed_digits = 0;
+  while ((1 - inverse_base_power < 1) && (reversed_digits < limit)) {
+    unsigned int next = a / base;
+    unsigned int digit = a - next * base;
+    unsigned int digit_seed = HashCombine(seed, (unsigned int) (reversed_digits ^ (reversed_digits >> 32)));
+    digit = PermutationElement(digit, base, digit_seed);
+    reversed_digits = reversed_digits * base + digit;
+    inverse_base_power *= inverse_base;
+    a = next;
+  }
+  return std::min(inverse_base_power * reversed_digits, ONE_MINUS_EPSILON);
+}
+
+int ParseSamplerType(const char *name, SamplerType *type)
+{
+  if (!strcmp(name, "independent")) *type = INDEPENDENT_SAMPLER;
+  else if (!strcmp(name, "stratified")) *type = STRATIFIED_SAMPLER;
+  else if (!strcmp(name, "halton")) *type = HALTON_SAMPLER;
+  else if (!strcmp(name, "sobol")) *type = SOBOL_SAMPLER;
+  else return 0;
+  return 1;
+}
+
+Sampler::Sampler(SamplerType type, int nsamples, unsigned int seed)
+  : type(type),
+    nsamples(std::max(nsamples, 1)),
+    seed(Hash(seed)),
+    sequence(0),
+    sample(0),
+    dimension(0)
+{
+}
+
+void Sampler::StartSample(unsigned int sequence_, unsigned int sample_, unsigned int dimension_)
+{
+  sequence = sequence_;
+  sample = sample_;
+  dimension = dimension_;
+}
+
+RNScalar Sampler::Next1D(void)
+{
+  if (type == INDEPENDENT_SAMPLER) return RNRandomScalar();
+  unsigned int hash = HashCombine(HashCombine(seed, sequence), dimension);
+  RNScalar u = 0;
+  switch (type) {
+    case STRATIFIED_SAMPLER: {
+      // Jitter within the stratum that the sample gets in this dimension
+      // (strata are dealt again every nsamples samples)
+      unsigned int round = sample / nsamples;
+      unsigned int permutation_seed = HashCombine(hash, round);
+      unsigned int stratum = PermutationElement(sample % nsamples, nsamples, permutation_seed);
+      RNScalar jitter = UnitScalar(HashCombine(permutation_seed, sample));
+      u = std::min((stratum + jitter) / nsamples, ONE_MINUS_EPSILON);
+      break;
+    }
+    case HALTON_SAMPLER:
+      if (dimension < (unsigned int) HALTON_NPRIMES) {
+        u = OwenScrambledRadicalInverse(HALTON_PRIMES[dimension], sample, hash);
+        break;
+      }
+      // Fall through to pad with scrambled base 2 sequences
+    default: {
+      unsigned int index = NestedUniformScramble(sample, hash);
+      u = UnitScalar(NestedUniformScramble(ReverseBits(index), Hash(hash ^ 0xa511e9b3U)));
+      break;
+    }
+  }
+  dimension++;
+  return u;
+}
+
+void Sampler::Next2D(RNScalar *u1, RNScalar *u2)
+{
+  // Draw the two numbers one at a time if the sequence is not 2D
+  if ((type == INDEPENDENT_SAMPLER) ||
+      ((type == HALTON_SAMPLER) && (dimension + 1 < (unsigned int) HALTON_NPRIMES))) {
+    *u1 = Next1D();
+    *u2 = Next1D();
+    return;
+  }
+
+  unsigned int hash = HashCombine(HashCombine(seed, sequence), dimension);
+  if (type == STRATIFIED_SAMPLER) {
+    // Jitter within the cell of an nx by ny grid that the sample gets
+    // (using nsamples of the cells if the grid has more)
+    int nx = std::max((int) sqrt((double) nsamples), 1);
+    int ny = (nsamples + nx - 1) / nx;
+    unsigned int round = sample / nsamples;
+    unsigned int permutation_seed = HashCombine(hash, round);
+    unsigned int cell = PermutationElement(sample % nsamples, nx * ny, permutation_seed);
+    RNScalar jitter1 = UnitScalar(HashCombine(permutation_seed, 2 * sample));
+    RNScalar jitter2 = UnitScalar(HashCombine(permutation_seed, 2 * sample + 1));
+    *u1 = std::min((cell % nx + jitter1) / nx, ONE_MINUS_EPSILON);
+    *u2 = std::min((cell / nx + jitter2) / ny, ONE_MINUS_EPSILON);
+  }
+  else {
+    // Take the first two Sobol dimensions at a shuffled index, and
+    // scramble each (Burley's padding of Owen-scrambled Sobol points)
+    unsigned int index = NestedUniformScramble(sample, hash);
+    unsigned int x, y;
+    SobolPoint(index, &x, &y);
+    *u1 = UnitScalar(NestedUniformScramble(x, Hash(hash ^ 0xa511e9b3U)));
+    *u2 = UnitScalar(NestedUniformScramble(y, Hash(hash ^ 0x63d83595U)));
+  }
+  dimension += 2;
+}
+
+Sampler& ThreadSampler(void)
+{
+  static thread_local Sampler sampler;
+  return sampler;
+}
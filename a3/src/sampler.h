@@ -0,0 +1,62 @@
+// Include file for the sample generators
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "R3Graphics/R3Graphics.h"
+
+// Kinds of sample sequences
+enum SamplerType {
+  INDEPENDENT_SAMPLER, // RNRandomScalar, as all random decisions used to be
+  STRATIFIED_SAMPLER,  // jittered strata, shuffled per dimension
+  HALTON_SAMPLER,      // Owen-scrambled radical inverses in prime bases
+  SOBOL_SAMPLER        // Owen-scrambled Sobol points, padded in 2D blocks
+};
+
+// Parse the name of a sampler type (returns 0 if unknown)
+int ParseSamplerType(const char *name, SamplerType *type);
+
+// A generator of the random numbers of one sample (a pixel sample or an
+// emitted photon).  Samples are indexed by the sequence they belong to
+// (a pixel, or a light), their number within it and the dimension of
+// each number drawn, so the numbers of a sample do not depend on the
+// order in which samples are taken.  Numbers of the same dimension over
+// the samples of a sequence are stratified, or are a low-discrepancy
+// sequence, so that consecutive dimensions drawn together by Next2D
+// cover the square well.  Each sequence is scrambled differently.  The
+// independent sampler ignores indices and draws from RNRandomScalar, so
+// it consumes the thread's random stream exactly as direct calls do.
+class Sampler {
+public:
+  // Constructors (nsamples is the number of samples expected per
+  // sequence, over which the stratified sampler spreads its strata)
+  Sampler(SamplerType type = INDEPENDENT_SAMPLER, int nsamples = 1, unsigned int seed = 0);
+
+  // Property functions
+  SamplerType Type(void) const { return type; }
+
+  // Start drawing the numbers of a sample, from the given dimension
+  void StartSample(unsigned int sequence, unsigned int sample, unsigned int dimension = 0);
+
+  // Draw the number(s) of the next dimension(s) of the sample
+  RNScalar Next1D(void);
+  void Next2D(RNScalar *u1, RNScalar *u2);
+
+private:
+  SamplerType type;
+  int nsamples;
+  unsigned int seed;
+  unsigned int sequence;
+  unsigned int sample;
+  unsigned int dimension;
+};
+
+// Return the sampler that the random decisions of the calling thread draw
+// from (an independent sampler until assigned)
+Sampler& ThreadSampler(void);
+
+// Draw the next numbers from the sampler of the calling thread
+inline RNScalar Sample1D(void) { return ThreadSampler().Next1D(); }
+inline void Sample2D(RNScalar *u1, RNScalar *u2) { ThreadSampler().Next2D(u1, u2); }
+
+#endif
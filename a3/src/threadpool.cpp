@@ -0,0 +1,83 @@
+#include <thread>
+
+#include "threadpool.h"
+
+int DefaultThreadCount(void)
+{
+  int nthreads = (int) std::thread::hardware_concurrency();
+  return (nthreads > 0) ? nthreads : 1;
+}
+
+ThreadPool::ThreadPool(int nthreads_)
+  : nthreads((nthreads_ > 0) ? nthreads_ : DefaultThreadCount()),
+    queues(nthreads)
+{
+}
+
+void ThreadPool::Run(int ntasks, const std::function<void(int, int)>& task)
+{
+  if (ntasks <= 0) return;
+
+  // Deal out contiguous blocks of tasks, so that each thread starts on
+  // neighboring tasks (e.g., adjacent image tiles)
+  for (int t = 0; t < nthreads; t++) {
+    int first = (int) ((long long) ntasks * t / nthreads);
+    int last = (int) ((long long) ntasks * (t + 1) / nthreads);
+    for (int i = first; i < last; i++) {
+      queues[t].tasks.push_back(i);
+    }
+  }
+
+  // Run on the calling thread alone if there is nothing to share
+  if (nthreads == 1) {
+    Work(0, task);
+    return;
+  }
+
+  // Spawn workers and wait for them to drain all queues
+  std::vector<std::thread> workers;
+  for (int t = 1; t < nthreads; t++) {
+    workers.push_back(std::thread(&ThreadPool::Work, this, t, std::cref(task)));
+  }
+  Work(0, task);
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+}
+
+void ThreadPool::Work(int thread_index, const std::function<void(int, int)>& task)
+{
+  while (true) {
+    int task_index = PopTask(thread_index);
+    if (task_index < 0) task_index = StealTask(thread_index);
+    if (task_index < 0) return; // No work left anywhere
+    task(task_index, thread_index);
+  }
+}
+
+int ThreadPool::PopTask(int thread_index)
+{
+  // Take the next task from the front of this thread's own queue
+  TaskQueue& queue = queues[thread_index];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty()) return -1;
+  int task_index = queue.tasks.front();
+  queue.tasks.pop_front();
+  return task_index;
+}
+
+int ThreadPool::StealTask(int thread_index)
+{
+  // Take a task from the back of another thread's queue, i.e., the task
+  // furthest from the one its owner is currently working on
+  for (int k = 1; k < nthreads; k++) {
+    TaskQueue& victim = queues[(thread_index + k) % nthreads];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (victim.tasks.empty()) continue;
+    int task_index = victim.tasks.back();
+    victim.tasks.pop_back();
+    return task_index;
+  }
+
+  return -1;
+}
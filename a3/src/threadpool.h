@@ -0,0 +1,42 @@
+// Include file for the work-stealing thread pool
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Number of threads to use when none is requested
+int DefaultThreadCount(void);
+
+class ThreadPool {
+public:
+  // Constructors (nthreads <= 0 means one thread per hardware core)
+  ThreadPool(int nthreads = 0);
+
+  // Property functions
+  int NThreads(void) const { return nthreads; }
+
+  // Execute task(task_index, thread_index) for every task_index in
+  // [0, ntasks), returning when all tasks have completed.  Each thread
+  // starts with a contiguous block of tasks and steals from the other
+  // threads' queues once its own queue runs dry.
+  void Run(int ntasks, const std::function<void(int, int)>& task);
+
+private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<int> tasks;
+  };
+
+  void Work(int thread_index, const std::function<void(int, int)>& task);
+  int PopTask(int thread_index);
+  int StealTask(int thread_index);
+
+  int nthreads;
+  std::vector<TaskQueue> queues;
+};
+
+#endif
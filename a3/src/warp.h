@@ -0,0 +1,81 @@
+// Include file for the functions warping samples of the unit square
+
+#ifndef WARP_H
+#define WARP_H
+
+#include <algorithm>
+#include <cmath>
+
+#include "R3Graphics/R3Graphics.h"
+
+// Orthonormal basis (u, v, w) about a unit vector w, built without
+// branches or trigonometry (Duff et al. 2017), for turning directions
+// sampled about +z into directions about w.  Build it once per surface
+// hit and reuse it for all the directions sampled there.
+class OrthonormalBasis {
+public:
+  // Constructors (w must be normalized)
+  OrthonormalBasis(const R3Vector& w);
+
+  // Return the world direction with local coordinates (x, y, z)
+  R3Vector ToWorld(const R3Vector& local) const {
+    return local.X() * u + local.Y() * v + local.Z() * w;
+  }
+
+private:
+  R3Vector u, v, w;
+};
+
+inline OrthonormalBasis::OrthonormalBasis(const R3Vector& w_)
+  : w(w_)
+{
+  RNScalar sign = copysign(1.0, w.Z());
+  RNScalar a = -1.0 / (sign + w.Z());
+  RNScalar b = w.X() * w.Y() * a;
+  u = R3Vector(1.0 + sign * w.X() * w.X() * a, sign * b, -sign * w.X());
+  v = R3Vector(b, sign + w.Y() * w.Y() * a, -w.Y());
+}
+
+// Return a direction about +z with density cos(theta) / pi
+inline R3Vector CosineHemisphereSample(RNScalar u1, RNScalar u2)
+{
+  RNScalar r = sqrt(u1);
+  RNAngle phi = 2.0 * RN_PI * u2;
+  return R3Vector(r * cos(phi), r * sin(phi), sqrt(std::max(0.0, 1.0 - u1)));
+}
+
+// Return a direction about +z with density (e + 1) / (2 pi) cos^e(theta)
+inline R3Vector PhongLobeSample(RNScalar u1, RNScalar u2, RNScalar exponent)
+{
+  RNScalar cos_theta = pow(u1, 1.0 / (exponent + 1.0));
+  RNScalar sin_theta = sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+  RNAngle phi = 2.0 * RN_PI * u2;
+  return R3Vector(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+// Return a direction about +z whose elevation above the xy plane has
+// cosine u1^(1 / (e + 1)), the distribution that eye rays and photons
+// have always sampled specular bounces about the normal from (the yaw of
+// R3Vector(pitch, yaw) being an elevation)
+inline R3Vector SpecularBounceSample(RNScalar u1, RNScalar u2, RNScalar exponent)
+{
+  RNScalar r = pow(u1, 1.0 / (exponent + 1.0));
+  RNAngle phi = 2.0 * RN_PI * u2;
+  return R3Vector(r * cos(phi), r * sin(phi), sqrt(std::max(0.0, 1.0 - r * r)));
+}
+
+// Map a point of the unit square to the unit disc, preserving area and
+// the stratification of the square (Shirley and Chiu's concentric map)
+inline void ConcentricDiscSample(RNScalar u1, RNScalar u2, RNScalar *x, RNScalar *y)
+{
+  RNScalar a = 2 * u1 - 1;
+  RNScalar b = 2 * u2 - 1;
+  if ((a == 0) && (b == 0)) { *x = *y = 0; return; }
+  RNScalar r, phi;
+  if (fabs(a) > fabs(b)) { r = a; phi = (RN_PI / 4) * (b / a); }
+  else { r = b; phi = (RN_PI / 2) - (RN_PI / 4) * (a / b); }
+  *x = r * cos(phi);
+  *y = r * sin(phi);
+}
+
+#endif